@@ -0,0 +1,268 @@
+#ifndef __EXTERNAL_SORTER__HEADER__
+#define __EXTERNAL_SORTER__HEADER__
+
+#include "../../include/RecordModel.h"
+#include "MmapFile.h"
+#include <stdlib.h>     // mkstemp
+#include <stdio.h>      // snprintf
+#include <unistd.h>     // close, unlink
+#include <limits.h>     // PATH_MAX
+#include <pthread.h>    // pthread_rwlock_t
+#include <algorithm>    // std::push_heap, std::pop_heap
+#include <limits>       // std::numeric_limits
+#include <vector>       // std::vector
+
+/*
+ * Sorts any number of records of a model with bounded memory.
+ *
+ * Records are collected in an array of "run_size" records. Whenever it is
+ * full, it is sorted and written out as a run, a temporary MmapFile within
+ * "tmp_dir". The files are unlinked right after creation, so they vanish
+ * once closed (or if the process dies). After finish(), next() returns all
+ * records in sorted order by merging the runs (k-way, using a heap over the
+ * heads of the runs).
+ *
+ * The runs are read through their mappings, so the kernel pages them in and
+ * out as needed, and the records returned by next() stay valid as long as
+ * the sorter exists.
+ *
+ * Sorts by "keys" (NULL terminated, default: the keys of the model), which
+ * can be any fields.
+ */
+class ExternalSorter
+{
+  struct Run
+  {
+    MmapFile *file;
+    const char *base;
+    size_t n;
+    size_t pos;
+  };
+
+  /*
+   * Orders run indices by their current record, smallest on top of the heap.
+   */
+  struct HeadGreater
+  {
+    ExternalSorter *sorter;
+
+    bool operator()(size_t a, size_t b) const
+    {
+      return (RecordModelInstance::compare_keys_ptr2(&sorter->keys[0], sorter->head(a), sorter->head(b)) > 0);
+    }
+  };
+
+  RecordModel *model;
+  std::vector<RM_Type*> keys;
+  char *tmp_dir;
+  size_t run_size;
+
+  RecordModelInstanceArray buf;
+  std::vector<Run> runs;
+  std::vector<size_t> heap;
+  size_t _entries;
+  bool merging;
+
+  // MmapFile needs one. runs are never expanded, so it is never taken.
+  pthread_rwlock_t rwlock;
+
+public:
+
+  ExternalSorter(RecordModel *model, RM_Type **keys, const char *tmp_dir, size_t run_size)
+  {
+    this->model = model;
+    for (int i = 0; keys && keys[i] != NULL; ++i)
+    {
+      this->keys.push_back(keys[i]);
+    }
+    for (int i = 0; !keys && model->_keys[i] != NULL; ++i)
+    {
+      this->keys.push_back(model->_keys[i]);
+    }
+    this->keys.push_back(NULL);
+
+    this->tmp_dir = strdup(tmp_dir);
+
+    // a run is sorted with RecordModelInstanceArray::sort (SORT_IDX)
+    if (run_size > std::numeric_limits<RecordModelInstanceArray::SORT_IDX>::max())
+      run_size = std::numeric_limits<RecordModelInstanceArray::SORT_IDX>::max();
+    this->run_size = run_size;
+
+    this->_entries = 0;
+    this->merging = false;
+    buf.model = model;
+    pthread_rwlock_init(&rwlock, NULL);
+  }
+
+  ~ExternalSorter()
+  {
+    for (size_t r = 0; r < runs.size(); ++r)
+    {
+      runs[r].file->close();
+      delete runs[r].file;
+    }
+    free(tmp_dir);
+    pthread_rwlock_destroy(&rwlock);
+  }
+
+  size_t entries() const { return _entries; }
+  size_t num_runs() const { return runs.size(); }
+  bool is_merging() const { return merging; }
+  RecordModel *get_model() const { return model; }
+
+  /*
+   * True if sorting by "other" (NULL terminated).
+   */
+  bool sorts_by(RM_Type **other)
+  {
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+      if (keys[i] != other[i]) return false;
+    }
+    return true;
+  }
+
+  /*
+   * Returns false if writing a run failed.
+   */
+  bool add(const RecordModelInstance *rec)
+  {
+    assert(!merging);
+    assert(rec->model == model);
+
+    if (!buf._ptr && !buf.allocate(run_size))
+      return false;
+
+    // a mapped buffer can hold more than "run_size" records
+    if ((buf.full() || buf.entries() >= run_size) && !spill())
+      return false;
+
+    if (!buf.push(rec))
+      return false;
+    ++_entries;
+    return true;
+  }
+
+  bool add_array(RecordModelInstanceArray *arr)
+  {
+    RecordModelInstance rec(model, NULL);
+    for (size_t i = 0; i < arr->entries(); ++i)
+    {
+      rec._ptr = arr->ptr_at(i);
+      if (!add(&rec))
+        return false;
+    }
+    return true;
+  }
+
+  /*
+   * Writes the last run and starts merging. No more records can be added.
+   * Returns false if writing the run failed.
+   */
+  bool finish()
+  {
+    assert(!merging);
+
+    if (!buf.empty() && !spill())
+      return false;
+
+    // the runs hold everything now, give back the memory of the buffer
+    RecordModelInstanceArray empty;
+    std::swap(buf._ptr, empty._ptr);
+    std::swap(buf._mapped, empty._mapped);
+    std::swap(buf._capacity, empty._capacity);
+
+    HeadGreater cmp = {this};
+    for (size_t r = 0; r < runs.size(); ++r)
+    {
+      if (runs[r].n > 0)
+        heap.push_back(r);
+    }
+    std::make_heap(heap.begin(), heap.end(), cmp);
+
+    merging = true;
+    return true;
+  }
+
+  /*
+   * Returns the next record in sorted order, or NULL at the end.
+   */
+  const void *next()
+  {
+    assert(merging);
+
+    if (heap.empty())
+      return NULL;
+
+    HeadGreater cmp = {this};
+    std::pop_heap(heap.begin(), heap.end(), cmp);
+    size_t r = heap.back();
+    const void *rec = head(r);
+
+    if (++runs[r].pos < runs[r].n)
+      std::push_heap(heap.begin(), heap.end(), cmp);
+    else
+      heap.pop_back();
+
+    return rec;
+  }
+
+private:
+
+  inline const void *head(size_t r) const
+  {
+    const Run &run = runs[r];
+    return run.base + run.pos * model->size();
+  }
+
+  /*
+   * Sorts the collected records and writes them out as a new run.
+   */
+  bool spill()
+  {
+    size_t n = buf.entries();
+    size_t sz = model->size();
+
+    buf.sort(&keys[0]);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/rm_sort_XXXXXX", tmp_dir);
+    int fd = mkstemp(path);
+    if (fd == -1)
+      return false;
+    ::close(fd);
+
+    MmapFile *file = new MmapFile(&rwlock);
+    bool ok = file->open(path, 0, n * sz, false);
+    unlink(path);
+    if (!ok)
+    {
+      delete file;
+      return false;
+    }
+
+    char *dst = (char*)file->ptr_append(n * sz);
+    if (!dst)
+    {
+      file->close();
+      delete file;
+      return false;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+      memcpy(dst + i * sz, buf.ptr_at(i), sz);
+    }
+
+    Run run;
+    run.file = file;
+    run.base = (const char*)file->ptr_read_at(0, n * sz);
+    run.n = n;
+    run.pos = 0;
+    runs.push_back(run);
+
+    buf.reset();
+    return true;
+  }
+};
+
+#endif
@@ -1,8 +1,13 @@
 #include <assert.h> // assert
 #include <stdio.h> // snprintf 
 #include <strings.h> // bzero
+#include <alloca.h> // alloca
 #include "../../include/RecordModel.h"
+#include "../../include/RM_Sketch.h"
+#include "../../include/IngestPipeline.h"
+#include "../../include/RM_ColumnArray.h"
 #include "MmapFile.h"
+#include "ExternalSorter.h"
 #include "ruby.h"
 #include <pthread.h>
 #include <set> // std::set
@@ -13,6 +18,10 @@
 extern RecordModel* get_RecordModel(VALUE);
 extern RecordModelInstance* get_RecordModelInstance(VALUE);
 extern RecordModelInstanceArray* get_RecordModelInstanceArray(VALUE);
+extern bool is_RecordModelInstanceColumnArray(VALUE);
+extern RecordModelInstanceColumnArray* get_RecordModelInstanceColumnArray(VALUE);
+extern AutoFileReader* get_AutoFileReader(VALUE);
+extern RM_ParsePlan *make_parse_plan(RecordModel*, VALUE, VALUE);
 
 /*
  * A database consists of:
@@ -43,6 +52,21 @@ extern RecordModelInstanceArray* get_RecordModelInstanceArray(VALUE);
  * so we can skip a whole slice if one value range has no intersection with the
  * query range.
  *
+ * The optional "hll" file (e.g. "hll_8192") stores one HyperLogLog sketch
+ * (RM_HyperLogLog::NUM_REGISTERS bytes) per key and slice. Slices which are
+ * completely covered by a query range are answered from it by
+ * query_distinct. As hashing every key of every record slows down put_bulk
+ * considerably, it is only maintained if the database is opened with "hll"
+ * set. Slices stored without it get their sketches rebuilt upon the next
+ * (writable) open with "hll". If opened readonly, or without "hll", we simply
+ * fall back to scanning.
+ *
+ * Likewise, the "sums" file (e.g. "sums_52") stores one complete RecordModel
+ * instance per slice, holding the sum of each numeric value field over the
+ * slice (keys and non-numeric values are zero). Together with the slice length
+ * this answers count and sum queries for completely covered slices without
+ * touching the key and data files.
+ *
  * Thread safetly:
  *
  * It is safe to use the methods "put_bulk", "commit" and "query_all"
@@ -58,6 +82,8 @@ private:
 
   MmapFile *db_slices;
   MmapFile *db_minmax;
+  MmapFile *db_hll; // optional. NULL if not available
+  MmapFile *db_sums; // optional. NULL if not available
   MmapFile *db_data;
   MmapFile **db_keys;
   size_t num_keys;
@@ -75,6 +101,8 @@ public:
     model = NULL;
     db_slices = NULL;
     db_minmax = NULL;
+    db_hll = NULL;
+    db_sums = NULL;
     db_data = NULL;
     db_keys = NULL;
     num_keys = 0;
@@ -92,10 +120,12 @@ public:
     pthread_rwlock_destroy(&rwlock);
   }
 
+  bool is_readonly() const { return readonly; }
+
   /*
    * Note that path_prefix must include the trailing '/' if you want to store the databases under it's own directory.
    */
-  bool open(RecordModel *_model, const char *path_prefix, size_t _num_slices, size_t _hint_slices, size_t _num_records, size_t _hint_records, bool _readonly)
+  bool open(RecordModel *_model, const char *path_prefix, size_t _num_slices, size_t _hint_slices, size_t _num_records, size_t _hint_records, bool _readonly, bool _hll=false)
   {
     using namespace std;
 
@@ -144,6 +174,28 @@ public:
       if (!ok) goto fail;
     }
 
+    // open hll file
+    if (_hll)
+    {
+      snprintf(name, name_sz, "%shll_%ld", path_prefix, hll_slice_size());
+      db_hll = open_slice_meta(name, hll_slice_size(), _hint_slices, ok);
+      if (!ok) goto fail;
+      if (db_hll && db_hll->size() < hll_slice_size()*num_slices)
+      {
+        rebuild_hll();
+      }
+    }
+
+    // open sums file
+    snprintf(name, name_sz, "%ssums_%ld", path_prefix, model->size());
+    db_sums = open_slice_meta(name, model->size(), _hint_slices, ok);
+    if (!ok) goto fail;
+    if (db_sums && db_sums->size() < model->size()*num_slices)
+    {
+      rebuild_sums();
+    }
+
+    free(name);
     return true;
 
   fail:
@@ -154,6 +206,18 @@ public:
 
   void close()
   {
+    if (db_hll)
+    {
+      db_hll->close();
+      delete db_hll;
+      db_hll = NULL;
+    }
+    if (db_sums)
+    {
+      db_sums->close();
+      delete db_sums;
+      db_sums = NULL;
+    }
     model = NULL;
     if (db_slices)
     {
@@ -215,6 +279,12 @@ public:
     if (!db_data->sync())
       goto end;
 
+    if (db_hll && !db_hll->sync())
+      goto end;
+
+    if (db_sums && !db_sums->sync())
+      goto end;
+
     for (size_t i = 0; i < num_keys; ++i)
     {
       if (!db_keys[i]->sync())
@@ -234,16 +304,39 @@ end:
   }
 
   /*
-   * XXX: Do not mix size_t and uint32_t
-   *
-   * We do an optimization, in that we store two records for each slice, the
-   * first containing the minimum over all records of that slice (on a per
-   * field basis), and the second the maximum. For example, if one slice
-   * contains only campaigns within 4000 and 5000, but we are looking for
-   * campaign 3000, we can completely skip this slice, while before, it
-   * depended upon the order of keys.
+   * The per slice meta data computed by prepare_bulk.
+   */
+  struct PreparedSlice
+  {
+    size_t n;
+    RecordModelInstance *min;
+    RecordModelInstance *max;
+    RecordModelInstance *sums; // NULL without db_sums
+    uint8_t *hll;              // NULL without db_hll
+  };
+
+  /*
+   * Stores "arr" as a new slice. This is prepare_bulk followed by
+   * store_bulk.
    */
   void put_bulk(RecordModelInstanceArray *arr, bool verify=false)
+  {
+    PreparedSlice *slice = prepare_bulk(arr, verify);
+    if (slice)
+    {
+      store_bulk(arr, slice);
+    }
+  }
+
+  /*
+   * First phase of put_bulk: Sorts "arr" and computes the meta data of the
+   * slice. It does not touch the database files, so any number of threads
+   * can prepare arrays while another one stores. Returns NULL for an empty
+   * array (nothing to store).
+   *
+   * XXX: Do not mix size_t and uint32_t
+   */
+  PreparedSlice *prepare_bulk(RecordModelInstanceArray *arr, bool verify=false)
   {
     assert(!readonly);
     assert(arr);
@@ -253,7 +346,7 @@ end:
 
     if (n == 0)
     {
-      return;
+      return NULL;
     }
 
     arr->sort();
@@ -271,40 +364,30 @@ end:
       }
     }
 
-    /*
-     * Determine the complete (on a per field basis) min/max.
-     */
-    RecordModelInstance *min = RecordModelInstance::allocate(model);
-    RecordModelInstance *max = RecordModelInstance::allocate(model);
-
-    void *min_ptr = min->ptr();
-    void *max_ptr = max->ptr();
-
-    // both min and max are set to the first element.
-    arr->copy_out(min, 0);
-    arr->copy_out(max, 0);
-
+    PreparedSlice *slice = begin_slice(arr->ptr_at(0));
     for (size_t i = 1; i < n; ++i)
     {
-      const void *cur_ptr = arr->ptr_at(i);
-      for (size_t k = 0; k < model->_num_fields; ++k)
-      {
-        RM_Type *field = model->_all_fields[k];
-
-	if (field->compare(cur_ptr, min_ptr) < 0)
-	{
-	  field->copy(min_ptr, cur_ptr);
-	}
-	if (field->compare(cur_ptr, max_ptr) > 0)
-	{
-	  field->copy(max_ptr, cur_ptr);
-	}
-      }
+      add_to_slice(slice, arr->ptr_at(i));
     }
 
+    return slice;
+  }
+
+  /*
+   * Second phase of put_bulk: Appends the prepared array "arr" as a new
+   * slice and frees "slice". "arr" must not be modified in between.
+   */
+  void store_bulk(RecordModelInstanceArray *arr, PreparedSlice *slice)
+  {
+    assert(!readonly);
+    assert(slice);
+    assert(slice->n == arr->entries());
+
+    size_t n = slice->n;
+
     /*
-     * There cannot be more than one thread calling put_bulk
-     * at the same time. Use a mutex to guarantee that.
+     * There cannot be more than one thread storing at the same time. Use a
+     * mutex to guarantee that.
      */
     int err = pthread_mutex_lock(&mutex);
     assert(!err);
@@ -315,12 +398,7 @@ end:
      * might acquire an exclusive rwlock lock. 
      */
 
-    // store the slice length
-    db_slices->append_value<uint32_t>(n);
-
-    // store min/max records
-    memcpy(db_minmax->ptr_append(model->size()), min_ptr, model->size());
-    memcpy(db_minmax->ptr_append(model->size()), max_ptr, model->size());
+    store_slice_meta(slice);
 
     // store key/data
     for (size_t i = 0; i < n; ++i)
@@ -334,180 +412,711 @@ end:
     err = pthread_mutex_unlock(&mutex);
     assert(!err);
 
-    RecordModelInstance::deallocate(min);
-    RecordModelInstance::deallocate(max);
+    free_slice(slice);
   }
 
-private:
+  /*
+   * put_bulk for columnar arrays. The columns are brought into sorted order
+   * (RecordModelInstanceColumnArray::apply_sort), so that each key column
+   * is stored with a single memcpy. Returns false if out of memory, then
+   * nothing is stored.
+   */
+  bool put_bulk(RecordModelInstanceColumnArray *arr)
+  {
+    if (arr->empty())
+    {
+      return true;
+    }
 
-  inline void store_record(void *rec_ptr)
+    PreparedSlice *slice = prepare_bulk(arr);
+    return (slice && store_bulk(arr, slice));
+  }
+
+  /*
+   * Returns NULL for an empty array, or if the columns could not be brought
+   * into sorted order (out of memory).
+   */
+  PreparedSlice *prepare_bulk(RecordModelInstanceColumnArray *arr)
   {
-    // copy data
-    for (size_t k = 0; k < model->_num_values; ++k)
+    assert(!readonly);
+    assert(arr);
+    assert(model == arr->model);
+
+    size_t n = arr->entries();
+
+    if (n == 0)
     {
-      RM_Type *field = model->_values[k];
-      field->copy_to_memory(rec_ptr, db_data->ptr_append(field->size())); 
+      return NULL;
     }
 
-    // copy keys
-    for (size_t k = 0; k < model->_num_keys; ++k)
+    arr->sort();
+    if (!arr->apply_sort())
     {
-      RM_Type *field = model->_keys[k];
-      field->copy_to_memory(rec_ptr, db_keys[k]->ptr_append(field->size())); 
+      return NULL;
     }
-  }
 
-public:
+    PreparedSlice *slice = new PreparedSlice;
+    slice->n = n;
+    slice->min = RecordModelInstance::allocate(model);
+    slice->max = RecordModelInstance::allocate(model);
 
-  // -----------------------------------------------
-  // Query support
-  // -----------------------------------------------
+    /*
+     * Determine the min/max of each column.
+     */
+    for (size_t k = 0; k < model->_num_fields; ++k)
+    {
+      RM_Type *field = model->_all_fields[k];
+      size_t sz = field->size();
+      const char *col = arr->column(k);
+      const char *min_mem = col;
+      const char *max_mem = col;
 
-  static const int ITER_CONTINUE;
-  static const int ITER_NEXT_SLICE;
-  static const int ITER_STOP;
+      for (size_t i = 1; i < n; ++i)
+      {
+        const char *cur = col + i * sz;
+        if (field->compare_memory(cur, min_mem) < 0) min_mem = cur;
+        if (field->compare_memory(cur, max_mem) > 0) max_mem = cur;
+      }
 
-private:
+      field->set_from_memory(slice->min->ptr(), min_mem);
+      field->set_from_memory(slice->max->ptr(), max_mem);
+    }
 
-  /*
-   * Compare the key we are looking for with the element at position 'index'.
-   */
-  inline int compare(const void *key_ptr, uint64_t index)
-  {
-    for (size_t i = 0; i < this->num_keys; ++i)
+    /*
+     * Sum up all numeric values.
+     */
+    slice->sums = NULL;
+    if (db_sums)
     {
-      RM_Type *field = model->_keys[i];
-      const void *b_ptr = this->db_keys[i]->ptr_read_element(index, field->size());
+      slice->sums = RecordModelInstance::allocate(model);
+      bzero(slice->sums->ptr(), model->size());
+      RecordModelInstance *cur = RecordModelInstance::allocate(model);
 
-      int cmp = field->compare_with_memory(key_ptr, b_ptr);
-      if (cmp != 0) return cmp;
+      for (size_t k = 0; k < model->_num_fields; ++k)
+      {
+        RM_Type *field = model->_all_fields[k];
+        if (!arr->is_value(k) || !field->is_numeric())
+          continue;
+        size_t sz = field->size();
+        const char *col = arr->column(k);
+        for (size_t i = 0; i < n; ++i)
+        {
+          field->set_from_memory(cur->ptr(), col + i * sz);
+          field->add(slice->sums->ptr(), cur->ptr());
+        }
+      }
+
+      RecordModelInstance::deallocate(cur);
     }
-    return 0;
-  }
 
-  void copy_keys_in(RecordModelInstance *rec, uint64_t index)
-  {
-    for (size_t i = 0; i < this->num_keys; ++i)
+    /*
+     * Compute the distinct count sketches of all keys. The columns already
+     * are in the layout copy_to_memory produces.
+     */
+    slice->hll = NULL;
+    if (db_hll)
     {
-      RM_Type *field = model->_keys[i];
-      const void *c = this->db_keys[i]->ptr_read_element(index, field->size());
-      field->set_from_memory(rec->ptr(), c);
+      slice->hll = (uint8_t*)calloc(1, hll_slice_size());
+      assert(slice->hll);
+
+      for (size_t k = 0; k < num_keys; ++k)
+      {
+        RM_Type *field = model->_keys[k];
+        size_t sz = field->size();
+        const char *col = arr->column(arr->field_index(field));
+        for (size_t i = 0; i < n; ++i)
+        {
+          RM_HyperLogLog::add_hash(slice->hll + k*RM_HyperLogLog::NUM_REGISTERS, RM_Hash::hash64(col + i * sz, sz));
+        }
+      }
     }
+
+    return slice;
   }
 
-  void copy_values_in(RecordModelInstance *rec, uint64_t index)
+  /*
+   * "arr" has to be in sorted order (done by prepare_bulk). Returns false
+   * and stores nothing if the columns were sorted again in between.
+   * "slice" is freed in any case.
+   */
+  bool store_bulk(RecordModelInstanceColumnArray *arr, PreparedSlice *slice)
   {
-    const void *c = this->db_data->ptr_read_element(index, model->size_values());
+    assert(!readonly);
+    assert(slice);
+    assert(slice->n == arr->entries());
 
-    for (size_t i = 0; i < model->_num_values; ++i)
+    if (arr->sort_arr != NULL)
     {
-      RM_Type *field = model->_values[i];
-      field->set_from_memory(rec->ptr(), c);
-      c = (const void*) (((const char*)c) + field->size());
+      free_slice(slice);
+      return false;
     }
-  }
 
-  int64_t bin_search(int64_t l, int64_t r, const void *key_ptr)
-  {
-    int64_t m;
+    size_t n = slice->n;
 
-    while (l < r)
-    {
-      m = l + (r - l) / 2;
+    int err = pthread_mutex_lock(&mutex);
+    assert(!err);
 
-      assert(l < r);
-      assert(l >= 0);
-      assert(r > 0);
-      assert(m >= 0);
-      assert(m >= l);
+    store_slice_meta(slice);
 
-      int c = compare(key_ptr, m);
-      if (c > 0)
-      {
-        /*
-         * key is > element[m]
-         *
-         * continue search in right half
-         */
-        l = m + 1;
-      }
-      else if (c < 0)
-      {
-        /*
-         * key is < element[m]
-         *
-         * continue search in left half
-         */
-        r = m - 1;
-      }
-      else
+    // the data file stores the values record by record
+    size_t data_size = 0;
+    for (size_t k = 0; k < model->_num_values; ++k)
+    {
+      data_size += model->_values[k]->size();
+    }
+    char *data = (char*)db_data->ptr_append(n * data_size);
+    for (size_t i = 0; i < n; ++i)
+    {
+      for (size_t k = 0; k < model->_num_values; ++k)
       {
-        assert (c == 0);
-        /*
-	 * key is == element[m]
-         *
-	 * as mulitple equal keys are allowed to exist, and we want to find the
-	 * first one, we continue in the left half but include the current
-	 * element.
-         */ 
-         r = m;
+        RM_Type *field = model->_values[k];
+        size_t sz = field->size();
+        memcpy(data, arr->column(arr->field_index(field)) + i * sz, sz);
+        data += sz;
       }
     }
-    return l;
-  }
 
-public:
+    // the key files store one column each
+    for (size_t k = 0; k < model->_num_keys; ++k)
+    {
+      RM_Type *field = model->_keys[k];
+      size_t len = n * field->size();
+      memcpy(db_keys[k]->ptr_append(len), arr->column(arr->field_index(field)), len);
+    }
 
-  struct iter_data
-  {
-    MMDB *db;
-    RecordModelInstance *current;
-    uint64_t cursor;
-    bool copy_values_in;
-  };
+    num_records += n;
+    ++num_slices;
 
-private:
+    err = pthread_mutex_unlock(&mutex);
+    assert(!err);
 
-  int query(uint64_t idx_from, uint64_t idx_to,
-            const RecordModelInstance *range_from, const RecordModelInstance *range_to,
-            int (*iterator)(iter_data*), iter_data *data)
-  {
-    assert(idx_from <= idx_to);
+    free_slice(slice);
+    return true;
+  }
 
-    // the code below is no longer neccessary, as we store a min/max records separately
-    #if 0
-    /*
-     * What we are looking for is completely out of bound.
-     *
-     * [range_from, range_to] ... [idx_from, idx_to]
-     */
-    if (compare(range_to->ptr(), idx_from) < 0)
-      return ITER_CONTINUE;
+  /*
+   * Stores the records of "sorter" (after ExternalSorter::finish, sorted by
+   * the keys of the model) in merged order as a single slice, or as several
+   * if there are more records than the length of a slice can express. Unlike
+   * put_bulk, the records never have to be in memory all at once.
+   *
+   * Other writers are blocked until all records are stored.
+   */
+  void put_sorted(ExternalSorter *sorter)
+  {
+    assert(!readonly);
+    assert(sorter->get_model() == model);
+    assert(sorter->is_merging());
 
-    /*
-     * What we are looking for is completely out of bound.
-     *
-     * [idx_from, idx_to] ... [range_from, range_to]
-     */
-    if (compare(range_from->ptr(), idx_to) > 0)
-      return ITER_CONTINUE;
-    #endif
+    const size_t max_slice = std::numeric_limits<uint32_t>::max();
 
-    /*
-     * Position our cursor using binary search
-     */ 
-    uint64_t cursor = bin_search(idx_from, idx_to, range_from->ptr());
+    int err = pthread_mutex_lock(&mutex);
+    assert(!err);
 
-    /*
-     * Linear scan from current position
-     */
-    while (cursor <= idx_to)
+    PreparedSlice *slice = NULL;
+    const void *rec;
+    while ((rec = sorter->next()) != NULL)
     {
-      copy_keys_in(data->current, cursor);
-     
-      int keypos;
-      int cmp = data->current->keys_in_range_pos(range_from, range_to, keypos);
-      if (cmp == 0)
+      if (slice)
+        add_to_slice(slice, rec);
+      else
+        slice = begin_slice(rec);
+
+      store_record((void*)rec);
+
+      if (slice->n == max_slice)
+      {
+        end_slice(slice);
+        slice = NULL;
+      }
+    }
+    if (slice)
+      end_slice(slice);
+
+    err = pthread_mutex_unlock(&mutex);
+    assert(!err);
+  }
+
+private:
+
+  /*
+   * Starts the meta data of a slice whose first record is "rec_ptr".
+   *
+   * We do an optimization, in that we store two records for each slice, the
+   * first containing the minimum over all records of that slice (on a per
+   * field basis), and the second the maximum. For example, if one slice
+   * contains only campaigns within 4000 and 5000, but we are looking for
+   * campaign 3000, we can completely skip this slice, while before, it
+   * depended upon the order of keys.
+   */
+  PreparedSlice *begin_slice(const void *rec_ptr)
+  {
+    PreparedSlice *slice = new PreparedSlice;
+    slice->n = 0;
+
+    // both min and max are set to the first element.
+    slice->min = RecordModelInstance::allocate(model);
+    slice->max = RecordModelInstance::allocate(model);
+    memcpy(slice->min->ptr(), rec_ptr, model->size());
+    memcpy(slice->max->ptr(), rec_ptr, model->size());
+
+    slice->sums = NULL;
+    if (db_sums)
+    {
+      slice->sums = RecordModelInstance::allocate(model);
+      bzero(slice->sums->ptr(), model->size());
+    }
+
+    slice->hll = NULL;
+    if (db_hll)
+    {
+      slice->hll = (uint8_t*)calloc(1, hll_slice_size());
+      assert(slice->hll);
+    }
+
+    add_to_slice(slice, rec_ptr);
+    return slice;
+  }
+
+  /*
+   * Accounts record "rec_ptr" in the meta data of "slice": the per field
+   * min/max, the sums of all numeric values and the distinct count sketches
+   * of all keys.
+   */
+  void add_to_slice(PreparedSlice *slice, const void *rec_ptr)
+  {
+    void *min_ptr = slice->min->ptr();
+    void *max_ptr = slice->max->ptr();
+
+    for (size_t k = 0; k < model->_num_fields; ++k)
+    {
+      RM_Type *field = model->_all_fields[k];
+
+      if (field->compare(rec_ptr, min_ptr) < 0)
+      {
+        field->copy(min_ptr, rec_ptr);
+      }
+      if (field->compare(rec_ptr, max_ptr) > 0)
+      {
+        field->copy(max_ptr, rec_ptr);
+      }
+    }
+
+    if (slice->sums)
+    {
+      RecordModelInstance cur(model, (void*)rec_ptr);
+      slice->sums->add_numeric_values(&cur);
+    }
+
+    if (slice->hll)
+    {
+      uint8_t buf[256];
+      for (size_t k = 0; k < num_keys; ++k)
+      {
+        RM_Type *field = model->_keys[k];
+        field->copy_to_memory(rec_ptr, buf);
+        RM_HyperLogLog::add_hash(slice->hll + k*RM_HyperLogLog::NUM_REGISTERS, RM_Hash::hash64(buf, field->size()));
+      }
+    }
+
+    ++slice->n;
+  }
+
+  /*
+   * Completes a slice whose records are stored already. Called with the
+   * mutex held.
+   */
+  void end_slice(PreparedSlice *slice)
+  {
+    store_slice_meta(slice);
+    num_records += slice->n;
+    ++num_slices;
+    free_slice(slice);
+  }
+
+  /*
+   * Appends the slice length and the per slice meta data. Called with the
+   * mutex held.
+   */
+  void store_slice_meta(PreparedSlice *slice)
+  {
+    // store the slice length
+    db_slices->append_value<uint32_t>(slice->n);
+
+    // store min/max records
+    memcpy(db_minmax->ptr_append(model->size()), slice->min->ptr(), model->size());
+    memcpy(db_minmax->ptr_append(model->size()), slice->max->ptr(), model->size());
+
+    if (slice->hll)
+    {
+      memcpy(db_hll->ptr_append(hll_slice_size()), slice->hll, hll_slice_size());
+    }
+
+    if (slice->sums)
+    {
+      memcpy(db_sums->ptr_append(model->size()), slice->sums->ptr(), model->size());
+    }
+  }
+
+  void free_slice(PreparedSlice *slice)
+  {
+    RecordModelInstance::deallocate(slice->min);
+    RecordModelInstance::deallocate(slice->max);
+    RecordModelInstance::deallocate(slice->sums);
+    free(slice->hll);
+    delete slice;
+  }
+
+  size_t hll_slice_size()
+  {
+    return num_keys * RM_HyperLogLog::NUM_REGISTERS;
+  }
+
+  /*
+   * Opens a file which stores "elem_size" bytes of meta data per slice, and
+   * which might not exist (or be incomplete) for databases created by older
+   * versions. "ok" is set to false on hard errors.
+   *
+   * Returns NULL if the file does not cover all slices and we are
+   * readonly. Otherwise, the returned file might cover less than num_slices
+   * slices and the caller has to rebuild (append) the missing ones.
+   */
+  MmapFile *open_slice_meta(const char *name, size_t elem_size, size_t hint_slices, bool &ok)
+  {
+    ok = true;
+
+    size_t valid_slices = 0;
+    struct stat st;
+    if (stat(name, &st) == 0 && st.st_size > 0)
+    {
+      valid_slices = std::min((size_t)st.st_size / elem_size, num_slices);
+    }
+
+    if (valid_slices < num_slices && readonly)
+    {
+      return NULL;
+    }
+
+    MmapFile *f = new MmapFile(&rwlock);
+    if (!f->open(name, elem_size*valid_slices, elem_size*hint_slices, readonly))
+    {
+      delete f;
+      if (!readonly) ok = false;
+      return NULL;
+    }
+    return f;
+  }
+
+  /*
+   * Computes the sums of all slices missing in the sums file.
+   */
+  void rebuild_sums()
+  {
+    assert(!readonly && db_sums);
+
+    RecordModelInstance *sums = RecordModelInstance::allocate(model);
+    RecordModelInstance *cur = RecordModelInstance::allocate(model);
+
+    size_t offs = 0;
+    for (size_t s = 0; s < num_slices; ++s)
+    {
+      uint32_t length = db_slices->ptr_read_element_at<uint32_t>(s);
+
+      if (s >= db_sums->size() / model->size())
+      {
+        bzero(sums->ptr(), model->size());
+        for (size_t i = offs; i < offs + length; ++i)
+        {
+          copy_values_in(cur, i);
+          sums->add_numeric_values(cur);
+        }
+        memcpy(db_sums->ptr_append(model->size()), sums->ptr(), model->size());
+      }
+
+      offs += length;
+    }
+
+    RecordModelInstance::deallocate(sums);
+    RecordModelInstance::deallocate(cur);
+  }
+
+  /*
+   * Computes the hll sketches of all slices missing in the hll file.
+   */
+  void rebuild_hll()
+  {
+    assert(!readonly && db_hll);
+
+    uint8_t *hll = (uint8_t*)malloc(hll_slice_size());
+    assert(hll);
+
+    size_t offs = 0;
+    for (size_t s = 0; s < num_slices; ++s)
+    {
+      uint32_t length = db_slices->ptr_read_element_at<uint32_t>(s);
+
+      if (s >= db_hll->size() / hll_slice_size())
+      {
+        bzero(hll, hll_slice_size());
+        for (size_t k = 0; k < num_keys; ++k)
+        {
+          RM_Type *field = model->_keys[k];
+          for (size_t i = offs; i < offs + length; ++i)
+          {
+            const void *mem = db_keys[k]->ptr_read_element(i, field->size());
+            RM_HyperLogLog::add_hash(hll + k*RM_HyperLogLog::NUM_REGISTERS, RM_Hash::hash64(mem, field->size()));
+          }
+        }
+        memcpy(db_hll->ptr_append(hll_slice_size()), hll, hll_slice_size());
+      }
+
+      offs += length;
+    }
+
+    free(hll);
+  }
+
+  inline void store_record(void *rec_ptr)
+  {
+    // copy data
+    for (size_t k = 0; k < model->_num_values; ++k)
+    {
+      RM_Type *field = model->_values[k];
+      field->copy_to_memory(rec_ptr, db_data->ptr_append(field->size())); 
+    }
+
+    // copy keys
+    for (size_t k = 0; k < model->_num_keys; ++k)
+    {
+      RM_Type *field = model->_keys[k];
+      field->copy_to_memory(rec_ptr, db_keys[k]->ptr_append(field->size())); 
+    }
+  }
+
+public:
+
+  // -----------------------------------------------
+  // Query support
+  // -----------------------------------------------
+
+  static const int ITER_CONTINUE;
+  static const int ITER_NEXT_SLICE;
+  static const int ITER_STOP;
+  static const int ITER_SCAN_SLICE; // only returned by covered_slice
+
+private:
+
+  /*
+   * Compare the key we are looking for with the element at position 'index'.
+   */
+  inline int compare(const void *key_ptr, uint64_t index)
+  {
+    for (size_t i = 0; i < this->num_keys; ++i)
+    {
+      RM_Type *field = model->_keys[i];
+      const void *b_ptr = this->db_keys[i]->ptr_read_element(index, field->size());
+
+      int cmp = field->compare_with_memory(key_ptr, b_ptr);
+      if (cmp != 0) return cmp;
+    }
+    return 0;
+  }
+
+  void copy_keys_in(RecordModelInstance *rec, uint64_t index)
+  {
+    for (size_t i = 0; i < this->num_keys; ++i)
+    {
+      RM_Type *field = model->_keys[i];
+      const void *c = this->db_keys[i]->ptr_read_element(index, field->size());
+      field->set_from_memory(rec->ptr(), c);
+    }
+  }
+
+  void copy_values_in(RecordModelInstance *rec, uint64_t index)
+  {
+    const void *c = this->db_data->ptr_read_element(index, model->size_values());
+
+    for (size_t i = 0; i < model->_num_values; ++i)
+    {
+      RM_Type *field = model->_values[i];
+      field->set_from_memory(rec->ptr(), c);
+      c = (const void*) (((const char*)c) + field->size());
+    }
+  }
+
+  int64_t bin_search(int64_t l, int64_t r, const void *key_ptr)
+  {
+    int64_t m;
+
+    while (l < r)
+    {
+      m = l + (r - l) / 2;
+
+      assert(l < r);
+      assert(l >= 0);
+      assert(r > 0);
+      assert(m >= 0);
+      assert(m >= l);
+
+      int c = compare(key_ptr, m);
+      if (c > 0)
+      {
+        /*
+         * key is > element[m]
+         *
+         * continue search in right half
+         */
+        l = m + 1;
+      }
+      else if (c < 0)
+      {
+        /*
+         * key is < element[m]
+         *
+         * continue search in left half
+         */
+        r = m - 1;
+      }
+      else
+      {
+        assert (c == 0);
+        /*
+	 * key is == element[m]
+         *
+	 * as mulitple equal keys are allowed to exist, and we want to find the
+	 * first one, we continue in the left half but include the current
+	 * element.
+         */ 
+         r = m;
+      }
+    }
+    return l;
+  }
+
+  /*
+   * Returns the index of the first element >= key within [l, r), or r if
+   * there is none.
+   */
+  uint64_t lower_bound(uint64_t l, uint64_t r, const void *key_ptr)
+  {
+    while (l < r)
+    {
+      uint64_t m = l + (r - l) / 2;
+      if (compare(key_ptr, m) > 0)
+        l = m + 1;
+      else
+        r = m;
+    }
+    return l;
+  }
+
+  /*
+   * Keeps track of the distances query_scan had to skip forward, so that
+   * skip_search can choose between a linear scan and a galloping search.
+   */
+  struct SkipState
+  {
+    uint64_t avg_dist;
+
+    SkipState() : avg_dist(SKIP_LINEAR_MAX) {}
+
+    void update(uint64_t dist)
+    {
+      avg_dist = (3*avg_dist + dist) / 4;
+    }
+  };
+
+  /*
+   * Max. number of records skip_search scans linearly, before it switches to
+   * a galloping search.
+   */
+  static const uint64_t SKIP_LINEAR_MAX = 8;
+
+  /*
+   * Positions the cursor at the first element >= key, searching forward from
+   * "l" up to "r" (inclusive). Returns r+1 if there is no such element.
+   *
+   * Instead of a binary search over the whole remainder of the slice (which
+   * is what dominates queries that do not constrain the leading key), we
+   * gallop forward from "l" (probing l, l+1, l+3, l+7, ...) and then
+   * binary search only within the last step. When the previous skips were
+   * short (a dense run of matching or nearly-matching records), we first try
+   * a few records linearly, which is cheaper than any kind of search.
+   */
+  uint64_t skip_search(uint64_t l, uint64_t r, const void *key_ptr, SkipState &state)
+  {
+    uint64_t cursor = l;
+
+    if (state.avg_dist < SKIP_LINEAR_MAX)
+    {
+      for (uint64_t n = 0; n < SKIP_LINEAR_MAX; ++n, ++cursor)
+      {
+        if (cursor > r || compare(key_ptr, cursor) <= 0)
+        {
+          state.update(cursor - l);
+          return cursor;
+        }
+      }
+    }
+
+    uint64_t lo = cursor;
+    uint64_t step = 1;
+    uint64_t hi = cursor;
+
+    while (hi <= r && compare(key_ptr, hi) > 0)
+    {
+      lo = hi + 1;
+      hi = lo + step;
+      step *= 2;
+    }
+
+    cursor = lower_bound(lo, std::min(hi, r + 1), key_ptr);
+    state.update(cursor - l);
+    return cursor;
+  }
+
+public:
+
+  struct iter_data
+  {
+    MMDB *db;
+    RecordModelInstance *current;
+    uint64_t cursor;
+    bool copy_values_in;
+
+    /*
+     * Optional. If set, it is called instead of scanning slice "slice" when
+     * the query range contains the whole min/max range of the slice, i.e.
+     * when all "length" records starting at "offs" match. Returning
+     * ITER_SCAN_SLICE falls back to scanning the slice.
+     */
+    int (*covered_slice)(iter_data*, size_t slice, uint64_t offs, uint32_t length);
+
+    iter_data() : db(NULL), current(NULL), cursor(0), copy_values_in(false), covered_slice(NULL) {}
+  };
+
+private:
+
+  /*
+   * Scans from "cursor" (which must not be positioned after the first record
+   * matching "range_from") to "idx_to".
+   */
+  int query_scan(uint64_t cursor, uint64_t idx_to,
+            const RecordModelInstance *range_from, const RecordModelInstance *range_to,
+            int (*iterator)(iter_data*), iter_data *data)
+  {
+    SkipState skip;
+
+    /*
+     * Linear scan from current position
+     */
+    while (cursor <= idx_to)
+    {
+      copy_keys_in(data->current, cursor);
+     
+      int keypos;
+      int cmp = data->current->keys_in_range_pos(range_from, range_to, keypos);
+      if (cmp == 0)
       {
         /*
          * all keys are within [range_from, range_to]
@@ -552,7 +1161,7 @@ private:
         /*
          * Search forward
          */
-        cursor = bin_search(cursor+1, idx_to, data->current->ptr());
+        cursor = skip_search(cursor+1, idx_to, data->current->ptr(), skip);
       }
       else if (cmp > 0)
       {
@@ -577,7 +1186,7 @@ private:
         /*
          * Search forward
          */
-        cursor = bin_search(cursor+1, idx_to, data->current->ptr());
+        cursor = skip_search(cursor+1, idx_to, data->current->ptr(), skip);
       }
     }
 
@@ -626,7 +1235,42 @@ public:
   const void *get_minmax_element(size_t index)
   {
     assert(index < 2*this->num_slices);
-    return db_minmax->ptr_read_element(index, model->size()); 
+    return db_minmax->ptr_read_element(index, model->size());
+  }
+
+  /*
+   * Appends all records of slice "s" to "arr". Returns false if "arr" is
+   * full and cannot be expanded.
+   */
+  bool read_slice(size_t s, RecordModelInstanceArray *arr)
+  {
+    assert(s < num_slices);
+    assert(arr->model == model);
+
+    int err = pthread_rwlock_rdlock(&rwlock);
+    assert(!err);
+
+    uint64_t offs = 0;
+    for (size_t i = 0; i < s; ++i)
+    {
+      offs += db_slices->ptr_read_element_at<uint32_t>(i);
+    }
+    uint32_t length = db_slices->ptr_read_element_at<uint32_t>(s);
+
+    RecordModelInstance *cur = RecordModelInstance::allocate(model);
+    bool ok = true;
+    for (uint64_t i = offs; ok && i < offs + length; ++i)
+    {
+      copy_keys_in(cur, i);
+      copy_values_in(cur, i);
+      ok = arr->push(cur);
+    }
+    RecordModelInstance::deallocate(cur);
+
+    err = pthread_rwlock_unlock(&rwlock);
+    assert(!err);
+
+    return ok;
   }
 
   /*
@@ -635,10 +1279,69 @@ public:
    */
   int query_all(size_t slices, const RecordModelInstance *range_from, const RecordModelInstance *range_to,
                  int (*iterator)(iter_data *), iter_data *data)
+  {
+    const RecordModelInstance *ranges[2] = {range_from, range_to};
+    return query_all_ranges(slices, ranges, 1, iterator, data);
+  }
+
+  /*
+   * Sorts the (from, to) pairs in "ranges" (2*num_ranges records) by "from",
+   * as required by query_all_ranges.
+   */
+  void sort_ranges(const RecordModelInstance **ranges, size_t num_ranges)
+  {
+    RangeCompare c;
+    c.model = model;
+    std::sort((RangePair*)ranges, ((RangePair*)ranges) + num_ranges, c);
+  }
+
+  /*
+   * Like query_all, but for many ranges at once (e.g. a query for a list of
+   * uids). "ranges" contains "num_ranges" pairs of (from, to) records, which
+   * MUST be sorted by "from" (use sort_ranges).
+   *
+   * Every slice is visited only once. A slice is skipped when it has no
+   * overlap with the bounding box of all ranges, otherwise every range is
+   * checked against the min/max records. As the "from" records are sorted,
+   * the lower bound of a range within a slice can never be before the lower
+   * bound of the previous range, so we only search forward.
+   */
+  int query_all_ranges(size_t slices, const RecordModelInstance **ranges, size_t num_ranges,
+                 int (*iterator)(iter_data *), iter_data *data)
   {
     int iter = ITER_CONTINUE;
     size_t offs = 0;
 
+    if (num_ranges == 0)
+      return iter;
+
+    /*
+     * Determine the bounding box (on a per field basis) of all ranges. It
+     * lives on the stack, as the iterator might never return (e.g. a break
+     * or an exception within the block of query_each).
+     */
+    void *box_from = alloca(model->size());
+    void *box_to = alloca(model->size());
+    memcpy(box_from, ranges[0]->ptr(), model->size());
+    memcpy(box_to, ranges[1]->ptr(), model->size());
+
+    for (size_t r = 1; r < num_ranges; ++r)
+    {
+      for (size_t k = 0; k < model->_num_fields; ++k)
+      {
+        RM_Type *field = model->_all_fields[k];
+
+        if (field->compare(ranges[2*r]->ptr(), box_from) < 0)
+        {
+          field->copy(box_from, ranges[2*r]->ptr());
+        }
+        if (field->compare(ranges[2*r+1]->ptr(), box_to) > 0)
+        {
+          field->copy(box_to, ranges[2*r+1]->ptr());
+        }
+      }
+    }
+
     /*
      * We set a read lock here so a _ptr of a MmapFile cannot be ripped out under us.
      * in case the mmap has to be expanded.
@@ -662,14 +1365,37 @@ public:
       const void *max_ptr = db_minmax->ptr_read_element(2*s+1, model->size()); 
       assert(min_ptr && max_ptr);
 
-      if (!model->overlap_all(range_from->ptr(), range_to->ptr(), min_ptr, max_ptr))
-      {
-        iter = ITER_CONTINUE;
-      }
-      else
+      if (model->overlap_all(box_from, box_to, min_ptr, max_ptr))
       {
-        iter = query(offs, offs+length-1, range_from, range_to, iterator, data);
+        const uint64_t idx_to = offs+length-1;
+        uint64_t lower = offs;
+
+        for (size_t r = 0; r < num_ranges; ++r)
+        {
+          const RecordModelInstance *range_from = ranges[2*r];
+          const RecordModelInstance *range_to = ranges[2*r+1];
+
+          if (!model->overlap_all(range_from->ptr(), range_to->ptr(), min_ptr, max_ptr))
+            continue;
+
+          iter = ITER_SCAN_SLICE;
+          if (data->covered_slice && model->contains_all(range_from->ptr(), range_to->ptr(), min_ptr, max_ptr))
+          {
+            /*
+             * Every record of the slice matches. Let the caller answer it
+             * from the per-slice meta data (if it can).
+             */
+            iter = data->covered_slice(data, s, offs, length);
+          }
+          if (iter == ITER_SCAN_SLICE)
+          {
+            lower = bin_search(lower, idx_to, range_from->ptr());
+            iter = query_scan(lower, idx_to, range_from, range_to, iterator, data);
+          }
+          if (iter != ITER_CONTINUE) break;
+        }
         if (iter == ITER_STOP) break;
+        iter = ITER_CONTINUE;
       }
 
       offs += length;
@@ -678,8 +1404,28 @@ public:
     err = pthread_rwlock_unlock(&rwlock);
     assert(!err);
 
-    return iter;
-  }
+    return iter;
+  }
+
+private:
+
+  struct RangePair
+  {
+    const RecordModelInstance *from;
+    const RecordModelInstance *to;
+  };
+
+  struct RangeCompare
+  {
+    RecordModel *model;
+
+    bool operator()(const RangePair &a, const RangePair &b) const
+    {
+      return (RecordModelInstance::compare_keys_ptr(model, a.from->ptr(), b.from->ptr()) < 0);
+    }
+  };
+
+public:
   
   struct min_iter_data : iter_data
   {
@@ -725,7 +1471,7 @@ public:
     if (data.min)
     {
       current->copy(data.min);
-      delete data.min;
+      RecordModelInstance::deallocate(data.min);
       return true;
     }
     else
@@ -746,22 +1492,193 @@ public:
     ++data->count;
     return ITER_CONTINUE;
   }
+
+  static int count_covered_slice(iter_data *_data, size_t slice, uint64_t offs, uint32_t length)
+  {
+    count_iter_data *data = (count_iter_data*)_data;
+    data->count += length;
+    return ITER_CONTINUE;
+  }
  
   /*
    * Returns the number of matching records.
    */
   size_t query_count(size_t slices, const RecordModelInstance *range_from, const RecordModelInstance *range_to,
              RecordModelInstance *current)
+  {
+    const RecordModelInstance *ranges[2] = {range_from, range_to};
+    return query_count(slices, ranges, 1, current);
+  }
+
+  /*
+   * Returns the number of records matching any of the (sorted) ranges.
+   */
+  size_t query_count(size_t slices, const RecordModelInstance **ranges, size_t num_ranges,
+             RecordModelInstance *current)
   {
     count_iter_data data;
     data.db = this;
     data.current = current;
     data.copy_values_in = false;
+    data.covered_slice = count_covered_slice;
+    data.count = 0;
+    query_all_ranges(slices, ranges, num_ranges, count_iter, (iter_data*)&data);
+    return data.count;
+  }
+
+  struct sum_iter_data : iter_data
+  {
+    RecordModelInstance *sums;
+    size_t count;
+  };
+
+  static int sum_iter(iter_data *_data)
+  {
+    sum_iter_data *data = (sum_iter_data*)_data;
+    data->sums->add_numeric_values(data->current);
+    ++data->count;
+    return ITER_CONTINUE;
+  }
+
+  static int sum_covered_slice(iter_data *_data, size_t slice, uint64_t offs, uint32_t length)
+  {
+    sum_iter_data *data = (sum_iter_data*)_data;
+    RecordModelInstance slice_sums(data->db->model, (void*)data->db->get_sums_element(slice));
+    data->sums->add_numeric_values(&slice_sums);
+    data->count += length;
+    return ITER_CONTINUE;
+  }
+
+  /*
+   * Sums up the numeric values of all records matching any of the (sorted)
+   * ranges into "sums" (which is zeroed first). Returns the number of
+   * matching records.
+   */
+  size_t query_sum(size_t slices, const RecordModelInstance **ranges, size_t num_ranges,
+             RecordModelInstance *current, RecordModelInstance *sums)
+  {
+    bzero(sums->ptr(), model->size());
+
+    sum_iter_data data;
+    data.db = this;
+    data.current = current;
+    data.copy_values_in = true;
+    if (db_sums && db_sums->size() >= model->size()*slices)
+      data.covered_slice = sum_covered_slice;
+    data.sums = sums;
     data.count = 0;
-    query_all(slices, range_from, range_to, count_iter, (iter_data*)&data);
+    query_all_ranges(slices, ranges, num_ranges, sum_iter, (iter_data*)&data);
     return data.count;
   }
 
+private:
+
+  const void *get_sums_element(size_t slice)
+  {
+    return db_sums->ptr_read_element(slice, model->size());
+  }
+
+public:
+
+  struct distinct_iter_data : iter_data
+  {
+    RM_Type *field;
+    size_t key_idx; // index into the hll file
+    RM_HyperLogLog *hll;
+  };
+
+  static int distinct_iter(iter_data *_data)
+  {
+    distinct_iter_data *data = (distinct_iter_data*)_data;
+    uint8_t buf[256];
+    data->field->copy_to_memory(data->current->ptr(), buf);
+    data->hll->add(buf, data->field->size());
+    return ITER_CONTINUE;
+  }
+
+  static int distinct_covered_slice(iter_data *_data, size_t slice, uint64_t offs, uint32_t length)
+  {
+    distinct_iter_data *data = (distinct_iter_data*)_data;
+    const uint8_t *regs = (const uint8_t*)data->db->db_hll->ptr_read_element(slice, data->db->hll_slice_size());
+    assert(regs);
+    data->hll->merge(regs + data->key_idx*RM_HyperLogLog::NUM_REGISTERS);
+    return ITER_CONTINUE;
+  }
+
+  /*
+   * Estimates the number of distinct values of "field" of all records
+   * matching any of the (sorted) ranges. For key fields, slices which are
+   * completely covered by a range are answered from the hll file.
+   */
+  double query_distinct(size_t slices, const RecordModelInstance **ranges, size_t num_ranges,
+             RecordModelInstance *current, RM_Type *field)
+  {
+    RM_HyperLogLog *hll = new RM_HyperLogLog;
+
+    distinct_iter_data data;
+    data.db = this;
+    data.current = current;
+    data.copy_values_in = true;
+    data.field = field;
+    data.key_idx = 0;
+    data.hll = hll;
+
+    for (size_t k = 0; k < num_keys; ++k)
+    {
+      if (model->_keys[k] == field)
+      {
+        data.copy_values_in = false;
+        data.key_idx = k;
+        if (db_hll && db_hll->size() >= hll_slice_size()*slices)
+          data.covered_slice = distinct_covered_slice;
+      }
+    }
+
+    query_all_ranges(slices, ranges, num_ranges, distinct_iter, (iter_data*)&data);
+
+    double res = hll->estimate();
+    delete hll;
+    return res;
+  }
+
+  struct quantile_iter_data : iter_data
+  {
+    RM_Type *field;
+    RM_KLL *kll;
+  };
+
+  static int quantile_iter(iter_data *_data)
+  {
+    quantile_iter_data *data = (quantile_iter_data*)_data;
+    data->kll->add(data->field->to_double(data->current->ptr()));
+    return ITER_CONTINUE;
+  }
+
+  /*
+   * Builds a quantile sketch over the (numeric) "field" of all records
+   * matching any of the (sorted) ranges.
+   */
+  void query_quantiles(size_t slices, const RecordModelInstance **ranges, size_t num_ranges,
+             RecordModelInstance *current, RM_Type *field, RM_KLL *kll)
+  {
+    assert(field->is_numeric());
+
+    quantile_iter_data data;
+    data.db = this;
+    data.current = current;
+    data.copy_values_in = true;
+    data.field = field;
+    data.kll = kll;
+
+    for (size_t k = 0; k < num_keys; ++k)
+    {
+      if (model->_keys[k] == field)
+        data.copy_values_in = false;
+    }
+
+    query_all_ranges(slices, ranges, num_ranges, quantile_iter, (iter_data*)&data);
+  }
+
   struct Entry
   {
     void *ptr;
@@ -821,6 +1738,50 @@ public:
  
   void query_aggregate(size_t slices, const RecordModelInstance *range_from, const RecordModelInstance *range_to,
              RecordModelInstance *current, RecordModelInstanceArray *arr, RM_Type **keys /* NULL terminated */, bool sum)
+  {
+    const RecordModelInstance *ranges[2] = {range_from, range_to};
+    query_aggregate(slices, ranges, 1, current, arr, keys, sum);
+  }
+
+  /*
+   * If all records of a covered slice fall into the same group (min and max
+   * of all group keys are equal), we can add the slice sums instead of
+   * scanning it.
+   */
+  static int aggregate_covered_slice(iter_data *_data, size_t slice, uint64_t offs, uint32_t length)
+  {
+    aggregate_iter_data *data = (aggregate_iter_data*)_data;
+    MMDB *db = data->db;
+
+    const void *min_ptr = db->get_minmax_element(2*slice);
+    const void *max_ptr = db->get_minmax_element(2*slice+1);
+
+    for (RM_Type **key = data->set->key_comp().keys; *key != NULL; ++key)
+    {
+      if ((*key)->compare(min_ptr, max_ptr) != 0)
+        return ITER_SCAN_SLICE;
+    }
+
+    /*
+     * Fields which are neither group keys nor numeric values are taken from
+     * the min record (like the scan, which takes them from the first record
+     * of a group).
+     */
+    RecordModelInstance min(db->model, (void*)min_ptr);
+    data->current->copy(&min);
+    RecordModelInstance slice_sums(db->model, (void*)db->get_sums_element(slice));
+    for (size_t k = 0; k < db->model->_num_values; ++k)
+    {
+      RM_Type *field = db->model->_values[k];
+      if (field->is_numeric())
+        field->copy(data->current->ptr(), slice_sums.ptr());
+    }
+
+    return aggregate_iter(data);
+  }
+
+  void query_aggregate(size_t slices, const RecordModelInstance **ranges, size_t num_ranges,
+             RecordModelInstance *current, RecordModelInstanceArray *arr, RM_Type **keys /* NULL terminated */, bool sum)
   {
     Compare c;
     c.keys = keys; // MUST be NULL terminated array 
@@ -834,7 +1795,9 @@ public:
     data.set = &set;
     data.arr = arr;
     data.sum = sum;
-    query_all(slices, range_from, range_to, aggregate_iter, (iter_data*)&data);
+    if (sum && db_sums && db_sums->size() >= model->size()*slices)
+      data.covered_slice = aggregate_covered_slice;
+    query_all_ranges(slices, ranges, num_ranges, aggregate_iter, (iter_data*)&data);
   }
  
 };
@@ -867,7 +1830,7 @@ MMDB* MMDB__get(VALUE self) {
 }
 
 static
-VALUE MMDB__open(VALUE klass, VALUE recordmodel, VALUE path_prefix, VALUE num_slices, VALUE hint_slices, VALUE num_records, VALUE hint_records, VALUE readonly)
+VALUE MMDB__open(VALUE klass, VALUE recordmodel, VALUE path_prefix, VALUE num_slices, VALUE hint_slices, VALUE num_records, VALUE hint_records, VALUE readonly, VALUE hll)
 {
   Check_Type(path_prefix, T_STRING);
 
@@ -875,7 +1838,7 @@ VALUE MMDB__open(VALUE klass, VALUE recordmodel, VALUE path_prefix, VALUE num_sl
 
   MMDB *mdb = new MMDB;
 
-  bool ok = mdb->open(model, RSTRING_PTR(path_prefix), NUM2ULONG(num_slices), NUM2ULONG(hint_slices), NUM2ULONG(num_records), NUM2ULONG(hint_records), RTEST(readonly));
+  bool ok = mdb->open(model, RSTRING_PTR(path_prefix), NUM2ULONG(num_slices), NUM2ULONG(hint_slices), NUM2ULONG(num_records), NUM2ULONG(hint_records), RTEST(readonly), RTEST(hll));
   if (!ok)
   {
     delete mdb;
@@ -893,31 +1856,348 @@ VALUE MMDB_close(VALUE self)
   return Qnil;
 }
 
-struct Params 
+struct Params 
+{
+  MMDB *db;
+  RecordModelInstanceArray *arr;
+  RecordModelInstanceColumnArray *column_arr;
+  bool verify;
+};
+
+static
+VALUE put_bulk(void *ptr)
+{
+  Params *params = (Params*)ptr;
+  if (params->column_arr)
+    return params->db->put_bulk(params->column_arr) ? Qtrue : Qfalse;
+  params->db->put_bulk(params->arr, params->verify);
+  return Qtrue;
+}
+
+/*
+ * "arr" is either a RecordModelInstanceArray or a RecordModelInstanceColumnArray.
+ */
+static
+VALUE MMDB_put_bulk(VALUE self, VALUE arr)
+{
+  Params p;
+
+  Data_Get_Struct(self, MMDB, p.db);
+  p.arr = NULL;
+  p.column_arr = NULL;
+  if (is_RecordModelInstanceColumnArray(arr))
+    p.column_arr = get_RecordModelInstanceColumnArray(arr);
+  else
+    p.arr = get_RecordModelInstanceArray(arr);
+  p.verify = false;
+
+  if (!RTEST(rb_thread_blocking_region(put_bulk, &p, NULL, NULL)))
+    rb_raise(rb_eRuntimeError, "Failed to sort columns");
+
+  return Qnil;
+}
+
+static
+void *ingest_prepare(void *store_data, RecordModelInstanceArray *arr)
+{
+  return ((MMDB*)store_data)->prepare_bulk(arr);
+}
+
+static
+void ingest_store(void *store_data, RecordModelInstanceArray *arr, void *prepared)
+{
+  ((MMDB*)store_data)->store_bulk(arr, (MMDB::PreparedSlice*)prepared);
+}
+
+static
+VALUE ingest(void *ptr)
+{
+  IngestPipeline *pipeline = (IngestPipeline*)ptr;
+  return INT2NUM(pipeline->run());
+}
+
+/*
+ * Reads, parses and stores all lines of "_reader" natively (see
+ * IngestPipeline). "_num_arrays" arrays of "_array_size" records are used,
+ * each stored as one slice. The arrays are sorted (and combined if
+ * "_combine" is true) on "_num_preparers" threads while another one writes.
+ *
+ * Returns [lines_read, lines_ok, parse_errors, invalid_num_tokens].
+ */
+static
+VALUE MMDB_ingest(VALUE self, VALUE _reader, VALUE _field_arr, VALUE _sep, VALUE _min_num_tokens, VALUE _max_num_tokens,
+  VALUE _num_threads, VALUE _chunk_size, VALUE _array_size, VALUE _num_arrays, VALUE _num_preparers,
+  VALUE _combine)
+{
+  MMDB *db = MMDB__get(self);
+  AutoFileReader *reader = get_AutoFileReader(_reader);
+
+  if (db->is_readonly())
+    rb_raise(rb_eArgError, "Database is readonly");
+
+  size_t num_threads = NUM2ULONG(_num_threads);
+  size_t chunk_size = NUM2ULONG(_chunk_size);
+  size_t array_size = NUM2ULONG(_array_size);
+  size_t num_arrays = NUM2ULONG(_num_arrays);
+  size_t num_preparers = NUM2ULONG(_num_preparers);
+  if (num_threads == 0 || chunk_size == 0 || array_size == 0 || num_arrays == 0 || num_preparers == 0)
+    rb_raise(rb_eArgError, "Invalid number of threads, chunk size or array size");
+
+  RM_ParsePlan *plan = make_parse_plan(db->model, _field_arr, _sep);
+
+  IngestPipeline *pipeline = new IngestPipeline(reader, plan, NUM2INT(_min_num_tokens), NUM2INT(_max_num_tokens),
+    num_threads, chunk_size, array_size, num_arrays, ingest_prepare, ingest_store, db, num_preparers);
+  pipeline->combine = RTEST(_combine);
+
+  int res = NUM2INT(rb_thread_blocking_region(ingest, pipeline, NULL, NULL));
+
+  const ParallelLineParser::Stats &st = pipeline->stats;
+  VALUE stats = rb_ary_new3(4, ULONG2NUM(st.lines_read), ULONG2NUM(st.lines_ok),
+    ULONG2NUM(st.parse_errors), ULONG2NUM(st.invalid_num_tokens));
+
+  delete pipeline;
+  delete plan;
+
+  if (res < 0)
+    rb_raise(rb_eRuntimeError, "ingest failed");
+
+  return stats;
+}
+
+static
+VALUE put_sorted(void *ptr)
+{
+  void **args = (void**)ptr;
+  ExternalSorter *sorter = (ExternalSorter*)args[1];
+  if (!sorter->is_merging() && !sorter->finish())
+    return Qfalse;
+  ((MMDB*)args[0])->put_sorted(sorter);
+  return Qtrue;
+}
+
+static ExternalSorter *ExternalSorter__get(VALUE);
+
+/*
+ * Stores the records of "_sorter" (an ExternalSorter over the keys of the
+ * model) as one large slice. Finishes the sorter if not done yet.
+ */
+static
+VALUE MMDB_put_sorted(VALUE self, VALUE _sorter)
+{
+  MMDB *db = MMDB__get(self);
+  ExternalSorter *sorter = ExternalSorter__get(_sorter);
+
+  if (db->is_readonly())
+    rb_raise(rb_eArgError, "Database is readonly");
+  if (sorter->get_model() != db->model || !sorter->sorts_by(db->model->_keys))
+    rb_raise(rb_eArgError, "Sorter does not sort by the keys of the model");
+
+  void *args[2] = {db, sorter};
+  if (!RTEST(rb_thread_blocking_region(put_sorted, args, NULL, NULL)))
+    rb_raise(rb_eRuntimeError, "Failed to write run");
+
+  return Qnil;
+}
+
+/*
+ * ExternalSorter
+ */
+
+static
+void ExternalSorter__mark(void *ptr)
+{
+  ExternalSorter *sorter = (ExternalSorter*)ptr;
+  if (sorter)
+  {
+    rb_gc_mark(sorter->get_model()->_rm_obj);
+  }
+}
+
+static
+void ExternalSorter__free(void *ptr)
+{
+  ExternalSorter *sorter = (ExternalSorter*)ptr;
+  if (sorter)
+  {
+    delete sorter;
+  }
+}
+
+static
+ExternalSorter *ExternalSorter__get(VALUE self)
+{
+  if (TYPE(self) != T_DATA || RDATA(self)->dfree != (RUBY_DATA_FUNC)(ExternalSorter__free))
+  {
+    rb_raise(rb_eTypeError, "wrong argument type");
+  }
+  ExternalSorter *ptr;
+  Data_Get_Struct(self, ExternalSorter, ptr);
+  return ptr;
+}
+
+/*
+ * Sorts by the fields "_keys" (an Array of field indices, or nil for the keys
+ * of the model), spilling sorted runs of "_run_size" records to "_tmp_dir".
+ */
+static
+VALUE ExternalSorter__new(VALUE klass, VALUE recordmodel, VALUE _tmp_dir, VALUE _keys, VALUE _run_size)
+{
+  Check_Type(_tmp_dir, T_STRING);
+
+  RecordModel *model = get_RecordModel(recordmodel);
+  size_t run_size = NUM2ULONG(_run_size);
+  if (run_size == 0)
+    rb_raise(rb_eArgError, "Invalid run size");
+
+  std::vector<RM_Type*> keys;
+  if (!NIL_P(_keys))
+  {
+    Check_Type(_keys, T_ARRAY);
+    if (RARRAY_LEN(_keys) == 0)
+      rb_raise(rb_eArgError, "No keys given");
+    for (int i = 0; i < RARRAY_LEN(_keys); ++i)
+    {
+      RM_Type *field = model->get_field(FIX2UINT(RARRAY_PTR(_keys)[i]));
+      if (field == NULL)
+        rb_raise(rb_eArgError, "Wrong index");
+      keys.push_back(field);
+    }
+    keys.push_back(NULL);
+  }
+
+  ExternalSorter *sorter = new ExternalSorter(model, keys.empty() ? NULL : &keys[0], RSTRING_PTR(_tmp_dir), run_size);
+  return Data_Wrap_Struct(klass, ExternalSorter__mark, ExternalSorter__free, sorter);
+}
+
+static
+VALUE ExternalSorter_push(VALUE self, VALUE _rec)
+{
+  ExternalSorter *sorter = ExternalSorter__get(self);
+  RecordModelInstance *rec = get_RecordModelInstance(_rec);
+
+  if (sorter->is_merging())
+    rb_raise(rb_eArgError, "Sorter already finished");
+  if (rec->model != sorter->get_model())
+    rb_raise(rb_eArgError, "Model mismatch");
+
+  if (!sorter->add(rec))
+    rb_raise(rb_eRuntimeError, "Failed to write run");
+
+  return self;
+}
+
+static
+VALUE external_sorter_add_array(void *ptr)
+{
+  void **args = (void**)ptr;
+  bool ok = ((ExternalSorter*)args[0])->add_array((RecordModelInstanceArray*)args[1]);
+  return ok ? Qtrue : Qfalse;
+}
+
+static
+VALUE ExternalSorter_add_array(VALUE self, VALUE _arr)
+{
+  ExternalSorter *sorter = ExternalSorter__get(self);
+  RecordModelInstanceArray *arr = get_RecordModelInstanceArray(_arr);
+
+  if (sorter->is_merging())
+    rb_raise(rb_eArgError, "Sorter already finished");
+  if (arr->model != sorter->get_model())
+    rb_raise(rb_eArgError, "Model mismatch");
+
+  void *args[2] = {sorter, arr};
+  if (!RTEST(rb_thread_blocking_region(external_sorter_add_array, args, NULL, NULL)))
+    rb_raise(rb_eRuntimeError, "Failed to write run");
+
+  return self;
+}
+
+static
+VALUE external_sorter_finish(void *ptr)
+{
+  return ((ExternalSorter*)ptr)->finish() ? Qtrue : Qfalse;
+}
+
+static
+VALUE ExternalSorter_finish(VALUE self)
+{
+  ExternalSorter *sorter = ExternalSorter__get(self);
+
+  if (!sorter->is_merging() && !RTEST(rb_thread_blocking_region(external_sorter_finish, sorter, NULL, NULL)))
+    rb_raise(rb_eRuntimeError, "Failed to write run");
+
+  return self;
+}
+
+static
+VALUE ExternalSorter_size(VALUE self)
+{
+  return ULONG2NUM(ExternalSorter__get(self)->entries());
+}
+
+static
+VALUE ExternalSorter_runs(VALUE self)
 {
-  MMDB *db;
-  RecordModelInstanceArray *arr;
-  bool verify;
-};
+  return ULONG2NUM(ExternalSorter__get(self)->num_runs());
+}
 
+/*
+ * Yields "_rec" filled with each of the remaining records in sorted order.
+ */
 static
-VALUE put_bulk(void *ptr)
+VALUE ExternalSorter_each(VALUE self, VALUE _rec)
 {
-  Params *params = (Params*)ptr;
-  params->db->put_bulk(params->arr, params->verify);
+  ExternalSorter *sorter = ExternalSorter__get(self);
+  RecordModelInstance *rec = get_RecordModelInstance(_rec);
+
+  if (!sorter->is_merging())
+    rb_raise(rb_eArgError, "Sorter not finished");
+  if (rec->model != sorter->get_model())
+    rb_raise(rb_eArgError, "Model mismatch");
+
+  const void *ptr;
+  while ((ptr = sorter->next()) != NULL)
+  {
+    memcpy(rec->ptr(), ptr, rec->model->size());
+    rb_yield(_rec);
+  }
+
   return Qnil;
 }
 
+/*
+ * Appends up to "_max" of the remaining records (in sorted order) to "_arr".
+ * Stops early once "_arr" is full and cannot be expanded. Returns the number
+ * of records appended.
+ */
 static
-VALUE MMDB_put_bulk(VALUE self, VALUE arr)
+VALUE ExternalSorter_read_into(VALUE self, VALUE _arr, VALUE _max)
 {
-  Params p;
-
-  Data_Get_Struct(self, MMDB, p.db);
-  p.arr = get_RecordModelInstanceArray(arr);
-  p.verify = false;
+  ExternalSorter *sorter = ExternalSorter__get(self);
+  RecordModelInstanceArray *arr = get_RecordModelInstanceArray(_arr);
+  size_t max = NUM2ULONG(_max);
+
+  if (!sorter->is_merging())
+    rb_raise(rb_eArgError, "Sorter not finished");
+  if (arr->model != sorter->get_model())
+    rb_raise(rb_eArgError, "Model mismatch");
+
+  RecordModelInstance rec(arr->model, NULL);
+  size_t n = 0;
+  const void *ptr;
+  while (n < max)
+  {
+    // make room first, as next() consumes the record
+    if (arr->full() && !arr->expand())
+      break;
+    if ((ptr = sorter->next()) == NULL)
+      break;
+    rec._ptr = (void*)ptr;
+    arr->push(&rec);
+    ++n;
+  }
 
-  return rb_thread_blocking_region(put_bulk, &p, NULL, NULL);
+  return ULONG2NUM(n);
 }
 
 struct yield_iter_data : MMDB::iter_data
@@ -986,8 +2266,82 @@ struct Params_query_into
   // for query_aggregate 
   RM_Type **keys;
   bool sum;
+
+  // for the *_ranges variants
+  const RecordModelInstance **ranges;
+  size_t num_ranges;
 };
 
+/*
+ * Converts an Array of [from, to] pairs into an array of 2*num_ranges
+ * records, sorted by "from" as required by MMDB::query_all_ranges.
+ *
+ * The memory is owned by the String returned in "holder", so the ranges
+ * do not leak if the block of query_each_ranges raises. Keep "holder" alive
+ * with RB_GC_GUARD.
+ */
+static
+const RecordModelInstance **get_ranges(MMDB *db, VALUE _ranges, size_t &num_ranges, VALUE &holder)
+{
+  Check_Type(_ranges, T_ARRAY);
+
+  for (long i = 0; i < RARRAY_LEN(_ranges); ++i)
+  {
+    VALUE pair = RARRAY_PTR(_ranges)[i];
+    Check_Type(pair, T_ARRAY);
+    if (RARRAY_LEN(pair) != 2)
+    {
+      rb_raise(rb_eArgError, "[from, to] pair expected");
+    }
+    if (get_RecordModelInstance(RARRAY_PTR(pair)[0])->model != db->model ||
+        get_RecordModelInstance(RARRAY_PTR(pair)[1])->model != db->model)
+    {
+      rb_raise(rb_eArgError, "Model mismatch");
+    }
+  }
+
+  num_ranges = RARRAY_LEN(_ranges);
+  holder = rb_str_new(NULL, sizeof(RecordModelInstance*)*(2*num_ranges+1));
+  const RecordModelInstance **ranges = (const RecordModelInstance**)RSTRING_PTR(holder);
+
+  for (size_t i = 0; i < num_ranges; ++i)
+  {
+    VALUE pair = RARRAY_PTR(_ranges)[i];
+    ranges[2*i] = get_RecordModelInstance(RARRAY_PTR(pair)[0]);
+    ranges[2*i+1] = get_RecordModelInstance(RARRAY_PTR(pair)[1]);
+  }
+
+  db->sort_ranges(ranges, num_ranges);
+
+  return ranges;
+}
+
+/*
+ * Converts an Array of field indices into a NULL terminated array of fields.
+ * Free the returned array with free().
+ */
+static
+RM_Type **get_keys(RecordModel *model, VALUE _keys)
+{
+  Check_Type(_keys, T_ARRAY);
+  RM_Type **keys = (RM_Type**)malloc(sizeof(RM_Type*)*(RARRAY_LEN(_keys)+1));
+  if (!keys)
+  {
+    rb_raise(rb_eArgError, "failed to alloc memory");
+  }
+  for (int i=0; i < RARRAY_LEN(_keys); ++i)
+  {
+    keys[i] = model->get_field(NUM2ULONG(RARRAY_PTR(_keys)[i]));
+    if (!keys[i])
+    {
+      free(keys);
+      rb_raise(rb_eArgError, "invalid field");
+    }
+  }
+  keys[RARRAY_LEN(_keys)] = NULL;
+  return keys;
+}
+
 static
 VALUE query_into(void *a)
 {
@@ -998,7 +2352,11 @@ VALUE query_into(void *a)
   d.copy_values_in = true;
   d.arr = p->arr;
 
-  int iter = p->db->query_all(p->snapshot, p->from, p->to, array_fill_iter, (MMDB::iter_data*)&d); 
+  int iter;
+  if (p->ranges)
+    iter = p->db->query_all_ranges(p->snapshot, p->ranges, p->num_ranges, array_fill_iter, (MMDB::iter_data*)&d);
+  else
+    iter = p->db->query_all(p->snapshot, p->from, p->to, array_fill_iter, (MMDB::iter_data*)&d); 
 
   if (iter == MMDB::ITER_STOP)
     return Qfalse;
@@ -1011,6 +2369,8 @@ VALUE MMDB_query_into(VALUE self, VALUE _from, VALUE _to, VALUE _current, VALUE
 {
   Params_query_into p;
   Data_Get_Struct(self, MMDB, p.db);
+  p.ranges = NULL;
+  p.num_ranges = 0;
 
   p.from = get_RecordModelInstance(_from);
   p.to = get_RecordModelInstance(_to);
@@ -1047,6 +2407,8 @@ VALUE MMDB_query_min(VALUE self, VALUE _from, VALUE _to, VALUE _current, VALUE _
 {
   Params_query_into p;
   Data_Get_Struct(self, MMDB, p.db);
+  p.ranges = NULL;
+  p.num_ranges = 0;
 
   p.from = get_RecordModelInstance(_from);
   p.to = get_RecordModelInstance(_to);
@@ -1070,7 +2432,10 @@ static
 VALUE query_count(void *a)
 {
   Params_query_into *p = (Params_query_into*)a;
-  p->count = p->db->query_count(p->snapshot, p->from, p->to, p->current);
+  if (p->ranges)
+    p->count = p->db->query_count(p->snapshot, p->ranges, p->num_ranges, p->current);
+  else
+    p->count = p->db->query_count(p->snapshot, p->from, p->to, p->current);
   return Qnil;
 }
 
@@ -1082,6 +2447,8 @@ VALUE MMDB_query_count(VALUE self, VALUE _from, VALUE _to, VALUE _current, VALUE
 {
   Params_query_into p;
   Data_Get_Struct(self, MMDB, p.db);
+  p.ranges = NULL;
+  p.num_ranges = 0;
 
   p.from = get_RecordModelInstance(_from);
   p.to = get_RecordModelInstance(_to);
@@ -1102,7 +2469,10 @@ static
 VALUE query_aggregate(void *a)
 {
   Params_query_into *p = (Params_query_into*)a;
-  p->db->query_aggregate(p->snapshot, p->from, p->to, p->current, p->arr, p->keys, p->sum);
+  if (p->ranges)
+    p->db->query_aggregate(p->snapshot, p->ranges, p->num_ranges, p->current, p->arr, p->keys, p->sum);
+  else
+    p->db->query_aggregate(p->snapshot, p->from, p->to, p->current, p->arr, p->keys, p->sum);
   return Qnil;
 }
 
@@ -1114,6 +2484,8 @@ VALUE MMDB_query_aggregate(VALUE self, VALUE _from, VALUE _to, VALUE _current, V
 {
   Params_query_into p;
   Data_Get_Struct(self, MMDB, p.db);
+  p.ranges = NULL;
+  p.num_ranges = 0;
 
   p.from = get_RecordModelInstance(_from);
   p.to = get_RecordModelInstance(_to);
@@ -1128,32 +2500,280 @@ VALUE MMDB_query_aggregate(VALUE self, VALUE _from, VALUE _to, VALUE _current, V
   assert(p.from->model == p.arr->model);
 
   p.snapshot = NUM2ULONG(_snapshot);
+  p.keys = get_keys(p.from->model, _keys);
 
-  Check_Type(_keys, T_ARRAY);
-  p.keys = (RM_Type**)malloc(sizeof(RM_Type*)*(RARRAY_LEN(_keys)+1));
-  if (!p.keys)
+  rb_thread_blocking_region(query_aggregate, &p, NULL, NULL);
+
+  free(p.keys);
+
+  return Qnil;
+}
+
+/*
+ * The *_ranges methods below work like their single range counterparts, but
+ * take an Array of [from, to] pairs and visit each slice only once.
+ */
+
+static
+VALUE MMDB_query_each_ranges(VALUE self, VALUE _ranges, VALUE _current, VALUE _snapshot)
+{
+  MMDB *db;
+  Data_Get_Struct(self, MMDB, db);
+
+  RecordModelInstance *current = get_RecordModelInstance(_current);
+  assert(current->model == db->model);
+
+  size_t snapshot = NUM2ULONG(_snapshot);
+  size_t num_ranges;
+  VALUE holder;
+  const RecordModelInstance **ranges = get_ranges(db, _ranges, num_ranges, holder);
+
+  struct yield_iter_data d;
+  d.db = db;
+  d.current = current;
+  d.copy_values_in = true;
+  d._current = _current;
+
+  db->query_all_ranges(snapshot, ranges, num_ranges, yield_iter, (MMDB::iter_data*)&d); 
+  RB_GC_GUARD(holder);
+
+  return Qnil;
+}
+
+static
+VALUE MMDB_query_into_ranges(VALUE self, VALUE _ranges, VALUE _current, VALUE _arr, VALUE _snapshot)
+{
+  Params_query_into p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.current = get_RecordModelInstance(_current);
+  p.arr = get_RecordModelInstanceArray(_arr);
+
+  assert(p.arr->model == p.db->model);
+  assert(p.current->model == p.db->model);
+
+  p.snapshot = NUM2ULONG(_snapshot);
+
+  VALUE holder;
+  p.ranges = get_ranges(p.db, _ranges, p.num_ranges, holder);
+
+  VALUE res = rb_thread_blocking_region(query_into, &p, NULL, NULL);
+  RB_GC_GUARD(holder);
+
+  return res;
+}
+
+static
+VALUE MMDB_query_count_ranges(VALUE self, VALUE _ranges, VALUE _current, VALUE _snapshot)
+{
+  Params_query_into p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.current = get_RecordModelInstance(_current);
+  assert(p.current->model == p.db->model);
+
+  p.snapshot = NUM2ULONG(_snapshot);
+  p.count = 0;
+
+  VALUE holder;
+  p.ranges = get_ranges(p.db, _ranges, p.num_ranges, holder);
+
+  rb_thread_blocking_region(query_count, &p, NULL, NULL);
+  RB_GC_GUARD(holder);
+
+  return ULONG2NUM(p.count);
+}
+
+static
+VALUE MMDB_query_aggregate_ranges(VALUE self, VALUE _ranges, VALUE _current, VALUE _arr, VALUE _keys, VALUE _sum, VALUE _snapshot)
+{
+  Params_query_into p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.current = get_RecordModelInstance(_current);
+  p.arr = get_RecordModelInstanceArray(_arr);
+
+  p.sum = RTEST(_sum);
+
+  assert(p.current->model == p.db->model);
+  assert(p.arr->model == p.db->model);
+
+  p.snapshot = NUM2ULONG(_snapshot);
+
+  VALUE holder;
+  p.ranges = get_ranges(p.db, _ranges, p.num_ranges, holder);
+  p.keys = get_keys(p.db->model, _keys);
+
+  rb_thread_blocking_region(query_aggregate, &p, NULL, NULL);
+  RB_GC_GUARD(holder);
+
+  free(p.keys);
+
+  return Qnil;
+}
+
+
+
+struct Params_query_sum
+{
+  MMDB *db;
+  RecordModelInstance *current;
+  RecordModelInstance *sums;
+  const RecordModelInstance **ranges;
+  size_t num_ranges;
+  size_t snapshot;
+  size_t count;
+};
+
+static
+VALUE query_sum(void *a)
+{
+  Params_query_sum *p = (Params_query_sum*)a;
+  p->count = p->db->query_sum(p->snapshot, p->ranges, p->num_ranges, p->current, p->sums);
+  return Qnil;
+}
+
+/*
+ * Stores the sums of all numeric values of the records matching any of the
+ * [from, to] pairs in "_ranges" into "_sums". Returns the number of matching
+ * records.
+ */
+static
+VALUE MMDB_query_sum_ranges(VALUE self, VALUE _ranges, VALUE _current, VALUE _sums, VALUE _snapshot)
+{
+  Params_query_sum p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.current = get_RecordModelInstance(_current);
+  p.sums = get_RecordModelInstance(_sums);
+  assert(p.current->model == p.db->model);
+  assert(p.sums->model == p.db->model);
+
+  p.snapshot = NUM2ULONG(_snapshot);
+  p.count = 0;
+
+  VALUE holder;
+  p.ranges = get_ranges(p.db, _ranges, p.num_ranges, holder);
+
+  rb_thread_blocking_region(query_sum, &p, NULL, NULL);
+  RB_GC_GUARD(holder);
+
+  return ULONG2NUM(p.count);
+}
+
+struct Params_query_sketch
+{
+  MMDB *db;
+  RecordModelInstance *current;
+  const RecordModelInstance **ranges;
+  size_t num_ranges;
+  size_t snapshot;
+  RM_Type *field;
+
+  double distinct; // result of query_distinct
+  RM_KLL *kll;     // for query_quantiles
+};
+
+static
+VALUE query_distinct(void *a)
+{
+  Params_query_sketch *p = (Params_query_sketch*)a;
+  p->distinct = p->db->query_distinct(p->snapshot, p->ranges, p->num_ranges, p->current, p->field);
+  return Qnil;
+}
+
+/*
+ * Returns the estimated number of distinct values of field "_field_idx"
+ * among all records matching any of the [from, to] pairs in "_ranges".
+ */
+static
+VALUE MMDB_query_distinct_ranges(VALUE self, VALUE _ranges, VALUE _current, VALUE _field_idx, VALUE _snapshot)
+{
+  Params_query_sketch p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.current = get_RecordModelInstance(_current);
+  assert(p.current->model == p.db->model);
+
+  p.field = p.db->model->get_field(NUM2ULONG(_field_idx));
+  if (!p.field)
   {
-    rb_raise(rb_eArgError, "failed to alloc memory");
+    rb_raise(rb_eArgError, "invalid field");
   }
-  for (int i=0; i < RARRAY_LEN(_keys); ++i)
+
+  p.snapshot = NUM2ULONG(_snapshot);
+  p.distinct = 0.0;
+
+  VALUE holder;
+  p.ranges = get_ranges(p.db, _ranges, p.num_ranges, holder);
+
+  rb_thread_blocking_region(query_distinct, &p, NULL, NULL);
+  RB_GC_GUARD(holder);
+
+  return ULONG2NUM((unsigned long)(p.distinct + 0.5));
+}
+
+static
+VALUE query_quantiles(void *a)
+{
+  Params_query_sketch *p = (Params_query_sketch*)a;
+  p->db->query_quantiles(p->snapshot, p->ranges, p->num_ranges, p->current, p->field, p->kll);
+  return Qnil;
+}
+
+/*
+ * Returns an Array with the approximate values of field "_field_idx" at each
+ * of the quantiles in "_qs" (e.g. [0.5, 0.99]) among all records matching
+ * any of the [from, to] pairs in "_ranges". The values are nil if nothing
+ * matched.
+ */
+static
+VALUE MMDB_query_quantiles_ranges(VALUE self, VALUE _ranges, VALUE _current, VALUE _field_idx, VALUE _qs, VALUE _snapshot)
+{
+  Params_query_sketch p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.current = get_RecordModelInstance(_current);
+  assert(p.current->model == p.db->model);
+
+  p.field = p.db->model->get_field(NUM2ULONG(_field_idx));
+  if (!p.field || !p.field->is_numeric())
+  {
+    rb_raise(rb_eArgError, "invalid field");
+  }
+
+  Check_Type(_qs, T_ARRAY);
+  for (long i = 0; i < RARRAY_LEN(_qs); ++i)
   {
-    p.keys[i] = p.from->model->get_field(NUM2ULONG(RARRAY_PTR(_keys)[i]));
-    if (!p.keys[i])
+    double q = NUM2DBL(RARRAY_PTR(_qs)[i]);
+    if (q < 0.0 || q > 1.0)
     {
-      free(p.keys);
-      rb_raise(rb_eArgError, "invalid field");
+      rb_raise(rb_eArgError, "quantile out of range");
     }
   }
-  p.keys[RARRAY_LEN(_keys)] = NULL;
 
-  rb_thread_blocking_region(query_aggregate, &p, NULL, NULL);
+  p.snapshot = NUM2ULONG(_snapshot);
 
-  free(p.keys);
+  VALUE holder;
+  p.ranges = get_ranges(p.db, _ranges, p.num_ranges, holder);
 
-  return Qnil;
-}
+  RM_KLL kll;
+  p.kll = &kll;
+
+  rb_thread_blocking_region(query_quantiles, &p, NULL, NULL);
+  RB_GC_GUARD(holder);
 
+  VALUE res = rb_ary_new();
+  for (long i = 0; i < RARRAY_LEN(_qs); ++i)
+  {
+    if (kll.n == 0)
+      rb_ary_push(res, Qnil);
+    else
+      rb_ary_push(res, rb_float_new(kll.quantile(NUM2DBL(RARRAY_PTR(_qs)[i]))));
+  }
 
+  return res;
+}
 
 /*
  * TODO: in background
@@ -1209,9 +2829,45 @@ VALUE MMDB_slices(VALUE self, VALUE _current, VALUE _snapshot)
   return Qnil;
 }
 
+struct Params_slice_into
+{
+  MMDB *db;
+  size_t slice;
+  RecordModelInstanceArray *arr;
+};
+
+static
+VALUE slice_into(void *a)
+{
+  Params_slice_into *p = (Params_slice_into*)a;
+  return (p->db->read_slice(p->slice, p->arr) ? Qtrue : Qfalse);
+}
+
+/*
+ * Appends all records of slice "_slice" (of the first "_snapshot" slices)
+ * to "_arr". Returns false if "_arr" became full.
+ */
+static
+VALUE MMDB_slice_into(VALUE self, VALUE _slice, VALUE _arr, VALUE _snapshot)
+{
+  Params_slice_into p;
+  Data_Get_Struct(self, MMDB, p.db);
+
+  p.slice = NUM2ULONG(_slice);
+  p.arr = get_RecordModelInstanceArray(_arr);
+  if (p.arr->model != p.db->model)
+    rb_raise(rb_eArgError, "Array has a different model");
+  if (p.slice >= NUM2ULONG(_snapshot) || p.slice >= p.db->get_num_slices_for_read())
+    rb_raise(rb_eArgError, "Invalid slice");
+
+  return rb_thread_blocking_region(slice_into, &p, NULL, NULL);
+}
+
 const int MMDB::ITER_CONTINUE = 0; 
 const int MMDB::ITER_NEXT_SLICE = 1;
 const int MMDB::ITER_STOP = 2;
+const int MMDB::ITER_SCAN_SLICE = 3;
+const uint64_t MMDB::SKIP_LINEAR_MAX;
 
 
 
@@ -1220,15 +2876,35 @@ extern "C"
 void Init_RecordModelMMDBExt()
 {
   VALUE cMMDB = rb_define_class("RecordModelMMDB", rb_cObject);
-  rb_define_singleton_method(cMMDB, "open", (VALUE (*)(...)) MMDB__open, 7);
+  rb_define_singleton_method(cMMDB, "open", (VALUE (*)(...)) MMDB__open, 8);
   rb_define_method(cMMDB, "close", (VALUE (*)(...)) MMDB_close, 0);
   rb_define_method(cMMDB, "put_bulk", (VALUE (*)(...)) MMDB_put_bulk, 1);
+  rb_define_method(cMMDB, "ingest", (VALUE (*)(...)) MMDB_ingest, 11);
+  rb_define_method(cMMDB, "put_sorted", (VALUE (*)(...)) MMDB_put_sorted, 1);
   rb_define_method(cMMDB, "query_each", (VALUE (*)(...)) MMDB_query_each, 4);
   rb_define_method(cMMDB, "query_into", (VALUE (*)(...)) MMDB_query_into, 5);
   rb_define_method(cMMDB, "query_min", (VALUE (*)(...)) MMDB_query_min, 4);
   rb_define_method(cMMDB, "query_count", (VALUE (*)(...)) MMDB_query_count, 4);
   rb_define_method(cMMDB, "query_aggregate", (VALUE (*)(...)) MMDB_query_aggregate, 7);
+  rb_define_method(cMMDB, "query_each_ranges", (VALUE (*)(...)) MMDB_query_each_ranges, 3);
+  rb_define_method(cMMDB, "query_into_ranges", (VALUE (*)(...)) MMDB_query_into_ranges, 4);
+  rb_define_method(cMMDB, "query_count_ranges", (VALUE (*)(...)) MMDB_query_count_ranges, 3);
+  rb_define_method(cMMDB, "query_aggregate_ranges", (VALUE (*)(...)) MMDB_query_aggregate_ranges, 6);
+  rb_define_method(cMMDB, "query_sum_ranges", (VALUE (*)(...)) MMDB_query_sum_ranges, 4);
+  rb_define_method(cMMDB, "query_distinct_ranges", (VALUE (*)(...)) MMDB_query_distinct_ranges, 4);
+  rb_define_method(cMMDB, "query_quantiles_ranges", (VALUE (*)(...)) MMDB_query_quantiles_ranges, 5);
   rb_define_method(cMMDB, "commit", (VALUE (*)(...)) MMDB_commit, 0);
   rb_define_method(cMMDB, "get_snapshot_num", (VALUE (*)(...)) MMDB_get_snapshot_num, 0);
   rb_define_method(cMMDB, "slices", (VALUE (*)(...)) MMDB_slices, 2);
+  rb_define_method(cMMDB, "slice_into", (VALUE (*)(...)) MMDB_slice_into, 3);
+
+  VALUE cExternalSorter = rb_define_class("RecordModelExternalSorter", rb_cObject);
+  rb_define_singleton_method(cExternalSorter, "new", (VALUE (*)(...)) ExternalSorter__new, 4);
+  rb_define_method(cExternalSorter, "<<", (VALUE (*)(...)) ExternalSorter_push, 1);
+  rb_define_method(cExternalSorter, "add_array", (VALUE (*)(...)) ExternalSorter_add_array, 1);
+  rb_define_method(cExternalSorter, "finish", (VALUE (*)(...)) ExternalSorter_finish, 0);
+  rb_define_method(cExternalSorter, "size", (VALUE (*)(...)) ExternalSorter_size, 0);
+  rb_define_method(cExternalSorter, "runs", (VALUE (*)(...)) ExternalSorter_runs, 0);
+  rb_define_method(cExternalSorter, "_each", (VALUE (*)(...)) ExternalSorter_each, 1);
+  rb_define_method(cExternalSorter, "_read_into", (VALUE (*)(...)) ExternalSorter_read_into, 2);
 }
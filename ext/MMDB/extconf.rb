@@ -1,2 +1,11 @@
 require 'mkmf'
+
+# MMDB#ingest reads input with AutoFileReader, so this has to detect the
+# same (optional) formats as ../RecordModel/extconf.rb
+have_library('z') || raise
+have_library('lzma') || raise
+have_header('zstd.h') && have_library('zstd')
+have_header('lz4frame.h') && have_library('lz4')
+have_header('liburing.h') && have_library('uring')
+
 create_makefile('RecordModelMMDBExt') 
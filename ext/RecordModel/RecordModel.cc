@@ -1,10 +1,16 @@
 #include "../../include/RecordModel.h"
 #include "../../include/LineReader.h"
 #include "../../include/AutoFileReader.h"
+#include "../../include/MultiFileReader.h"
+#include "../../include/ParallelLineParser.h"
+#include "../../include/RM_ParsePlan.h"
+#include "../../include/RM_ColumnArray.h"
+#include "../../include/RM_Join.h"
 
 #include <assert.h> // assert
 #include <strings.h> // bzero
 #include <algorithm> // std::max
+#include <set>       // std::set
 #include "ruby.h"
 
 /*
@@ -14,6 +20,7 @@
 static VALUE cRecordModel;
 static VALUE cRecordModelInstance;
 static VALUE cRecordModelInstanceArray;
+static VALUE cRecordModelInstanceColumnArray;
 static VALUE cAutoFileReader; // needed by bulk parse
 
 /*
@@ -52,18 +59,26 @@ AutoFileReader* get_AutoFileReader(VALUE obj)
 }
 
 
+/*
+ * "async" is nil (depending on the file system), true or false. See
+ * AutoFileReader::ReadMode.
+ */
 static VALUE
-AutoFileReader__open(VALUE klass, VALUE path, VALUE bufsz)
+AutoFileReader__open(VALUE klass, VALUE path, VALUE bufsz, VALUE async)
 {
   Check_Type(path, T_STRING);
 
+  AutoFileReader::ReadMode read_mode = AutoFileReader::READ_AUTO;
+  if (async == Qtrue) read_mode = AutoFileReader::READ_ASYNC;
+  else if (async == Qfalse) read_mode = AutoFileReader::READ_MMAP;
+
   VALUE obj = Qnil;
   AutoFileReader *reader = new AutoFileReader();
   if (!reader) {
     return Qnil;
   }
 
-  bool ok = reader->open(RSTRING_PTR(path), NUM2ULONG(bufsz)); 
+  bool ok = reader->open(RSTRING_PTR(path), NUM2ULONG(bufsz), read_mode);
   if (!ok)
   {
     delete reader;
@@ -74,6 +89,32 @@ AutoFileReader__open(VALUE klass, VALUE path, VALUE bufsz)
   return obj;
 }
 
+static VALUE
+AutoFileReader__open_multi(VALUE klass, VALUE paths, VALUE bufsz)
+{
+  Check_Type(paths, T_ARRAY);
+
+  std::vector<std::string> path_list;
+  for (long i = 0; i < RARRAY_LEN(paths); ++i)
+  {
+    VALUE path = rb_ary_entry(paths, i);
+    Check_Type(path, T_STRING);
+    path_list.push_back(std::string(RSTRING_PTR(path), RSTRING_LEN(path)));
+  }
+
+  MultiFileReader *multi = new MultiFileReader();
+  if (!multi->open(path_list, NUM2ULONG(bufsz)))
+  {
+    delete multi;
+    return Qnil;
+  }
+
+  AutoFileReader *reader = new AutoFileReader();
+  reader->open(multi);
+
+  return Data_Wrap_Struct(klass, NULL, AutoFileReader__free, reader);
+}
+
 static VALUE
 AutoFileReader_close(VALUE self)
 {
@@ -362,6 +403,16 @@ VALUE RecordModel_size(VALUE self)
   return UINT2NUM(get_RecordModel(self)->size());
 }
 
+/*
+ * Bytes allocated for the slab pools of RecordModelInstance objects (see
+ * RM_Slab). The pools never shrink, so this is their peak size.
+ */
+static
+VALUE RecordModel__slab_bytes(VALUE klass)
+{
+  return ULONG2NUM(RM_Slab::slab_bytes());
+}
+
 /*
  * RecordModelInstance
  */
@@ -617,6 +668,46 @@ void conv_field_arr(VALUE arr, int *field_arr, int field_arr_sz)
   }
 }
 
+static
+char dialect_char(VALUE opts, const char *key, char def)
+{
+  VALUE v = rb_hash_aref(opts, ID2SYM(rb_intern(key)));
+  if (NIL_P(v))
+    return def;
+  if (v == Qfalse)
+    return 0;
+  Check_Type(v, T_STRING);
+  if (RSTRING_LEN(v) != 1)
+    rb_raise(rb_eArgError, "Single character string expected");
+  return RSTRING_PTR(v)[0];
+}
+
+/*
+ * "_sep" is either a single character string, or a Hash
+ * {:sep => ",", :quote => '"', :escape => '"'} (shown are the defaults) to
+ * parse quoted CSV fields (see RM_Dialect). :escape => false means no escape
+ * character.
+ */
+static
+RM_Dialect get_dialect(VALUE _sep)
+{
+  if (TYPE(_sep) == T_HASH)
+  {
+    RM_Dialect d;
+    d.sep = dialect_char(_sep, "sep", ',');
+    d.quote = dialect_char(_sep, "quote", '"');
+    d.escape = dialect_char(_sep, "escape", d.quote);
+    if (d.sep == 0 || d.quote == 0 || d.sep == d.quote || d.sep == d.escape)
+      rb_raise(rb_eArgError, "Invalid dialect");
+    return d;
+  }
+
+  Check_Type(_sep, T_STRING);
+  if (RSTRING_LEN(_sep) != 1)
+    rb_raise(rb_eArgError, "Single character string expected");
+  return RM_Dialect(RSTRING_PTR(_sep)[0]);
+}
+
 static
 int parse_line(RecordModelInstance *self, const char *str, VALUE _field_arr, char sep, int &err)
 {
@@ -803,6 +894,177 @@ VALUE RecordModelInstanceArray_bulk_set(VALUE _self, VALUE field_idx, VALUE val)
   return Qnil;
 }
 
+static
+RM_Type *RecordModelInstanceArray__column(RecordModelInstanceArray *self, VALUE field_idx, bool numeric)
+{
+  RM_Type *field = self->model->get_field(FIX2UINT(field_idx));
+
+  if (field == NULL)
+  {
+    rb_raise(rb_eArgError, "Wrong index");
+  }
+  if (numeric && !field->is_numeric())
+  {
+    rb_raise(rb_eArgError, "Field is not numeric");
+  }
+
+  return field;
+}
+
+/*
+ * The range of the column operations is given as two records "_from" and "_to",
+ * of which only field "field_idx" is used.
+ */
+static
+void RecordModelInstanceArray__column_range(RecordModelInstanceArray *self, VALUE _from, VALUE _to,
+  RecordModelInstance *&from, RecordModelInstance *&to)
+{
+  from = get_RecordModelInstance(_from);
+  to = get_RecordModelInstance(_to);
+
+  if (self->model != from->model || self->model != to->model)
+  {
+    rb_raise(rb_eArgError, "Model mismatch");
+  }
+}
+
+static
+VALUE RecordModelInstanceArray_column_sum(VALUE _self, VALUE field_idx)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+  RM_Type *field = RecordModelInstanceArray__column(self, field_idx, true);
+  return rb_float_new(self->column_sum(field));
+}
+
+/*
+ * Returns [min, max] of the column, or nil if empty.
+ */
+static
+VALUE RecordModelInstanceArray_column_min_max(VALUE _self, VALUE field_idx)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+  RM_Type *field = RecordModelInstanceArray__column(self, field_idx, false);
+
+  if (self->empty())
+    return Qnil;
+
+  RecordModelInstance *min = RecordModelInstance::allocate(self->model);
+  RecordModelInstance *max = RecordModelInstance::allocate(self->model);
+  assert(min && max);
+
+  self->column_min_max(field, min, max);
+  VALUE res = rb_ary_new3(2, field->to_ruby(min->ptr()), field->to_ruby(max->ptr()));
+
+  RecordModelInstance::deallocate(min);
+  RecordModelInstance::deallocate(max);
+
+  return res;
+}
+
+static
+VALUE RecordModelInstanceArray_column_count(VALUE _self, VALUE field_idx, VALUE _from, VALUE _to)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+  RM_Type *field = RecordModelInstanceArray__column(self, field_idx, false);
+  RecordModelInstance *from, *to;
+  RecordModelInstanceArray__column_range(self, _from, _to, from, to);
+
+  return ULONG2NUM(self->column_count_between(field, from, to));
+}
+
+static
+VALUE RecordModelInstanceArray_column_filter(VALUE _self, VALUE field_idx, VALUE _from, VALUE _to, VALUE _out)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+  RecordModelInstanceArray *out = get_RecordModelInstanceArray(_out);
+  RM_Type *field = RecordModelInstanceArray__column(self, field_idx, false);
+  RecordModelInstance *from, *to;
+  RecordModelInstanceArray__column_range(self, _from, _to, from, to);
+
+  if (out->model != self->model || out == self)
+  {
+    rb_raise(rb_eArgError, "Invalid target array");
+  }
+
+  if (!self->filter_between(field, from, to, out))
+  {
+    rb_raise(rb_eArgError, "Failed to push");
+  }
+
+  return _out;
+}
+
+static
+VALUE RecordModelInstanceArray_column_scale(VALUE _self, VALUE field_idx, VALUE factor)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+  RM_Type *field = RecordModelInstanceArray__column(self, field_idx, true);
+
+  self->column_scale(field, NUM2DBL(factor));
+
+  return _self;
+}
+
+/*
+ * Adds field "field_idx" of record "_rec" to the column.
+ */
+static
+VALUE RecordModelInstanceArray_column_add(VALUE _self, VALUE field_idx, VALUE _rec)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+  RM_Type *field = RecordModelInstanceArray__column(self, field_idx, true);
+  RecordModelInstance *rec = get_RecordModelInstance(_rec);
+
+  if (self->model != rec->model)
+  {
+    rb_raise(rb_eArgError, "Model mismatch");
+  }
+
+  self->column_add(field, rec);
+
+  return _self;
+}
+
+/*
+ * Returns a Hash mapping each distinct value of the column to its number of
+ * occurrences.
+ */
+static
+VALUE RecordModelInstanceArray_column_histogram(VALUE _self, VALUE field_idx)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+  RM_Type *field = RecordModelInstanceArray__column(self, field_idx, false);
+  VALUE hash = rb_hash_new();
+
+  if (self->empty())
+    return hash;
+
+  char *values = (char*)malloc(self->entries() * field->size());
+  uint64_t *counts = (uint64_t*)malloc(self->entries() * sizeof(uint64_t));
+  RecordModelInstance *rec = RecordModelInstance::allocate(self->model);
+
+  if (!values || !counts || !rec)
+  {
+    free(values);
+    free(counts);
+    RecordModelInstance::deallocate(rec);
+    rb_raise(rb_eRuntimeError, "Not enough memory");
+  }
+
+  size_t n = self->column_histogram(field, values, counts);
+  for (size_t k = 0; k < n; ++k)
+  {
+    field->set_from_memory(rec->ptr(), values + k * field->size());
+    rb_hash_aset(hash, field->to_ruby(rec->ptr()), ULONG2NUM(counts[k]));
+  }
+
+  free(values);
+  free(counts);
+  RecordModelInstance::deallocate(rec);
+
+  return hash;
+}
+
 /*
  * If the value of field_idx is equal to val, then yield the record to the block, and
  * write back the modified record.
@@ -838,16 +1100,196 @@ VALUE RecordModelInstanceArray_update_each(VALUE _self, VALUE field_idx, VALUE v
   return Qnil;
 }
 
+/*
+ * Orders indices into a RecordModelInstanceArray by their keys. Index PROBE
+ * refers to the record pointed to by "probe" instead.
+ */
+struct RollupCompare
+{
+  static const size_t PROBE = (size_t)-1;
+
+  RecordModelInstanceArray *arr;
+  const void **probe;
+
+  const void *at(size_t i) const
+  {
+    return (i == PROBE) ? *probe : arr->ptr_at(i);
+  }
+
+  bool operator()(size_t a, size_t b) const
+  {
+    return (RecordModelInstance::compare_keys_ptr(arr->model, at(a), at(b)) < 0);
+  }
+};
+
+const size_t RollupCompare::PROBE;
+
+/*
+ * Projects every record into array "_dst". The fields in "_reset_fields" are set
+ * to their minimum value, and each [field_idx, unit] pair in "_truncate" rounds
+ * down the value of that field to a multiple of unit. Records which end up with
+ * equal keys are combined into one by adding up their numeric values.
+ */
+static
+VALUE RecordModelInstanceArray_rollup_into(VALUE _self, VALUE _dst, VALUE _reset_fields, VALUE _truncate)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+  RecordModelInstanceArray *dst = get_RecordModelInstanceArray(_dst);
+  RecordModel *model = self->model;
+
+  if (dst->model != model)
+  {
+    rb_raise(rb_eArgError, "Model mismatch");
+  }
+
+  Check_Type(_reset_fields, T_ARRAY);
+  Check_Type(_truncate, T_ARRAY);
+
+  std::vector<RM_Type*> reset_fields;
+  for (int i = 0; i < RARRAY_LEN(_reset_fields); ++i)
+  {
+    RM_Type *field = model->get_field(FIX2UINT(RARRAY_PTR(_reset_fields)[i]));
+    if (field == NULL)
+      rb_raise(rb_eArgError, "Wrong index");
+    reset_fields.push_back(field);
+  }
+
+  std::vector< std::pair<RM_Type*, uint64_t> > truncate;
+  for (int i = 0; i < RARRAY_LEN(_truncate); ++i)
+  {
+    VALUE pair = RARRAY_PTR(_truncate)[i];
+    Check_Type(pair, T_ARRAY);
+    if (RARRAY_LEN(pair) != 2)
+      rb_raise(rb_eArgError, "Expected [field_idx, unit] pairs");
+    RM_Type *field = model->get_field(FIX2UINT(RARRAY_PTR(pair)[0]));
+    if (field == NULL)
+      rb_raise(rb_eArgError, "Wrong index");
+    truncate.push_back(std::make_pair(field, (uint64_t)NUM2ULONG(RARRAY_PTR(pair)[1])));
+  }
+
+  RecordModelInstance *rec = RecordModelInstance::allocate(model);
+  assert(rec);
+
+  const void *probe = rec->ptr();
+  RollupCompare cmp;
+  cmp.arr = dst;
+  cmp.probe = &probe;
+  std::set<size_t, RollupCompare> index(cmp);
+
+  for (size_t i = 0; i < dst->entries(); ++i)
+  {
+    index.insert(i);
+  }
+
+  for (size_t i = 0; i < self->entries(); ++i)
+  {
+    self->copy_out(rec, i);
+
+    for (size_t k = 0; k < reset_fields.size(); ++k)
+    {
+      reset_fields[k]->set_min(rec->ptr());
+    }
+
+    for (size_t k = 0; k < truncate.size(); ++k)
+    {
+      if (!truncate[k].first->truncate(rec->ptr(), truncate[k].second))
+      {
+        RecordModelInstance::deallocate(rec);
+        rb_raise(rb_eArgError, "Field cannot be truncated");
+      }
+    }
+
+    std::set<size_t, RollupCompare>::iterator it = index.find(RollupCompare::PROBE);
+    if (it != index.end())
+    {
+      RecordModelInstance entry(model, dst->ptr_at(*it));
+      entry.add_numeric_values(rec);
+    }
+    else
+    {
+      if (!dst->push(rec))
+      {
+        RecordModelInstance::deallocate(rec);
+        rb_raise(rb_eArgError, "Failed to push");
+      }
+      index.insert(dst->entries() - 1);
+    }
+  }
+
+  RecordModelInstance::deallocate(rec);
+
+  return _dst;
+}
+
+/*
+ * Sorts the array and collapses records with equal keys into one by adding up
+ * their numeric values.
+ */
+static
+VALUE RecordModelInstanceArray_combine(VALUE _self)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+
+  if (!self->combine())
+  {
+    rb_raise(rb_eRuntimeError, "Not enough memory");
+  }
+
+  return _self;
+}
+
+/*
+ * Builds the parse plan of bulk parsing. "_field_arr" is either an Array of
+ * field indices (or nil to skip a token) for separated tokens, or a Hash
+ * mapping keys (Strings) to field indices for JSON lines. "_sep" is not used
+ * for the latter.
+ *
+ * Also used by ../MMDB/MMDB.cc
+ */
+RM_ParsePlan *make_parse_plan(RecordModel *model, VALUE _field_arr, VALUE _sep)
+{
+  if (TYPE(_field_arr) == T_HASH)
+  {
+    VALUE _keys = rb_funcall(_field_arr, rb_intern("keys"), 0);
+    VALUE _fields = rb_funcall(_field_arr, rb_intern("values"), 0);
+    validate_field_arr(model, _fields);
+
+    std::vector<std::string> keys;
+    std::vector<int> fields;
+    for (long i = 0; i < RARRAY_LEN(_keys); ++i)
+    {
+      VALUE key = rb_ary_entry(_keys, i);
+      VALUE fld = rb_ary_entry(_fields, i);
+      Check_Type(key, T_STRING);
+      if (NIL_P(fld))
+        rb_raise(rb_eArgError, "Field index expected");
+      keys.push_back(std::string(RSTRING_PTR(key), RSTRING_LEN(key)));
+      fields.push_back((int)FIX2UINT(fld));
+    }
+    return new RM_ParsePlan(model, keys, fields.empty() ? NULL : &fields[0]);
+  }
+
+  Check_Type(_field_arr, T_ARRAY);
+  validate_field_arr(model, _field_arr);
+  RM_Dialect dialect = get_dialect(_sep);
+
+  int field_arr_sz = RARRAY_LEN(_field_arr);
+  int *field_arr = new int[field_arr_sz];
+  conv_field_arr(_field_arr, field_arr, field_arr_sz);
+  RM_ParsePlan *plan = new RM_ParsePlan(model, field_arr, field_arr_sz, dialect);
+  delete [] field_arr;
+  return plan;
+}
+
 struct Params
 {
   RecordModelInstanceArray *self;
   RecordModelInstance *rec;
-  int *field_arr;
-  int field_arr_sz;
   VALUE _rec;
   size_t lines_read; 
 
   LineReader *linereader;
+  RM_ParsePlan *plan;
   char *buf;
   size_t bufsz;
   int fd;
@@ -859,8 +1301,6 @@ struct Params
   bool reject_invalid_num_tokens;
   int min_num_tokens;
   int max_num_tokens;
-
-  char sep;
 };
 
 static
@@ -880,7 +1320,7 @@ static
 VALUE bulk_parse_line(void *ptr)
 {
   Params *p = (Params*)ptr;
-  char *line = NULL;
+  const char *line, *line_end;
 
   while (true)
   {
@@ -888,16 +1328,13 @@ VALUE bulk_parse_line(void *ptr)
     {
       return Qtrue;
     }
-    line = p->linereader->readline();
-    if (!line)
+    if (!p->linereader->next_line(line, line_end))
     {
       return Qfalse;
     }
     ++p->lines_read;
 
-    p->rec->zero();
-
-    p->num_tokens = p->rec->parse_line(line, p->field_arr, p->field_arr_sz, p->sep, p->parse_error);
+    p->num_tokens = p->plan->parse_line(p->rec, line, line_end, p->parse_error);
     if (p->parse_error)
     {
       // We either reject item for which a parse error occured, or we have 
@@ -941,22 +1378,9 @@ VALUE RecordModelInstanceArray_bulk_parse_line(VALUE _self, VALUE _rec, VALUE _r
   p._rec = _rec;
   p.self = get_RecordModelInstanceArray(_self);
   p.rec = get_RecordModelInstance(p._rec);
-  Check_Type(_field_arr, T_ARRAY);
-  Check_Type(_sep, T_STRING);
-  validate_field_arr(p.self->model, _field_arr);
 
   AutoFileReader *reader = get_AutoFileReader(_reader);
 
-  if (RSTRING_LEN(_sep) != 1)
-    rb_raise(rb_eArgError, "Single character string expected");
-
-  p.sep = RSTRING_PTR(_sep)[0];
-
-  p.field_arr_sz = RARRAY_LEN(_field_arr); 
-  p.field_arr = new int[p.field_arr_sz];
-
-  conv_field_arr(_field_arr, p.field_arr, p.field_arr_sz);
-
   p.lines_read = 0;
   p.reject_token_parse_error = RTEST(_reject_token_parse_error);
   p.reject_invalid_num_tokens = RTEST(_reject_invalid_num_tokens);
@@ -964,10 +1388,14 @@ VALUE RecordModelInstanceArray_bulk_parse_line(VALUE _self, VALUE _rec, VALUE _r
   p.max_num_tokens = NUM2INT(_max_num_tokens);
 
   size_t bufsz = NUM2INT(_bufsz);
+
+  RM_ParsePlan *plan = make_parse_plan(p.self->model, _field_arr, _sep);
+  p.plan = plan;
+
   char *buf = (char*)malloc(bufsz);
   if (!buf)
   {
-    delete [] p.field_arr;
+    delete plan;
     rb_raise(rb_eRuntimeError, "Not enough memory");
   }
 
@@ -976,12 +1404,150 @@ VALUE RecordModelInstanceArray_bulk_parse_line(VALUE _self, VALUE _rec, VALUE _r
 
   VALUE res = rb_thread_blocking_region(bulk_parse_line, &p, NULL, NULL);
 
-  delete [] p.field_arr;
+  if (res == Qtrue)
+  {
+    // give back what was read ahead, so the next call continues with it
+    size_t rest_len;
+    const char *rest = lr.rest(rest_len);
+    reader->unread(rest, rest_len);
+  }
+
+  delete plan;
   free(buf);
 
   return rb_ary_new3(2, res, ULONG2NUM(p.lines_read));
 }
 
+static
+VALUE bulk_parse_line_parallel(void *ptr)
+{
+  ParallelLineParser *parser = (ParallelLineParser*)ptr;
+  return INT2NUM(parser->run());
+}
+
+/*
+ * Like bulk_parse_line, but parses on "_num_threads" threads. Lines with a parse error
+ * or an invalid number of tokens are always rejected (no block is called).
+ *
+ * Returns [more, lines_read, [[lines_read, lines_ok, parse_errors, invalid_num_tokens], ...]]
+ * with the last element containing the counts of each thread.
+ */
+static
+VALUE RecordModelInstanceArray_bulk_parse_line_parallel(VALUE _self, VALUE _reader, VALUE _field_arr, VALUE _sep, VALUE _chunk_size,
+  VALUE _min_num_tokens, VALUE _max_num_tokens, VALUE _num_threads)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+  AutoFileReader *reader = get_AutoFileReader(_reader);
+
+  size_t num_threads = NUM2ULONG(_num_threads);
+  size_t chunk_size = NUM2ULONG(_chunk_size);
+  if (num_threads == 0 || chunk_size == 0)
+    rb_raise(rb_eArgError, "Invalid number of threads or chunk size");
+
+  RM_ParsePlan *plan = make_parse_plan(self->model, _field_arr, _sep);
+
+  ParallelLineParser *parser = new ParallelLineParser(self, reader, plan,
+    NUM2INT(_min_num_tokens), NUM2INT(_max_num_tokens), num_threads, chunk_size);
+
+  int res = NUM2INT(rb_thread_blocking_region(bulk_parse_line_parallel, parser, NULL, NULL));
+
+  VALUE thread_stats = rb_ary_new2(num_threads);
+  for (size_t t = 0; t < num_threads; ++t)
+  {
+    const ParallelLineParser::Stats &st = parser->thread_stats(t);
+    rb_ary_push(thread_stats, rb_ary_new3(4, ULONG2NUM(st.lines_read), ULONG2NUM(st.lines_ok),
+      ULONG2NUM(st.parse_errors), ULONG2NUM(st.invalid_num_tokens)));
+  }
+  size_t lines_read = parser->stats.lines_read;
+
+  delete parser;
+  delete plan;
+
+  if (res < 0)
+    rb_raise(rb_eRuntimeError, "bulk_parse_line_parallel failed");
+
+  return rb_ary_new3(3, (res > 0) ? Qtrue : Qfalse, ULONG2NUM(lines_read), thread_stats);
+}
+
+static
+VALUE join(void *ptr)
+{
+  RecordModelJoin *j = (RecordModelJoin*)ptr;
+  return INT2NUM(j->run());
+}
+
+/*
+ * Joins this (left) array with "_right" into "_target" (see RecordModelJoin).
+ * "_left_keys" and "_right_keys" are Arrays of field indices of equal length,
+ * "_maps" is an Array of [target_field_idx, from_right, src_field_idx].
+ *
+ * Returns the number of joined pairs.
+ */
+static
+VALUE RecordModelInstanceArray_join(VALUE _self, VALUE _right, VALUE _left_keys, VALUE _right_keys,
+  VALUE _target, VALUE _maps, VALUE _num_threads, VALUE _combine)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+  RecordModelInstanceArray *right = get_RecordModelInstanceArray(_right);
+  RecordModelInstanceArray *target = get_RecordModelInstanceArray(_target);
+
+  Check_Type(_left_keys, T_ARRAY);
+  Check_Type(_right_keys, T_ARRAY);
+  Check_Type(_maps, T_ARRAY);
+
+  if (RARRAY_LEN(_left_keys) == 0 || RARRAY_LEN(_left_keys) != RARRAY_LEN(_right_keys))
+    rb_raise(rb_eArgError, "Invalid join keys");
+  if (target == self || target == right)
+    rb_raise(rb_eArgError, "Invalid target array");
+
+  size_t num_threads = NUM2ULONG(_num_threads);
+  if (num_threads == 0)
+    rb_raise(rb_eArgError, "Invalid number of threads");
+
+  RecordModelJoin *j = new RecordModelJoin(self, right, target, num_threads, RTEST(_combine));
+  const char *err = NULL;
+
+  for (int i = 0; i < RARRAY_LEN(_left_keys) && !err; ++i)
+  {
+    RM_Type *l = self->model->get_field(FIX2UINT(RARRAY_PTR(_left_keys)[i]));
+    RM_Type *r = right->model->get_field(FIX2UINT(RARRAY_PTR(_right_keys)[i]));
+    if (l == NULL || r == NULL || !j->add_key(l, r))
+      err = "Invalid join keys";
+  }
+
+  for (int i = 0; i < RARRAY_LEN(_maps) && !err; ++i)
+  {
+    VALUE m = RARRAY_PTR(_maps)[i];
+    if (TYPE(m) != T_ARRAY || RARRAY_LEN(m) != 3)
+    {
+      err = "Invalid field mapping";
+      break;
+    }
+    bool from_right = RTEST(RARRAY_PTR(m)[1]);
+    RM_Type *dst = target->model->get_field(FIX2UINT(RARRAY_PTR(m)[0]));
+    RM_Type *src = (from_right ? right : self)->model->get_field(FIX2UINT(RARRAY_PTR(m)[2]));
+    if (dst == NULL || src == NULL || !j->add_field(dst, src, from_right))
+      err = "Invalid field mapping";
+  }
+
+  if (err)
+  {
+    delete j;
+    rb_raise(rb_eArgError, "%s", err);
+  }
+
+  int res = NUM2INT(rb_thread_blocking_region(join, j, NULL, NULL));
+  size_t pairs = j->pairs;
+  delete j;
+
+  if (res == RecordModelJoin::JOIN_NOT_SORTED)
+    rb_raise(rb_eArgError, "Input not sorted by the join keys");
+  if (res != RecordModelJoin::JOIN_OK)
+    rb_raise(rb_eRuntimeError, "Not enough memory");
+
+  return ULONG2NUM(pairs);
+}
+
 static
 VALUE RecordModelInstanceArray_push(VALUE _self, VALUE _rec)
 {
@@ -1052,6 +1618,30 @@ VALUE RecordModelInstanceArray_each(VALUE _self, VALUE _rec)
   return Qnil;
 }
 
+/*
+ * Like _each, but yields a new instance of "klass" (from the slab pools) for
+ * every record, without the need to dup it in Ruby.
+ */
+static
+VALUE RecordModelInstanceArray_each_dup(VALUE _self, VALUE klass)
+{
+  RecordModelInstanceArray *self = get_RecordModelInstanceArray(_self);
+
+  if (self->model != get_RecordModel(RecordModelInstance__model(klass)))
+  {
+    rb_raise(rb_eArgError, "Model mismatch");
+  }
+
+  for (size_t i = 0; i < self->entries(); ++i)
+  {
+    VALUE obj = RecordModelInstance__allocate2(klass, false);
+    self->copy_out(get_RecordModelInstance_nocheck(obj), i);
+    rb_yield(obj);
+  }
+
+  return Qnil;
+}
+
 static
 VALUE RecordModelInstanceArray_sort(VALUE _self, VALUE _keys)
 {
@@ -1081,14 +1671,246 @@ VALUE RecordModelInstanceArray_sort(VALUE _self, VALUE _keys)
   return _self;
 }
 
+/*
+ * RecordModelInstanceColumnArray
+ */
+
+static
+void RecordModelInstanceColumnArray__free(void *ptr)
+{
+  RecordModelInstanceColumnArray *arr = (RecordModelInstanceColumnArray*)ptr;
+  if (arr)
+  {
+    delete arr;
+  }
+}
+
+static
+void RecordModelInstanceColumnArray__mark(void *ptr)
+{
+  RecordModelInstanceColumnArray *arr = (RecordModelInstanceColumnArray*)ptr;
+  if (arr)
+  {
+    mark_RecordModel(arr->model);
+  }
+}
+
+static
+VALUE RecordModelInstanceColumnArray__allocate(VALUE klass)
+{
+  VALUE obj;
+  obj = Data_Wrap_Struct(klass, RecordModelInstanceColumnArray__mark, RecordModelInstanceColumnArray__free, new RecordModelInstanceColumnArray());
+  return obj;
+}
+
+bool is_RecordModelInstanceColumnArray(VALUE obj)
+{
+  return (TYPE(obj) == T_DATA && 
+      RDATA(obj)->dfree == (RUBY_DATA_FUNC)(RecordModelInstanceColumnArray__free));
+}
+
+RecordModelInstanceColumnArray* get_RecordModelInstanceColumnArray(VALUE obj)
+{
+  if (!is_RecordModelInstanceColumnArray(obj))
+  {
+    rb_raise(rb_eTypeError, "wrong argument type");
+  }
+  RecordModelInstanceColumnArray *ptr;
+  Data_Get_Struct(obj, RecordModelInstanceColumnArray, ptr);
+  assert(ptr);
+  return ptr;
+}
+
+static
+VALUE RecordModelInstanceColumnArray_initialize(VALUE _self, VALUE modelklass, VALUE _n, VALUE _expandable)
+{
+  RecordModelInstanceColumnArray *self = get_RecordModelInstanceColumnArray(_self);
+
+  if (!self->is_virgin())
+  {
+    rb_raise(rb_eArgError, "Already initialized");
+  }
+
+  self->model = get_RecordModel(RecordModelInstance__model(modelklass));
+  self->expandable = RTEST(_expandable);
+
+  if (!self->allocate(NUM2ULONG(_n)))
+  {
+    rb_raise(rb_eArgError, "Failed to allocate memory");
+  }
+
+  return Qnil;
+}
+
+static
+VALUE RecordModelInstanceColumnArray_is_empty(VALUE _self)
+{
+  return get_RecordModelInstanceColumnArray(_self)->empty() ? Qtrue : Qfalse;
+}
+
+static
+VALUE RecordModelInstanceColumnArray_is_full(VALUE _self)
+{
+  RecordModelInstanceColumnArray *self = get_RecordModelInstanceColumnArray(_self);
+
+  if (self->expandable)
+    rb_raise(rb_eArgError, "Called #full? for expandable RecordModelInstanceColumnArray"); 
+
+  return self->full() ? Qtrue : Qfalse;
+}
+
+static
+VALUE RecordModelInstanceColumnArray_size(VALUE _self)
+{
+  return ULONG2NUM(get_RecordModelInstanceColumnArray(_self)->entries());
+}
+
+static
+VALUE RecordModelInstanceColumnArray_capacity(VALUE _self)
+{
+  return ULONG2NUM(get_RecordModelInstanceColumnArray(_self)->capacity());
+}
+
+static
+VALUE RecordModelInstanceColumnArray_reset(VALUE _self)
+{
+  get_RecordModelInstanceColumnArray(_self)->reset();
+  return _self;
+}
+
+static
+VALUE RecordModelInstanceColumnArray_push(VALUE _self, VALUE _rec)
+{
+  RecordModelInstanceColumnArray *self = get_RecordModelInstanceColumnArray(_self);
+  const RecordModelInstance *rec = (const RecordModelInstance*)get_RecordModelInstance(_rec);
+
+  if (self->model != rec->model)
+  {
+    rb_raise(rb_eArgError, "Model mismatch");
+  }
+
+  if (!self->push(rec))
+  {
+    rb_raise(rb_eArgError, "Failed to push");
+  }
+ 
+  return _self;
+}
+
+/*
+ * Only the column of "field_idx" is written.
+ */
+static
+VALUE RecordModelInstanceColumnArray_bulk_set(VALUE _self, VALUE field_idx, VALUE val)
+{
+  RecordModelInstanceColumnArray *self = get_RecordModelInstanceColumnArray(_self);
+  RM_Type *field = self->model->get_field(FIX2UINT(field_idx));
+
+  if (field == NULL)
+  {
+    rb_raise(rb_eArgError, "Wrong index");
+  }
+
+  RecordModelInstance *rec = RecordModelInstance::allocate(self->model);
+  assert(rec);
+  field->set_from_ruby(rec->ptr(), val);
+  uint8_t mem[256];
+  field->copy_to_memory(rec->ptr(), mem);
+  RecordModelInstance::deallocate(rec);
+
+  self->fill(FIX2UINT(field_idx), mem);
+
+  return Qnil;
+}
+
+/*
+ * Yields a new instance of "klass" for every record (in sorted order).
+ */
+static
+VALUE RecordModelInstanceColumnArray_each_dup(VALUE _self, VALUE klass)
+{
+  RecordModelInstanceColumnArray *self = get_RecordModelInstanceColumnArray(_self);
+
+  if (self->model != get_RecordModel(RecordModelInstance__model(klass)))
+  {
+    rb_raise(rb_eArgError, "Model mismatch");
+  }
+
+  for (size_t i = 0; i < self->entries(); ++i)
+  {
+    VALUE obj = RecordModelInstance__allocate2(klass, false);
+    self->copy_out(get_RecordModelInstance_nocheck(obj), i);
+    rb_yield(obj);
+  }
+
+  return Qnil;
+}
+
+static
+VALUE RecordModelInstanceColumnArray_each(VALUE _self, VALUE _rec)
+{
+  RecordModelInstanceColumnArray *self = get_RecordModelInstanceColumnArray(_self);
+  RecordModelInstance *rec = get_RecordModelInstance(_rec);
+
+  if (self->model != rec->model)
+  {
+    rb_raise(rb_eArgError, "Model mismatch");
+  }
+
+  for (size_t i = 0; i < self->entries(); ++i)
+  {
+    self->copy_out(rec, i);
+    rb_yield(_rec);
+  }
+
+  return Qnil;
+}
+
+static
+VALUE RecordModelInstanceColumnArray_sort(VALUE _self, VALUE _keys)
+{
+  RecordModelInstanceColumnArray *self = get_RecordModelInstanceColumnArray(_self);
+  std::vector<RM_Type*> keys;
+
+  if (!NIL_P(_keys))
+  {
+    Check_Type(_keys, T_ARRAY);
+    for (int i = 0; i < RARRAY_LEN(_keys); ++i)
+    {
+      RM_Type *field = self->model->get_field(FIX2UINT(RARRAY_PTR(_keys)[i]));
+      if (field == NULL)
+        rb_raise(rb_eArgError, "Wrong index");
+      keys.push_back(field);
+    }
+    keys.push_back(NULL);
+  }
+  
+  self->sort(keys.empty() ? NULL : &keys[0]);
+
+  return _self;
+}
+
  
 extern "C"
 void Init_RecordModelExt()
 {
   cAutoFileReader = rb_define_class("AutoFileReader", rb_cObject);
-  rb_define_singleton_method(cAutoFileReader, "_open", (VALUE (*)(...)) AutoFileReader__open, 2);
+  rb_define_singleton_method(cAutoFileReader, "_open", (VALUE (*)(...)) AutoFileReader__open, 3);
+  rb_define_singleton_method(cAutoFileReader, "_open_multi", (VALUE (*)(...)) AutoFileReader__open_multi, 2);
   rb_define_method(cAutoFileReader, "close", (VALUE (*)(...)) AutoFileReader_close, 0);
   rb_define_method(cAutoFileReader, "read", (VALUE (*)(...)) AutoFileReader_read, 1);
+
+  // compressed input formats (file suffixes) supported by this build
+  VALUE formats = rb_ary_new();
+  rb_ary_push(formats, rb_str_new2("gz"));
+  rb_ary_push(formats, rb_str_new2("xz"));
+#ifdef HAVE_ZSTD_H
+  rb_ary_push(formats, rb_str_new2("zst"));
+#endif
+#ifdef HAVE_LZ4FRAME_H
+  rb_ary_push(formats, rb_str_new2("lz4"));
+#endif
+  rb_define_const(cAutoFileReader, "FORMATS", rb_obj_freeze(formats));
   
 
   cRecordModel = rb_define_class("RecordModel", rb_cObject);
@@ -1096,6 +1918,7 @@ void Init_RecordModelExt()
   rb_define_method(cRecordModel, "initialize", (VALUE (*)(...)) RecordModel_initialize, 1);
   rb_define_method(cRecordModel, "to_class", (VALUE (*)(...)) RecordModel_to_class, 0);
   rb_define_method(cRecordModel, "size", (VALUE (*)(...)) RecordModel_size, 0);
+  rb_define_singleton_method(cRecordModel, "slab_bytes", (VALUE (*)(...)) RecordModel__slab_bytes, 0);
 
   cRecordModelInstance = rb_define_class("RecordModelInstance", rb_cObject);
   rb_define_method(cRecordModelInstance, "[]", (VALUE (*)(...)) RecordModelInstance_get, 1);
@@ -1116,13 +1939,39 @@ void Init_RecordModelExt()
   rb_define_method(cRecordModelInstanceArray, "empty?", (VALUE (*)(...)) RecordModelInstanceArray_is_empty, 0);
   rb_define_method(cRecordModelInstanceArray, "full?", (VALUE (*)(...)) RecordModelInstanceArray_is_full, 0);
   rb_define_method(cRecordModelInstanceArray, "bulk_set", (VALUE (*)(...)) RecordModelInstanceArray_bulk_set, 2);
+  rb_define_method(cRecordModelInstanceArray, "_column_sum", (VALUE (*)(...)) RecordModelInstanceArray_column_sum, 1);
+  rb_define_method(cRecordModelInstanceArray, "_column_min_max", (VALUE (*)(...)) RecordModelInstanceArray_column_min_max, 1);
+  rb_define_method(cRecordModelInstanceArray, "_column_count", (VALUE (*)(...)) RecordModelInstanceArray_column_count, 3);
+  rb_define_method(cRecordModelInstanceArray, "_column_filter", (VALUE (*)(...)) RecordModelInstanceArray_column_filter, 4);
+  rb_define_method(cRecordModelInstanceArray, "_column_scale", (VALUE (*)(...)) RecordModelInstanceArray_column_scale, 2);
+  rb_define_method(cRecordModelInstanceArray, "_column_add", (VALUE (*)(...)) RecordModelInstanceArray_column_add, 2);
+  rb_define_method(cRecordModelInstanceArray, "_column_histogram", (VALUE (*)(...)) RecordModelInstanceArray_column_histogram, 1);
+  rb_define_method(cRecordModelInstanceArray, "_join", (VALUE (*)(...)) RecordModelInstanceArray_join, 7);
   rb_define_method(cRecordModelInstanceArray, "bulk_parse_line", (VALUE (*)(...)) RecordModelInstanceArray_bulk_parse_line, 9);
+  rb_define_method(cRecordModelInstanceArray, "bulk_parse_line_parallel", (VALUE (*)(...)) RecordModelInstanceArray_bulk_parse_line_parallel, 7);
   rb_define_method(cRecordModelInstanceArray, "<<", (VALUE (*)(...)) RecordModelInstanceArray_push, 1);
   rb_define_method(cRecordModelInstanceArray, "reset", (VALUE (*)(...)) RecordModelInstanceArray_reset, 0);
   rb_define_method(cRecordModelInstanceArray, "size", (VALUE (*)(...)) RecordModelInstanceArray_size, 0);
   rb_define_method(cRecordModelInstanceArray, "capacity", (VALUE (*)(...)) RecordModelInstanceArray_capacity, 0);
   rb_define_method(cRecordModelInstanceArray, "expandable?", (VALUE (*)(...)) RecordModelInstanceArray_expandable, 0);
   rb_define_method(cRecordModelInstanceArray, "_each", (VALUE (*)(...)) RecordModelInstanceArray_each, 1);
+  rb_define_method(cRecordModelInstanceArray, "_each_dup", (VALUE (*)(...)) RecordModelInstanceArray_each_dup, 1);
   rb_define_method(cRecordModelInstanceArray, "_update_each", (VALUE (*)(...)) RecordModelInstanceArray_update_each, 3);
   rb_define_method(cRecordModelInstanceArray, "_sort", (VALUE (*)(...)) RecordModelInstanceArray_sort, 1);
+  rb_define_method(cRecordModelInstanceArray, "_rollup_into", (VALUE (*)(...)) RecordModelInstanceArray_rollup_into, 3);
+  rb_define_method(cRecordModelInstanceArray, "combine!", (VALUE (*)(...)) RecordModelInstanceArray_combine, 0);
+
+  cRecordModelInstanceColumnArray = rb_define_class("RecordModelInstanceColumnArray", rb_cObject);
+  rb_define_alloc_func(cRecordModelInstanceColumnArray, RecordModelInstanceColumnArray__allocate);
+  rb_define_method(cRecordModelInstanceColumnArray, "initialize", (VALUE (*)(...)) RecordModelInstanceColumnArray_initialize, 3);
+  rb_define_method(cRecordModelInstanceColumnArray, "empty?", (VALUE (*)(...)) RecordModelInstanceColumnArray_is_empty, 0);
+  rb_define_method(cRecordModelInstanceColumnArray, "full?", (VALUE (*)(...)) RecordModelInstanceColumnArray_is_full, 0);
+  rb_define_method(cRecordModelInstanceColumnArray, "size", (VALUE (*)(...)) RecordModelInstanceColumnArray_size, 0);
+  rb_define_method(cRecordModelInstanceColumnArray, "capacity", (VALUE (*)(...)) RecordModelInstanceColumnArray_capacity, 0);
+  rb_define_method(cRecordModelInstanceColumnArray, "reset", (VALUE (*)(...)) RecordModelInstanceColumnArray_reset, 0);
+  rb_define_method(cRecordModelInstanceColumnArray, "<<", (VALUE (*)(...)) RecordModelInstanceColumnArray_push, 1);
+  rb_define_method(cRecordModelInstanceColumnArray, "bulk_set", (VALUE (*)(...)) RecordModelInstanceColumnArray_bulk_set, 2);
+  rb_define_method(cRecordModelInstanceColumnArray, "_each", (VALUE (*)(...)) RecordModelInstanceColumnArray_each, 1);
+  rb_define_method(cRecordModelInstanceColumnArray, "_each_dup", (VALUE (*)(...)) RecordModelInstanceColumnArray_each_dup, 1);
+  rb_define_method(cRecordModelInstanceColumnArray, "_sort", (VALUE (*)(...)) RecordModelInstanceColumnArray_sort, 1);
 }
@@ -2,4 +2,11 @@ require 'mkmf'
 
 have_library('z') || raise
 have_library('lzma') || raise
+
+# optional input formats of AutoFileReader
+have_header('zstd.h') && have_library('zstd')
+have_header('lz4frame.h') && have_library('lz4')
+
+# asynchronous reads (AsyncFileReader), otherwise a thread pool is used
+have_header('liburing.h') && have_library('uring')
 create_makefile('RecordModelExt')
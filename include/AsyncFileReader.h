@@ -0,0 +1,541 @@
+#ifndef __ASYNC_FILE_READER__HEADER__
+#define __ASYNC_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>  // pread
+#include <pthread.h> // pthread_create
+#include <stdlib.h>  // malloc
+#include <string.h>  // memcpy
+#include <stdint.h>  // uintptr_t
+#include <errno.h>
+#include <assert.h>
+#ifdef HAVE_LIBURING_H
+#include <liburing.h>
+#endif
+
+/*
+ * Reads a regular file with several large reads in flight, so that the
+ * I/O latency (e.g. of a network-attached volume) overlaps with parsing.
+ *
+ * The file is read in blocks of "bufsize" bytes. Block "b" is read into
+ * slot "b % depth" of a ring of buffers, at most "depth" blocks ahead of the
+ * block read() currently returns data from.
+ *
+ * With io_uring (HAVE_LIBURING_H), the reads are submitted into registered
+ * (fixed) buffers. If io_uring is not compiled in or not available at
+ * runtime, "depth" threads issue the reads with pread() instead.
+ *
+ * read_span returns the completed blocks directly from their slots. A slot
+ * is given back for the next read once the following read() or read_span()
+ * call is made, so a span stays valid until then.
+ */
+class AsyncFileReader : public FileReader
+{
+  enum SlotState { SLOT_FREE, SLOT_PENDING, SLOT_DONE, SLOT_ERROR };
+
+  struct Slot
+  {
+    char *data;
+    size_t len;       // bytes read so far
+    size_t want;      // bytes of the block
+    size_t offs;      // consumed by read()
+    SlotState state;
+  };
+
+  int fd;
+  size_t file_size;
+  size_t bufsize;
+  size_t depth;
+  Slot *slots;
+
+  size_t num_blocks;
+  size_t head;        // block read() returns data from
+  size_t next_block;  // next block to issue a read for
+  bool span_held;     // slot of "head" was returned by read_span
+
+  // thread pool (without io_uring)
+  pthread_t *threads;
+  size_t num_threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond_done;
+  pthread_cond_t cond_free;
+  bool stop;
+
+#ifdef HAVE_LIBURING_H
+  struct io_uring ring;
+  bool use_uring;
+#endif
+
+  public:
+
+    AsyncFileReader()
+    {
+      fd = -1;
+      slots = NULL;
+      threads = NULL;
+      num_threads = 0;
+#ifdef HAVE_LIBURING_H
+      use_uring = false;
+#endif
+    }
+
+    ~AsyncFileReader()
+    {
+      if (fd >= 0) close();
+    }
+
+    /*
+     * Fails for anything but a regular file.
+     */
+    bool open(const char *path, size_t bufsize = 1L << 20, size_t depth = 4)
+    {
+      assert(fd == -1);
+      assert(bufsize > 0 && depth > 0);
+
+      fd = ::open(path, O_RDONLY);
+      if (fd == -1)
+        return false;
+
+      struct stat st;
+      if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+      {
+        ::close(fd); fd = -1;
+        return false;
+      }
+
+      this->file_size = st.st_size;
+      this->bufsize = bufsize;
+      this->depth = depth;
+      this->num_blocks = (file_size + bufsize - 1) / bufsize;
+      this->head = 0;
+      this->next_block = 0;
+      this->span_held = false;
+      this->stop = false;
+
+      slots = (Slot*)calloc(depth, sizeof(Slot));
+      if (!slots)
+      {
+        ::close(fd); fd = -1;
+        return false;
+      }
+      for (size_t i = 0; i < depth; ++i)
+      {
+        slots[i].data = (char*)malloc(bufsize);
+        slots[i].state = SLOT_FREE;
+        if (!slots[i].data)
+        {
+          free_slots();
+          ::close(fd); fd = -1;
+          return false;
+        }
+      }
+
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+#ifdef HAVE_LIBURING_H
+      if (start_uring())
+        return true;
+#endif
+      if (!start_threads())
+      {
+        free_slots();
+        ::close(fd); fd = -1;
+        return false;
+      }
+      return true;
+    }
+
+    virtual void close()
+    {
+      assert(fd >= 0);
+
+#ifdef HAVE_LIBURING_H
+      if (use_uring)
+      {
+        stop_uring();
+      }
+      else
+#endif
+      {
+        stop_threads();
+      }
+
+      free_slots();
+      ::close(fd);
+      fd = -1;
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(fd >= 0);
+
+      release_span();
+
+      if (head >= num_blocks || buflen == 0)
+        return 0;
+
+      Slot &s = slots[head % depth];
+
+      if (!wait_for(s))
+        return -1;
+
+      size_t n = s.len - s.offs;
+      if (n > buflen) n = buflen;
+      memcpy(buf, s.data + s.offs, n);
+      s.offs += n;
+
+      if (s.offs == s.len)
+      {
+        // a short block (file truncated while reading) ends the input
+        release(s, s.len < s.want);
+      }
+
+      return n;
+    }
+
+    virtual bool read_span(const char *&data, size_t &len)
+    {
+      assert(fd >= 0);
+
+      release_span();
+
+      data = NULL;
+      len = 0;
+      if (head >= num_blocks)
+        return true;
+
+      Slot &s = slots[head % depth];
+
+      if (!wait_for(s))
+        return false;
+
+      data = s.data + s.offs;
+      len = s.len - s.offs;
+      s.offs = s.len;
+      span_held = true;
+      return true;
+    }
+
+    virtual bool unread_span(const char *data, size_t len)
+    {
+      if (!span_held)
+        return false;
+
+      Slot &s = slots[head % depth];
+      if (len > s.offs || data + len != s.data + s.offs)
+        return false;
+      s.offs -= len;
+      return true;
+    }
+
+  private:
+
+    /*
+     * Gives back the slot of the last span, unless part of it was unread.
+     */
+    void release_span()
+    {
+      if (!span_held)
+        return;
+      span_held = false;
+
+      Slot &s = slots[head % depth];
+      if (s.offs == s.len)
+      {
+        // a short block (file truncated while reading) ends the input
+        release(s, s.len < s.want);
+      }
+    }
+
+    size_t block_len(size_t b) const
+    {
+      size_t offs = b * bufsize;
+      return (file_size - offs < bufsize) ? (file_size - offs) : bufsize;
+    }
+
+    void free_slots()
+    {
+      for (size_t i = 0; i < depth; ++i)
+      {
+        free(slots[i].data);
+      }
+      free(slots);
+      slots = NULL;
+    }
+
+    /*
+     * Waits until the current block is read. Returns false on a read error.
+     */
+    bool wait_for(Slot &s)
+    {
+#ifdef HAVE_LIBURING_H
+      if (use_uring)
+      {
+        while (s.state == SLOT_PENDING)
+        {
+          if (!complete_uring())
+            return false;
+        }
+        return (s.state == SLOT_DONE);
+      }
+#endif
+      pthread_mutex_lock(&mutex);
+      while (s.state == SLOT_PENDING || s.state == SLOT_FREE)
+      {
+        pthread_cond_wait(&cond_done, &mutex);
+      }
+      pthread_mutex_unlock(&mutex);
+      return (s.state == SLOT_DONE);
+    }
+
+    /*
+     * The current block is consumed, its slot can take the next read.
+     */
+    void release(Slot &s, bool last)
+    {
+#ifdef HAVE_LIBURING_H
+      if (use_uring)
+      {
+        s.state = SLOT_FREE;
+        if (last) num_blocks = head + 1;
+        ++head;
+        submit_uring();
+        return;
+      }
+#endif
+      pthread_mutex_lock(&mutex);
+      s.state = SLOT_FREE;
+      if (last) num_blocks = head + 1;
+      ++head;
+      pthread_cond_broadcast(&cond_free);
+      pthread_mutex_unlock(&mutex);
+    }
+
+    /*
+     * Reads the whole block "b" into "s" with pread. Returns false on error.
+     */
+    bool pread_block(Slot &s, size_t b)
+    {
+      while (s.len < s.want)
+      {
+        ssize_t n = pread(fd, s.data + s.len, s.want - s.len, b * bufsize + s.len);
+        if (n < 0)
+        {
+          if (errno == EINTR) continue;
+          return false;
+        }
+        if (n == 0) break; // truncated
+        s.len += n;
+      }
+      return true;
+    }
+
+    bool start_threads()
+    {
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&cond_done, NULL);
+      pthread_cond_init(&cond_free, NULL);
+
+      threads = (pthread_t*)malloc(sizeof(pthread_t) * depth);
+      if (!threads)
+      {
+        stop_threads();
+        return false;
+      }
+      for (num_threads = 0; num_threads < depth; ++num_threads)
+      {
+        if (pthread_create(&threads[num_threads], NULL, run_thread, this) != 0)
+          break;
+      }
+      if (num_threads == 0)
+      {
+        stop_threads();
+        return false;
+      }
+      return true;
+    }
+
+    void stop_threads()
+    {
+      pthread_mutex_lock(&mutex);
+      stop = true;
+      pthread_cond_broadcast(&cond_free);
+      pthread_mutex_unlock(&mutex);
+
+      for (size_t t = 0; t < num_threads; ++t)
+      {
+        pthread_join(threads[t], NULL);
+      }
+      free(threads);
+      threads = NULL;
+      num_threads = 0;
+
+      pthread_mutex_destroy(&mutex);
+      pthread_cond_destroy(&cond_done);
+      pthread_cond_destroy(&cond_free);
+    }
+
+    static void *run_thread(void *ptr)
+    {
+      AsyncFileReader *r = (AsyncFileReader*)ptr;
+
+      pthread_mutex_lock(&r->mutex);
+      for (;;)
+      {
+        // claim the next block, once its slot is free
+        while (!r->stop && r->next_block < r->num_blocks &&
+               !(r->next_block < r->head + r->depth && r->slots[r->next_block % r->depth].state == SLOT_FREE))
+        {
+          pthread_cond_wait(&r->cond_free, &r->mutex);
+        }
+        if (r->stop || r->next_block >= r->num_blocks)
+          break;
+
+        size_t b = r->next_block++;
+        Slot &s = r->slots[b % r->depth];
+        s.state = SLOT_PENDING;
+        s.len = 0;
+        s.offs = 0;
+        s.want = r->block_len(b);
+        pthread_mutex_unlock(&r->mutex);
+
+        bool ok = r->pread_block(s, b);
+
+        pthread_mutex_lock(&r->mutex);
+        s.state = ok ? SLOT_DONE : SLOT_ERROR;
+        pthread_cond_broadcast(&r->cond_done);
+      }
+      pthread_mutex_unlock(&r->mutex);
+
+      return NULL;
+    }
+
+#ifdef HAVE_LIBURING_H
+
+    bool start_uring()
+    {
+      if (io_uring_queue_init(depth, &ring, 0) != 0)
+        return false;
+
+      struct iovec *iov = (struct iovec*)malloc(sizeof(struct iovec) * depth);
+      if (!iov)
+      {
+        io_uring_queue_exit(&ring);
+        return false;
+      }
+      for (size_t i = 0; i < depth; ++i)
+      {
+        iov[i].iov_base = slots[i].data;
+        iov[i].iov_len = bufsize;
+      }
+      int err = io_uring_register_buffers(&ring, iov, depth);
+      free(iov);
+      if (err != 0)
+      {
+        io_uring_queue_exit(&ring);
+        return false;
+      }
+
+      use_uring = true;
+      submit_uring();
+      return true;
+    }
+
+    void stop_uring()
+    {
+      // wait for the reads in flight, the kernel writes into our buffers
+      for (size_t i = 0; i < depth; ++i)
+      {
+        while (slots[i].state == SLOT_PENDING)
+        {
+          if (!complete_uring())
+          {
+            slots[i].state = SLOT_ERROR;
+            break;
+          }
+        }
+      }
+      io_uring_unregister_buffers(&ring);
+      io_uring_queue_exit(&ring);
+      use_uring = false;
+    }
+
+    void prep_read(size_t b)
+    {
+      Slot &s = slots[b % depth];
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+      assert(sqe); // at most "depth" reads are in flight
+      io_uring_prep_read_fixed(sqe, fd, s.data + s.len, s.want - s.len, b * bufsize + s.len, b % depth);
+      io_uring_sqe_set_data(sqe, (void*)(uintptr_t)b);
+    }
+
+    /*
+     * Issues reads for all blocks whose slot is free.
+     */
+    void submit_uring()
+    {
+      bool any = false;
+      while (next_block < num_blocks && next_block < head + depth &&
+             slots[next_block % depth].state == SLOT_FREE)
+      {
+        size_t b = next_block++;
+        Slot &s = slots[b % depth];
+        s.state = SLOT_PENDING;
+        s.len = 0;
+        s.offs = 0;
+        s.want = block_len(b);
+        prep_read(b);
+        any = true;
+      }
+      if (any)
+        io_uring_submit(&ring);
+    }
+
+    /*
+     * Waits for one completion. Short reads are resubmitted for the rest
+     * of the block. Returns false if waiting failed.
+     */
+    bool complete_uring()
+    {
+      struct io_uring_cqe *cqe;
+      int err = io_uring_wait_cqe(&ring, &cqe);
+      if (err == -EINTR) return true;
+      if (err != 0) return false;
+
+      size_t b = (size_t)(uintptr_t)io_uring_cqe_get_data(cqe);
+      int res = cqe->res;
+      io_uring_cqe_seen(&ring, cqe);
+
+      Slot &s = slots[b % depth];
+      if (res == -EINTR || res == -EAGAIN)
+      {
+        prep_read(b);
+        io_uring_submit(&ring);
+      }
+      else if (res < 0)
+      {
+        s.state = SLOT_ERROR;
+      }
+      else
+      {
+        s.len += res;
+        if (res > 0 && s.len < s.want)
+        {
+          prep_read(b);
+          io_uring_submit(&ring);
+        }
+        else
+        {
+          s.state = SLOT_DONE; // res == 0 means truncated
+        }
+      }
+      return true;
+    }
+
+#endif
+};
+
+#endif
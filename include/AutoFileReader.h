@@ -3,55 +3,269 @@
 
 #include "FileReader.h"
 #include "PosixFileReader.h"
+#include "MmapFileReader.h"
 #include "GzipFileReader.h"
 #include "XzFileReader.h"
+#include "BgzfFileReader.h"
+#include "ThreadedFileReader.h"
+#include "AsyncFileReader.h"
+#ifdef HAVE_ZSTD_H
+#include "ZstdFileReader.h"
+#endif
+#ifdef HAVE_LZ4FRAME_H
+#include "Lz4FileReader.h"
+#endif
 #include <assert.h>
 #include <string.h> // strlen
 #include <strings.h> // strncasecmp
+#include <stdlib.h>  // malloc
+#include <sys/stat.h> // fstat
+#ifdef __linux__
+#include <sys/vfs.h>  // statfs
+#endif
+#include <fcntl.h>
+#include <unistd.h>
 
 /*
- * Depending on the filename suffix uses a different FileReader.
+ * Depending on the file format uses a different FileReader. Plain files
+ * are memory mapped if possible. Compressed files are decompressed on a
+ * background thread (ThreadedFileReader), BGZF files even on multiple.
+ *
+ * Zstandard (.zst) and LZ4 (.lz4) support is only compiled in if the
+ * libraries were found (HAVE_ZSTD_H, HAVE_LZ4FRAME_H).
  */
 class AutoFileReader : public FileReader
 {
   PosixFileReader p_fr;
+  MmapFileReader m_fr;
   GzipFileReader gz_fr;
   XzFileReader xz_fr;
+  BgzfFileReader bgzf_fr;
+  AsyncFileReader a_fr;
+  ThreadedFileReader t_fr;
+#ifdef HAVE_ZSTD_H
+  ZstdFileReader zstd_fr;
+#endif
+#ifdef HAVE_LZ4FRAME_H
+  Lz4FileReader lz4_fr;
+#endif
 
   FileReader *file;
+  FileReader *owned;
+
+  // data given back by unread(), returned by read() before anything else
+  char *pushback;
+  size_t pushback_len;
+  size_t pushback_offs;
 
   public:
 
     AutoFileReader()
     {
       file = NULL;
+      owned = NULL;
+      pushback = NULL;
+      pushback_len = 0;
+      pushback_offs = 0;
     }
 
-    bool open(const char *path, unsigned bufsize = 1L << 16)
+    ~AutoFileReader()
     {
-      assert(file == NULL);
+      if (pushback) free(pushback);
+      if (owned) delete owned;
+    }
+
+    enum Format
+    {
+      FORMAT_UNKNOWN = 0,
+      FORMAT_PLAIN,
+      FORMAT_GZIP,
+      FORMAT_XZ,
+      FORMAT_ZSTD,
+      FORMAT_LZ4
+    };
+
+    /*
+     * Determines the format of a regular file by its magic bytes. Returns
+     * FORMAT_UNKNOWN for anything else (pipes, devices...) which must not
+     * be read twice, or if the file cannot be read.
+     */
+    static Format sniff_format(const char *path)
+    {
+      int fd = ::open(path, O_RDONLY);
+      if (fd == -1)
+        return FORMAT_UNKNOWN;
+
+      unsigned char m[6];
+      ssize_t n = 0;
+      struct stat st;
+      if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        n = ::read(fd, m, sizeof(m));
+      else
+        n = -1;
+      ::close(fd);
 
+      if (n < 0)
+        return FORMAT_UNKNOWN;
+      if (n >= 2 && m[0] == 0x1F && m[1] == 0x8B)
+        return FORMAT_GZIP;
+      if (n >= 6 && memcmp(m, "\xFD" "7zXZ\0", 6) == 0)
+        return FORMAT_XZ;
+      if (n >= 4 && memcmp(m, "\x28\xB5\x2F\xFD", 4) == 0)
+        return FORMAT_ZSTD;
+      if (n >= 4 && memcmp(m, "\x04\x22\x4D\x18", 4) == 0)
+        return FORMAT_LZ4;
+      return FORMAT_PLAIN;
+    }
+
+    static Format suffix_format(const char *path)
+    {
       int slen = strlen(path);
 
       if (slen >= 3 && strncasecmp(&path[slen-3], ".xz", 3) == 0)
+        return FORMAT_XZ;
+      if (slen >= 3 && strncasecmp(&path[slen-3], ".gz", 3) == 0)
+        return FORMAT_GZIP;
+      if ((slen >= 4 && strncasecmp(&path[slen-4], ".zst", 4) == 0) ||
+          (slen >= 5 && strncasecmp(&path[slen-5], ".zstd", 5) == 0))
+        return FORMAT_ZSTD;
+      if (slen >= 4 && strncasecmp(&path[slen-4], ".lz4", 4) == 0)
+        return FORMAT_LZ4;
+      return FORMAT_PLAIN;
+    }
+
+    enum ReadMode
+    {
+      READ_AUTO = 0,  // READ_ASYNC on network file systems, otherwise READ_MMAP
+      READ_MMAP,
+      READ_ASYNC
+    };
+
+    /*
+     * Returns true if "path" is on a network (or FUSE) file system, where
+     * each page fault of a memory mapping is a round trip.
+     */
+    static bool is_network_fs(const char *path)
+    {
+#ifdef __linux__
+      struct statfs st;
+      if (statfs(path, &st) != 0)
+        return false;
+
+      switch ((unsigned long)st.f_type)
       {
-        if (!xz_fr.open(path, bufsize)) return false; 
-	file = &xz_fr;
-      }
-      else if (slen >= 3 && strncasecmp(&path[slen-3], ".gz", 3) == 0)
-      {
-        if (!gz_fr.open(path, bufsize)) return false;
-	file = &gz_fr;
+        case 0x6969UL:      // NFS
+        case 0x517BUL:      // SMB
+        case 0xFF534D42UL:  // CIFS
+        case 0xFE534D42UL:  // SMB2
+        case 0x00C36400UL:  // Ceph
+        case 0x65735546UL:  // FUSE
+        case 0x5346414FUL:  // AFS
+        case 0x01021997UL:  // 9P
+        case 0x0BD00BD0UL:  // Lustre
+          return true;
       }
-      else
+#endif
+      return false;
+    }
+
+    /*
+     * Compressed files are recognized by their magic bytes, falling back to
+     * the filename suffix if the file cannot be sniffed (e.g. a named pipe)
+     * or does not start with any known magic. Fails for a compressed format
+     * that is not compiled in.
+     *
+     * Uncompressed regular files are either memory mapped or read with
+     * several reads in flight (AsyncFileReader), see ReadMode.
+     */
+    bool open(const char *path, unsigned bufsize = 1L << 16, ReadMode read_mode = READ_AUTO)
+    {
+      assert(file == NULL);
+
+      Format format = sniff_format(path);
+      if (format == FORMAT_UNKNOWN || format == FORMAT_PLAIN)
+        format = suffix_format(path);
+
+      switch (format)
       {
-        if (!p_fr.open(path)) return false;
-	file = &p_fr;
+        case FORMAT_XZ:
+          if (!xz_fr.open(path, bufsize)) return false; 
+          file = background(&xz_fr, bufsize);
+          break;
+
+        case FORMAT_GZIP:
+          if (bgzf_fr.open(path))
+          {
+            file = background(&bgzf_fr, bufsize);
+          }
+          else
+          {
+            if (!gz_fr.open(path, bufsize)) return false;
+            file = background(&gz_fr, bufsize);
+          }
+          break;
+
+        case FORMAT_ZSTD:
+#ifdef HAVE_ZSTD_H
+          if (!zstd_fr.open(path, bufsize)) return false;
+          file = background(&zstd_fr, bufsize);
+          break;
+#else
+          return false;
+#endif
+
+        case FORMAT_LZ4:
+#ifdef HAVE_LZ4FRAME_H
+          if (!lz4_fr.open(path, bufsize)) return false;
+          file = background(&lz4_fr, bufsize);
+          break;
+#else
+          return false;
+#endif
+
+        default:
+          if (read_mode == READ_AUTO)
+            read_mode = is_network_fs(path) ? READ_ASYNC : READ_MMAP;
+
+          if (read_mode == READ_ASYNC && a_fr.open(path, (bufsize < (1L << 20)) ? (1L << 20) : bufsize))
+          {
+            file = &a_fr;
+          }
+          else if (m_fr.open(path))
+          {
+            file = &m_fr;
+          }
+          else
+          {
+            if (!p_fr.open(path)) return false;
+            file = &p_fr;
+          }
       }
 
       return true;
     }
 
+    /*
+     * Reads from "reader" (e.g. a MultiFileReader), which is closed and
+     * deleted by close().
+     */
+    bool open(FileReader *reader)
+    {
+      assert(file == NULL);
+      owned = reader;
+      file = reader;
+      return true;
+    }
+
+    /*
+     * Hints the kernel to read ahead a memory mapped file.
+     */
+    void prefetch()
+    {
+      if (file == &m_fr)
+        m_fr.willneed();
+    }
+
     virtual void close()
     {
       if (file)
@@ -59,13 +273,80 @@ class AutoFileReader : public FileReader
         file->close();
         file = NULL;
       }
+      if (owned)
+      {
+        delete owned;
+        owned = NULL;
+      }
+      pushback_len = 0;
+      pushback_offs = 0;
     }
 
     virtual ssize_t read(void *buf, size_t buflen)
     {
       assert(file);
+      if (pushback_offs < pushback_len)
+      {
+        size_t n = pushback_len - pushback_offs;
+        if (n > buflen) n = buflen;
+        memcpy(buf, pushback + pushback_offs, n);
+        pushback_offs += n;
+        return n;
+      }
       return file->read(buf, buflen);
     }
+
+    virtual bool read_span(const char *&data, size_t &len)
+    {
+      assert(file);
+      if (file != &m_fr && file != &a_fr)
+        return false;
+
+      if (pushback_offs < pushback_len)
+      {
+        data = pushback + pushback_offs;
+        len = pushback_len - pushback_offs;
+        pushback_offs = pushback_len;
+        return true;
+      }
+      return file->read_span(data, len);
+    }
+
+    /*
+     * Gives back "len" bytes which were read ahead but not consumed (e.g. when
+     * an array was filled up in the middle of a buffer). They are returned by
+     * the next calls to read(), in front of any not yet returned pushed back
+     * data.
+     */
+    bool unread(const char *data, size_t len)
+    {
+      if (len == 0) return true;
+
+      size_t rest = pushback_len - pushback_offs;
+
+      // data from a memory mapping is not copied, just the position moved back
+      if (rest == 0 && file && file->unread_span(data, len))
+        return true;
+
+      char *p = (char*)malloc(len + rest);
+      if (!p) return false;
+
+      memcpy(p, data, len);
+      if (rest > 0) memcpy(p + len, pushback + pushback_offs, rest);
+
+      if (pushback) free(pushback);
+      pushback = p;
+      pushback_len = len + rest;
+      pushback_offs = 0;
+      return true;
+    }
+
+  private:
+
+    FileReader *background(FileReader *fr, size_t bufsize)
+    {
+      return t_fr.open(fr, bufsize) ? (FileReader*)&t_fr : fr;
+    }
 };
 
 #endif
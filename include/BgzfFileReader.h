@@ -0,0 +1,414 @@
+#ifndef __BGZF_FILE_READER__HEADER__
+#define __BGZF_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include "PosixFileReader.h"
+#include <zlib.h>
+#include <pthread.h> // pthread_create
+#include <unistd.h>  // sysconf
+#include <stdlib.h>  // malloc
+#include <string.h>  // memcpy
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * Decompresses blocked gzip files (BGZF, as written by bgzip) on multiple
+ * threads.
+ *
+ * A BGZF file is a series of gzip members of at most 64 KB each, whose extra
+ * field contains the compressed size of the member ("BC" subfield). This
+ * allows to find the member boundaries without decompressing, and each
+ * member decompresses independently. A batch of members is read and then
+ * decompressed by "num_threads" threads, each taking every n-th member.
+ * The threads are started by open() and wait for the next batch until the
+ * reader is closed; the calling thread takes the share of the first one.
+ *
+ * open() fails for ordinary gzip files, which have no such index and have to
+ * be decompressed sequentially (GzipFileReader).
+ */
+class BgzfFileReader : public FileReader
+{
+  static const size_t MAX_BLOCK = 1 << 16;
+  static const size_t BATCH_PER_THREAD = 16;
+
+  struct Block
+  {
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+    bool ok;
+  };
+
+  struct Worker
+  {
+    BgzfFileReader *reader;
+    size_t index;
+  };
+
+  PosixFileReader pf;
+  FileReader *file;
+
+  size_t num_threads;
+  Block *blocks;
+  size_t num_blocks;     // blocks in the current batch
+  size_t cur_block;      // next block to return data from
+  size_t cur_offs;
+  bool is_eof;
+
+  // worker pool (worker 0 is the calling thread)
+  pthread_t *threads;
+  Worker *workers;
+  size_t num_workers;    // started threads
+  pthread_mutex_t mutex;
+  pthread_cond_t cond_work;
+  pthread_cond_t cond_done;
+  size_t generation;     // incremented for every batch
+  size_t busy;           // threads not yet done with the batch
+  bool stop;
+
+  public:
+
+    BgzfFileReader()
+    {
+      file = NULL;
+      blocks = NULL;
+      threads = NULL;
+      workers = NULL;
+      num_workers = 0;
+    }
+
+    /*
+     * Returns false if the file cannot be opened or is no BGZF file.
+     */
+    bool open(const char *path, size_t num_threads = 0)
+    {
+      assert(file == NULL);
+
+      if (!pf.open(path))
+        return false;
+
+      unsigned char hdr[18];
+      if (!read_fully(&pf, hdr, sizeof(hdr)) || block_size(hdr) == 0)
+      {
+        pf.close();
+        return false;
+      }
+      // start again at the beginning
+      pf.close();
+      if (!pf.open(path))
+        return false;
+
+      if (num_threads == 0)
+      {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (n > 0) ? n : 1;
+      }
+
+      // sets "this->num_threads" to the number of threads actually started
+      if (!start_pool(num_threads))
+      {
+        pf.close();
+        return false;
+      }
+
+      size_t batch = this->num_threads * BATCH_PER_THREAD;
+      blocks = (Block*)calloc(batch, sizeof(Block));
+      if (!blocks)
+      {
+        stop_pool();
+        pf.close();
+        return false;
+      }
+      for (size_t i = 0; i < batch; ++i)
+      {
+        blocks[i].in = (unsigned char*)malloc(MAX_BLOCK);
+        blocks[i].out = (unsigned char*)malloc(MAX_BLOCK);
+        if (!blocks[i].in || !blocks[i].out)
+        {
+          stop_pool();
+          pf.close();
+          free_blocks(batch);
+          return false;
+        }
+      }
+
+      file = &pf;
+      num_blocks = 0;
+      cur_block = 0;
+      cur_offs = 0;
+      is_eof = false;
+      return true;
+    }
+
+    virtual void close()
+    {
+      assert(file);
+      stop_pool();
+      file->close(); file = NULL;
+      free_blocks(num_threads * BATCH_PER_THREAD);
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(file);
+
+      while (cur_block == num_blocks || cur_offs == blocks[cur_block].out_len)
+      {
+        if (cur_block < num_blocks)
+        {
+          ++cur_block;
+          cur_offs = 0;
+          continue;
+        }
+        if (is_eof)
+          return 0;
+        if (!next_batch())
+          return -1;
+      }
+
+      Block &b = blocks[cur_block];
+      size_t n = b.out_len - cur_offs;
+      if (n > buflen) n = buflen;
+      memcpy(buf, b.out + cur_offs, n);
+      cur_offs += n;
+      return n;
+    }
+
+  private:
+
+    void free_blocks(size_t batch)
+    {
+      for (size_t i = 0; i < batch; ++i)
+      {
+        free(blocks[i].in);
+        free(blocks[i].out);
+      }
+      free(blocks);
+      blocks = NULL;
+    }
+
+    static bool read_fully(FileReader *f, unsigned char *buf, size_t len)
+    {
+      size_t got = 0;
+      while (got < len)
+      {
+        ssize_t n = f->read(buf + got, len - got);
+        if (n <= 0) return false;
+        got += n;
+      }
+      return true;
+    }
+
+    static inline unsigned get16(const unsigned char *p)
+    {
+      return p[0] | (p[1] << 8);
+    }
+
+    static inline uint32_t get32(const unsigned char *p)
+    {
+      return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    /*
+     * Returns the total size of the member starting with the 18 byte header
+     * "hdr", or 0 if it is no BGZF member.
+     */
+    static size_t block_size(const unsigned char *hdr)
+    {
+      if (hdr[0] != 31 || hdr[1] != 139 || hdr[2] != 8 || !(hdr[3] & 4))
+        return 0;
+      if (get16(hdr + 10) != 6 || hdr[12] != 'B' || hdr[13] != 'C' || get16(hdr + 14) != 2)
+        return 0;
+      return get16(hdr + 16) + 1;
+    }
+
+    /*
+     * Reads up to a batch of members and decompresses them.
+     */
+    bool next_batch()
+    {
+      size_t batch = num_threads * BATCH_PER_THREAD;
+      num_blocks = 0;
+      cur_block = 0;
+      cur_offs = 0;
+
+      while (num_blocks < batch)
+      {
+        Block &b = blocks[num_blocks];
+
+        ssize_t n = file->read(b.in, 1);
+        if (n < 0) return false;
+        if (n == 0)
+        {
+          is_eof = true;
+          break;
+        }
+        if (!read_fully(file, b.in + 1, 17))
+          return false;
+
+        size_t size = block_size(b.in);
+        if (size < 18 + 8)
+          return false;
+        if (!read_fully(file, b.in + 18, size - 18))
+          return false;
+
+        b.in_len = size;
+        b.out_len = 0;
+        b.ok = false;
+        ++num_blocks;
+      }
+
+      // hand the batch to the pool, and take the share of worker 0
+      pthread_mutex_lock(&mutex);
+      busy = num_workers;
+      ++generation;
+      pthread_cond_broadcast(&cond_work);
+      pthread_mutex_unlock(&mutex);
+
+      inflate_blocks(&workers[0]);
+
+      pthread_mutex_lock(&mutex);
+      while (busy > 0)
+      {
+        pthread_cond_wait(&cond_done, &mutex);
+      }
+      pthread_mutex_unlock(&mutex);
+
+      for (size_t i = 0; i < num_blocks; ++i)
+      {
+        if (!blocks[i].ok)
+          return false;
+      }
+      return true;
+    }
+
+    /*
+     * Starts up to "n" - 1 threads. Only fails if out of memory.
+     */
+    bool start_pool(size_t n)
+    {
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&cond_work, NULL);
+      pthread_cond_init(&cond_done, NULL);
+      generation = 0;
+      busy = 0;
+      stop = false;
+      num_workers = 0;
+
+      threads = (pthread_t*)malloc(sizeof(pthread_t) * n);
+      workers = (Worker*)malloc(sizeof(Worker) * n);
+      if (!threads || !workers)
+      {
+        stop_pool();
+        return false;
+      }
+
+      workers[0].reader = this;
+      workers[0].index = 0;
+      for (size_t t = 1; t < n; ++t)
+      {
+        workers[t].reader = this;
+        workers[t].index = t;
+        if (pthread_create(&threads[t], NULL, run_worker, &workers[t]) != 0)
+          break;
+        ++num_workers;
+      }
+
+      // the started threads are 1 .. num_workers, so every member is taken
+      num_threads = 1 + num_workers;
+      return true;
+    }
+
+    void stop_pool()
+    {
+      pthread_mutex_lock(&mutex);
+      stop = true;
+      pthread_cond_broadcast(&cond_work);
+      pthread_mutex_unlock(&mutex);
+
+      for (size_t t = 1; t <= num_workers; ++t)
+      {
+        pthread_join(threads[t], NULL);
+      }
+      free(threads); threads = NULL;
+      free(workers); workers = NULL;
+      num_workers = 0;
+
+      pthread_mutex_destroy(&mutex);
+      pthread_cond_destroy(&cond_work);
+      pthread_cond_destroy(&cond_done);
+    }
+
+    static void *run_worker(void *ptr)
+    {
+      Worker *w = (Worker*)ptr;
+      BgzfFileReader *r = w->reader;
+      size_t seen = 0;
+
+      pthread_mutex_lock(&r->mutex);
+      for (;;)
+      {
+        while (!r->stop && r->generation == seen)
+        {
+          pthread_cond_wait(&r->cond_work, &r->mutex);
+        }
+        if (r->stop)
+          break;
+        seen = r->generation;
+        pthread_mutex_unlock(&r->mutex);
+
+        inflate_blocks(w);
+
+        pthread_mutex_lock(&r->mutex);
+        if (--r->busy == 0)
+          pthread_cond_signal(&r->cond_done);
+      }
+      pthread_mutex_unlock(&r->mutex);
+
+      return NULL;
+    }
+
+    static void *inflate_blocks(void *ptr)
+    {
+      Worker *w = (Worker*)ptr;
+      BgzfFileReader *r = w->reader;
+
+      for (size_t i = w->index; i < r->num_blocks; i += r->num_threads)
+      {
+        inflate_block(r->blocks[i]);
+      }
+      return NULL;
+    }
+
+    static void inflate_block(Block &b)
+    {
+      const unsigned char *trailer = b.in + b.in_len - 8;
+      uint32_t crc = get32(trailer);
+      size_t isize = get32(trailer + 4);
+      if (isize > MAX_BLOCK)
+        return;
+
+      z_stream zs;
+      memset(&zs, 0, sizeof(zs));
+      if (inflateInit2(&zs, -15) != Z_OK) // raw deflate
+        return;
+
+      zs.next_in = b.in + 18;
+      zs.avail_in = b.in_len - 18 - 8;
+      zs.next_out = b.out;
+      zs.avail_out = MAX_BLOCK;
+      int ret = inflate(&zs, Z_FINISH);
+      inflateEnd(&zs);
+
+      if (ret != Z_STREAM_END || zs.total_out != isize)
+        return;
+      if (crc32(crc32(0L, Z_NULL, 0), b.out, isize) != crc)
+        return;
+
+      b.out_len = isize;
+      b.ok = true;
+    }
+};
+
+#endif
@@ -1,14 +1,36 @@
 #ifndef __FILE_READER__HEADER__
 #define __FILE_READER__HEADER__
 
+#include <sys/types.h> // ssize_t, size_t
+
 /*
  * Common interface for file reading
  */
 class FileReader
 {
   public:
+    virtual ~FileReader() {}
     virtual ssize_t read(void *buf, size_t buflen) = 0;
     virtual void close() = 0;
+
+    /*
+     * Zero-copy reading. Returns false if not supported by the reader.
+     * Otherwise "data" points to the next "len" bytes of the input (len == 0
+     * on end of input), which are consumed by this call. Also returns false
+     * on a read error (a following read() reports it).
+     *
+     * A reader might return its input in several spans, which can end in
+     * the middle of a line. Memory of a mapped file stays valid until the
+     * reader is closed, otherwise (AsyncFileReader) only until the next
+     * call to read or read_span.
+     */
+    virtual bool read_span(const char *&data, size_t &len) { return false; }
+
+    /*
+     * Gives back the last "len" consumed bytes, if they were returned
+     * by read_span and end at "data + len". Returns false if not possible.
+     */
+    virtual bool unread_span(const char *data, size_t len) { return false; }
 };
 
 #endif
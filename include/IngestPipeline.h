@@ -0,0 +1,334 @@
+#ifndef __INGEST_PIPELINE__HEADER__
+#define __INGEST_PIPELINE__HEADER__
+
+#include "RecordModel.h"
+#include "AutoFileReader.h"
+#include "RM_ParsePlan.h"
+#include "ParallelLineParser.h"
+#include <pthread.h> // pthread_create
+#include <assert.h>  // assert
+#include <deque>     // std::deque
+#include <vector>    // std::vector
+
+/*
+ * Reads all lines of an AutoFileReader, parses them on multiple threads
+ * (ParallelLineParser) into a pool of arrays, and stores each filled array
+ * in two phases:
+ *
+ *   - prepare (e.g. MMDB::prepare_bulk, which sorts the array and computes
+ *     the slice meta data) on one of "num_preparers" threads, after
+ *     combining records with equal keys if "combine" is set, and
+ *
+ *   - store (e.g. MMDB::store_bulk, which writes the slice) on a single
+ *     writer thread, in the order the arrays were filled. With more than
+ *     one preparer, arrays might be prepared out of order. They are then
+ *     held back until all arrays filled before them are stored.
+ *
+ * So while one array is written, the next ones are parsed and prepared.
+ *
+ * The pool consists of "num_arrays" arrays of "array_size" records each,
+ * which is the depth of the pipeline: An array is either free, being filled,
+ * waiting to be or being prepared, waiting to be or being stored. If no
+ * array is free, parsing waits until the writer thread gives one back
+ * (backpressure), so memory use is bounded by the pool no matter how fast
+ * the input can be read.
+ *
+ * Nothing calls back into Ruby, so run() can be called outside the GVL.
+ * Lines with a parse error or an invalid number of tokens are rejected and
+ * counted, like ParallelLineParser does.
+ */
+struct IngestPipeline
+{
+  /*
+   * The result of prepare is passed on to store. "prepare" might be NULL,
+   * then store gets NULL.
+   */
+  typedef void *(*prepare_fn)(void *store_data, RecordModelInstanceArray *arr);
+  typedef void (*store_fn)(void *store_data, RecordModelInstanceArray *arr, void *prepared);
+
+  struct Prepared
+  {
+    RecordModelInstanceArray *arr;
+    void *prepared;
+    size_t seq;             // position in the order the arrays were filled
+  };
+
+  AutoFileReader *reader;
+  const RM_ParsePlan *plan;
+  int min_num_tokens;
+  int max_num_tokens;
+  size_t num_threads;
+  size_t chunk_size;
+
+  prepare_fn prepare;
+  store_fn store;
+  void *store_data;
+  size_t num_preparers;
+  bool combine;             // RecordModelInstanceArray::combine before prepare
+
+  size_t array_size;
+  size_t num_arrays;
+  RecordModelInstanceArray *arrays;
+
+  std::deque<RecordModelInstanceArray*> free_q;    // ready to be filled
+  std::deque<Prepared> prepare_q;                  // filled, waiting for a preparer
+  std::deque<Prepared> store_q;                    // prepared, waiting for the writer (ordered by seq)
+  size_t next_fill_seq;                            // seq of the next filled array
+  size_t next_store_seq;                           // seq of the next array to store
+  bool parsing_done;                               // nothing more is queued for preparing
+  size_t active_preparers;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond_free;
+  pthread_cond_t cond_prepare;
+  pthread_cond_t cond_store;
+
+  ParallelLineParser::Stats stats;
+  size_t records_stored;
+  size_t arrays_stored;
+
+  IngestPipeline(AutoFileReader *reader, const RM_ParsePlan *plan, int min_num_tokens, int max_num_tokens,
+                 size_t num_threads, size_t chunk_size, size_t array_size, size_t num_arrays,
+                 prepare_fn prepare, store_fn store, void *store_data, size_t num_preparers = 1)
+  {
+    assert(num_threads > 0);
+    assert(chunk_size > 0);
+    assert(array_size > 0);
+    assert(num_arrays > 0);
+    assert(num_preparers > 0);
+
+    this->reader = reader;
+    this->plan = plan;
+    this->min_num_tokens = min_num_tokens;
+    this->max_num_tokens = max_num_tokens;
+    this->num_threads = num_threads;
+    this->chunk_size = chunk_size;
+    this->prepare = prepare;
+    this->store = store;
+    this->store_data = store_data;
+    this->num_preparers = num_preparers;
+    this->combine = false;
+    this->array_size = array_size;
+    this->num_arrays = num_arrays;
+    this->arrays = new RecordModelInstanceArray[num_arrays];
+    this->parsing_done = false;
+    this->next_fill_seq = 0;
+    this->next_store_seq = 0;
+    this->active_preparers = 0;
+    this->records_stored = 0;
+    this->arrays_stored = 0;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond_free, NULL);
+    pthread_cond_init(&cond_prepare, NULL);
+    pthread_cond_init(&cond_store, NULL);
+  }
+
+  ~IngestPipeline()
+  {
+    delete [] arrays;
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond_free);
+    pthread_cond_destroy(&cond_prepare);
+    pthread_cond_destroy(&cond_store);
+  }
+
+  /*
+   * Returns 0 once all input is read and stored, and -1 on a read or memory
+   * error. Everything parsed before an error is still stored.
+   */
+  int run()
+  {
+    for (size_t i = 0; i < num_arrays; ++i)
+    {
+      arrays[i].model = plan->model;
+      if (!arrays[i].allocate(array_size))
+        return -1;
+      free_q.push_back(&arrays[i]);
+    }
+
+    std::vector<pthread_t> preparers(num_preparers);
+    pthread_t writer;
+
+    active_preparers = 0;
+    for (size_t t = 0; t < num_preparers; ++t)
+    {
+      if (pthread_create(&preparers[t], NULL, run_prepare, this) != 0)
+        break;
+      ++active_preparers;
+    }
+    size_t started = active_preparers;
+
+    if (started == 0 || pthread_create(&writer, NULL, run_store, this) != 0)
+    {
+      finish_parsing();
+      for (size_t t = 0; t < started; ++t)
+      {
+        pthread_join(preparers[t], NULL);
+      }
+      return -1;
+    }
+
+    int res = 0;
+    for (;;)
+    {
+      RecordModelInstanceArray *arr = take_free();
+
+      ParallelLineParser parser(arr, reader, plan, min_num_tokens, max_num_tokens, num_threads, chunk_size);
+      int more = parser.run();
+      add_stats(parser.stats);
+
+      if (more < 0)
+        res = -1;
+
+      if (arr->empty())
+        give_free(arr);
+      else
+        queue_prepare(arr);
+
+      if (more <= 0)
+        break;
+    }
+
+    finish_parsing();
+
+    for (size_t t = 0; t < started; ++t)
+    {
+      pthread_join(preparers[t], NULL);
+    }
+    pthread_join(writer, NULL);
+
+    return res;
+  }
+
+private:
+
+  RecordModelInstanceArray *take_free()
+  {
+    pthread_mutex_lock(&mutex);
+    while (free_q.empty())
+    {
+      pthread_cond_wait(&cond_free, &mutex);
+    }
+    RecordModelInstanceArray *arr = free_q.front();
+    free_q.pop_front();
+    pthread_mutex_unlock(&mutex);
+    return arr;
+  }
+
+  void give_free(RecordModelInstanceArray *arr)
+  {
+    arr->reset();
+    pthread_mutex_lock(&mutex);
+    free_q.push_back(arr);
+    pthread_cond_signal(&cond_free);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void queue_prepare(RecordModelInstanceArray *arr)
+  {
+    Prepared item;
+    item.arr = arr;
+    item.prepared = NULL;
+    pthread_mutex_lock(&mutex);
+    item.seq = next_fill_seq++;
+    prepare_q.push_back(item);
+    pthread_cond_signal(&cond_prepare);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void finish_parsing()
+  {
+    pthread_mutex_lock(&mutex);
+    parsing_done = true;
+    pthread_cond_broadcast(&cond_prepare);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  void add_stats(const ParallelLineParser::Stats &s)
+  {
+    stats.lines_read += s.lines_read;
+    stats.lines_ok += s.lines_ok;
+    stats.parse_errors += s.parse_errors;
+    stats.invalid_num_tokens += s.invalid_num_tokens;
+  }
+
+  static void *run_prepare(void *ptr)
+  {
+    IngestPipeline *p = (IngestPipeline*)ptr;
+
+    pthread_mutex_lock(&p->mutex);
+    for (;;)
+    {
+      while (p->prepare_q.empty() && !p->parsing_done)
+      {
+        pthread_cond_wait(&p->cond_prepare, &p->mutex);
+      }
+      if (p->prepare_q.empty())
+        break;
+
+      Prepared item = p->prepare_q.front();
+      p->prepare_q.pop_front();
+      pthread_mutex_unlock(&p->mutex);
+
+      // if out of memory, the array is stored uncombined
+      if (p->combine)
+        item.arr->combine();
+      item.prepared = p->prepare ? p->prepare(p->store_data, item.arr) : NULL;
+
+      pthread_mutex_lock(&p->mutex);
+      // keep store_q ordered by seq. usually item goes to the back.
+      std::deque<Prepared>::iterator pos = p->store_q.end();
+      while (pos != p->store_q.begin() && (pos - 1)->seq > item.seq)
+        --pos;
+      p->store_q.insert(pos, item);
+      pthread_cond_signal(&p->cond_store);
+    }
+
+    // the last preparer to leave tells the writer
+    --p->active_preparers;
+    pthread_cond_signal(&p->cond_store);
+    pthread_mutex_unlock(&p->mutex);
+
+    return NULL;
+  }
+
+  static void *run_store(void *ptr)
+  {
+    IngestPipeline *p = (IngestPipeline*)ptr;
+
+    for (;;)
+    {
+      pthread_mutex_lock(&p->mutex);
+      // wait for the next array in fill order, which might still be
+      // prepared while later ones are done already
+      while ((p->store_q.empty() || p->store_q.front().seq != p->next_store_seq) &&
+             p->active_preparers > 0)
+      {
+        pthread_cond_wait(&p->cond_store, &p->mutex);
+      }
+      if (p->store_q.empty())
+      {
+        // all preparers are done and nothing is left
+        pthread_mutex_unlock(&p->mutex);
+        break;
+      }
+      Prepared item = p->store_q.front();
+      assert(item.seq == p->next_store_seq);
+      p->store_q.pop_front();
+      ++p->next_store_seq;
+      pthread_mutex_unlock(&p->mutex);
+
+      size_t n = item.arr->entries();
+      p->store(p->store_data, item.arr, item.prepared);
+
+      p->records_stored += n;
+      ++p->arrays_stored;
+      p->give_free(item.arr);
+    }
+
+    return NULL;
+  }
+};
+
+#endif
@@ -2,7 +2,17 @@
 #define __LINEREADER__HEADER__
 
 #include "FileReader.h"
+#include "RM_Scan.h"
 
+/*
+ * Reads a file line by line.
+ *
+ * readline() copies the data into "buf" and returns NUL-terminated lines.
+ * next_line() returns length-delimited lines. If the reader supports
+ * read_span (e.g. a memory mapped file), these point directly into the
+ * reader's memory, and only lines continuing over the end of a span are
+ * copied (into "buf").
+ */
 struct LineReader
 {
   char *buf;
@@ -12,6 +22,10 @@ struct LineReader
   FileReader *reader;
   bool fd_is_eof;
 
+  enum { MODE_UNKNOWN, MODE_COPY, MODE_SPAN } mode;
+  const char *span;
+  const char *span_end;
+
   LineReader(FileReader *reader, char *buf, size_t bufsz)
   {
     this->reader = reader;
@@ -20,31 +34,144 @@ struct LineReader
     this->bufsz = bufsz;
     this->buflen = 0;
     this->bufoffs = 0;
+    this->mode = MODE_UNKNOWN;
+    this->span = NULL;
+    this->span_end = NULL;
+  }
+
+  /*
+   * Returns the data which was read ahead, but not yet returned as a line.
+   */
+  const char *rest(size_t &len) const
+  {
+    if (mode == MODE_SPAN)
+    {
+      len = span_end - span;
+      return span;
+    }
+    len = buflen;
+    return &buf[bufoffs];
+  }
+
+  /*
+   * Returns the next line [beg, end) without the newline. Returns false at the
+   * end of input or on error.
+   */
+  bool next_line(const char *&beg, const char *&end)
+  {
+    if (mode == MODE_UNKNOWN)
+    {
+      size_t len;
+      if (reader->read_span(span, len))
+      {
+        mode = MODE_SPAN;
+        span_end = span + len;
+      }
+      else
+      {
+        mode = MODE_COPY;
+      }
+    }
+
+    if (mode == MODE_COPY)
+    {
+      size_t len;
+      char *line = readline(len);
+      if (!line) return false;
+      beg = line;
+      end = line + len;
+      return true;
+    }
+
+    while (span == span_end)
+    {
+      // a reader might return its input in multiple spans
+      size_t len;
+      if (!reader->read_span(span, len) || len == 0)
+        return false;
+      span_end = span + len;
+    }
+
+    const char *nl = RM_Scan::find_byte(span, span_end, '\n');
+    if (!nl)
+      return join_spans(beg, end);
+
+    beg = span;
+    end = nl;
+    span = nl + 1;
+    return true;
+  }
+
+  /*
+   * Copies a line which continues over the end of the current span into
+   * "buf", reading further spans. Like readline(), a line longer than the
+   * buffer is split.
+   */
+  bool join_spans(const char *&beg, const char *&end)
+  {
+    size_t len = 0;
+
+    for (;;)
+    {
+      const char *nl = RM_Scan::find_byte(span, span_end, '\n');
+      const char *stop = nl ? nl : span_end;
+      if ((size_t)(stop - span) > bufsz - len)
+      {
+        stop = span + (bufsz - len);
+        nl = NULL;
+      }
+      memcpy(buf + len, span, stop - span);
+      len += stop - span;
+      span = nl ? nl + 1 : stop;
+
+      if (nl || len == bufsz)
+        break;
+
+      // the span is copied, so it may be given back by the reader
+      size_t n;
+      if (!reader->read_span(span, n) || n == 0)
+      {
+        span = span_end = NULL;
+        break;
+      }
+      span_end = span + n;
+    }
+
+    beg = buf;
+    end = buf + len;
+    return true;
   }
 
   char *readline()
+  {
+    size_t len;
+    return readline(len);
+  }
+
+  char *readline(size_t &len)
   {
     if (fd_is_eof && buflen == 0)
       return NULL;
    
     char *beg = &buf[bufoffs];
-    for (size_t i = 0; i < buflen; ++i)
+    char *nl = (char*)RM_Scan::find_byte(beg, beg + buflen, '\n');
+    if (nl)
     {
-      if (beg[i] == '\n')
-      {
-	// buf = "abc\ndef", buflen=7, bufoffs=0
-        beg[i] = '\0';
-	bufoffs += i+1;
-	buflen -= (i+1);
-	// buf[3] = 0, bufoffs = 4, buflen = 3 
-	return beg;
-      }
+      size_t i = nl - beg;
+      // buf = "abc\ndef", buflen=7, bufoffs=0
+      beg[i] = '\0';
+      bufoffs += i+1;
+      buflen -= (i+1);
+      // buf[3] = 0, bufoffs = 4, buflen = 3 
+      len = i;
+      return beg;
     }
 
     // no NL was found.
     if (fd_is_eof)
     {
       beg[buflen] = 0;
+      len = buflen;
       buflen = 0;
       return beg;
     }
@@ -64,22 +191,25 @@ struct LineReader
         if (nread == 0)
         {
           fd_is_eof = true;
+          if (buflen == 0)
+            return NULL; // input ended with a newline
           beg[buflen] = '\0';
+          len = buflen;
           buflen = 0;
           return beg;
         }
 
-	// check for NL in newly read bytes  
-        for (size_t i=0; i < (size_t)nread; ++i)
-	{
-	  if (beg[buflen+i] == '\n')
-	  {
-	    beg[buflen+i] = '\0';
-            bufoffs += buflen+i+1;
-	    buflen = nread - i - 1;
-	    return beg;
-	  }
-	}
+	// check for NL in newly read bytes only
+        nl = (char*)RM_Scan::find_byte(&beg[buflen], &beg[buflen + nread], '\n');
+        if (nl)
+        {
+          size_t i = nl - &beg[buflen];
+          beg[buflen+i] = '\0';
+          bufoffs += buflen+i+1;
+          len = buflen+i;
+          buflen = nread - i - 1;
+          return beg;
+        }
         buflen += nread;
       }
       else
@@ -88,16 +218,14 @@ struct LineReader
         {
           // buffer is completely full. moving does not make it any better
           beg[buflen] = '\0';
+          len = buflen;
           buflen = 0;
           return beg;
         }
         else
         {
           // copy buffer to position 0 and then try again
-          for (size_t i = 0; i < buflen; ++i)
-  	  {
-	    buf[i] = beg[i];
-	  }
+          memmove(buf, beg, buflen);
 	  bufoffs = 0;
 	  beg = buf;
         }
@@ -0,0 +1,116 @@
+#ifndef __LZ4_FILE_READER__HEADER__
+#define __LZ4_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include "PosixFileReader.h"
+#include <lz4frame.h>
+#include <assert.h>
+#include <stdlib.h> // malloc
+
+/*
+ * Reads LZ4 frame compressed files (as written by the "lz4" tool).
+ * Concatenated frames are decompressed one after the other.
+ */
+class Lz4FileReader : public FileReader
+{
+  PosixFileReader pf;
+  FileReader *file;
+  LZ4F_dctx *ctx;
+  char *inbuf;
+  size_t bufsize;
+  size_t in_pos;
+  size_t in_size;
+  bool is_eof;
+  bool in_frame;
+
+  public:
+
+    Lz4FileReader()
+    {
+      file = NULL;
+      inbuf = NULL;
+      ctx = NULL;
+    }
+
+    bool open(const char *path, unsigned bufsize = 1L << 16)
+    {
+      assert(file == NULL);
+
+      if (!pf.open(path))
+      {
+        return false;
+      }
+      file = &pf;
+
+      this->inbuf = (char*)malloc(bufsize);
+      if (!inbuf || LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+      {
+        file->close(); file = NULL;
+        free(inbuf); inbuf = NULL;
+        ctx = NULL;
+        return false;
+      }
+      this->bufsize = bufsize;
+
+      in_pos = 0;
+      in_size = 0;
+      is_eof = false;
+      in_frame = false;
+
+      return true;
+    }
+
+    virtual void close()
+    {
+      assert(file);
+      file->close(); file = NULL;
+      free(inbuf); inbuf = NULL;
+      LZ4F_freeDecompressionContext(ctx); ctx = NULL;
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(file);
+
+      for (;;)
+      {
+        if (!is_eof && in_pos == in_size)
+        {
+          ssize_t n = file->read(this->inbuf, this->bufsize);
+          if (n < 0)
+          {
+            return -1;
+          }
+          if (n == 0)
+          {
+            is_eof = true;
+          }
+          in_size = n;
+          in_pos = 0;
+        }
+
+        size_t out_len = buflen;
+        size_t in_len = in_size - in_pos;
+        size_t ret = LZ4F_decompress(ctx, buf, &out_len, inbuf + in_pos, &in_len, NULL);
+        if (LZ4F_isError(ret))
+        {
+          return -1;
+        }
+        in_pos += in_len;
+        // ret == 0: the frame is complete. the context is ready for the next one.
+        if (in_len > 0 || out_len > 0)
+          in_frame = (ret != 0);
+
+        if (out_len > 0)
+          return out_len;
+
+        if (is_eof && in_pos == in_size)
+        {
+          // truncated frame?
+          return in_frame ? -1 : 0;
+        }
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef __MMAP_FILE_READER__HEADER__
+#define __MMAP_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h> // memcpy
+#include <assert.h>
+
+/*
+ * Maps a whole (regular) file into memory. read_span returns the complete
+ * file at once, so LineReader can return lines directly from the mapping
+ * without copying them.
+ */
+class MmapFileReader : public FileReader
+{
+  int fd;
+  char *map;
+  size_t size;
+  size_t pos;
+
+  public:
+
+    MmapFileReader()
+    {
+      fd = -1;
+      map = NULL;
+      size = 0;
+      pos = 0;
+    }
+
+    /*
+     * Fails for anything but a regular file (pipes, devices...).
+     */
+    bool open(const char *path)
+    {
+      assert(fd == -1);
+      fd = ::open(path, O_RDONLY);
+      if (fd == -1)
+      {
+        return false;
+      }
+
+      struct stat st;
+      if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+      {
+        ::close(fd); fd = -1;
+        return false;
+      }
+
+      size = st.st_size;
+      pos = 0;
+      map = NULL;
+
+      if (size > 0)
+      {
+        void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED)
+        {
+          ::close(fd); fd = -1;
+          return false;
+        }
+        map = (char*)ptr;
+        madvise(map, size, MADV_SEQUENTIAL);
+      }
+
+      return true;
+    }
+
+    virtual void close()
+    {
+      assert(fd >= 0);
+      if (map)
+      {
+        munmap(map, size);
+        map = NULL;
+      }
+      ::close(fd);
+      fd = -1;
+    }
+
+    /*
+     * Asks the kernel to read the rest of the file ahead.
+     */
+    void willneed()
+    {
+      if (map && pos < size)
+        madvise(map, size, MADV_WILLNEED);
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(fd >= 0);
+      size_t n = size - pos;
+      if (n > buflen) n = buflen;
+      if (n > 0)
+      {
+        memcpy(buf, map + pos, n);
+        pos += n;
+      }
+      return n;
+    }
+
+    virtual bool read_span(const char *&data, size_t &len)
+    {
+      assert(fd >= 0);
+      data = map + pos;
+      len = size - pos;
+      pos = size;
+      return true;
+    }
+
+    virtual bool unread_span(const char *data, size_t len)
+    {
+      if (map == NULL || len > pos || data != map + pos - len)
+        return false;
+      pos -= len;
+      return true;
+    }
+};
+
+#endif
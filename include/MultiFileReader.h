@@ -0,0 +1,158 @@
+#ifndef __MULTI_FILE_READER__HEADER__
+#define __MULTI_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include "AutoFileReader.h"
+#include <string>  // std::string
+#include <vector>  // std::vector
+#include <assert.h>
+
+/*
+ * Reads a list of files (each in any format AutoFileReader supports) back
+ * to back as one stream. A newline is inserted between two files if the
+ * first does not end with one, so the last line of a file is never joined
+ * with the first line of the next.
+ *
+ * The next file is opened while the current one is being read. For
+ * compressed files this already starts its decompression thread, for memory
+ * mapped files the kernel is asked to read it ahead.
+ *
+ * A file that cannot be opened is reported as a read error.
+ */
+class MultiFileReader : public FileReader
+{
+  std::vector<std::string> paths;
+  unsigned bufsize;
+
+  size_t next_index;      // index of the next file to open
+  AutoFileReader *cur;
+  AutoFileReader *next;   // prefetched, or NULL
+  bool next_failed;
+  char last_char;         // last byte returned from "cur", 0 if none
+
+  public:
+
+    MultiFileReader()
+    {
+      cur = NULL;
+      next = NULL;
+      next_index = 0;
+      next_failed = false;
+      last_char = 0;
+    }
+
+    ~MultiFileReader()
+    {
+      close_files();
+    }
+
+    bool open(const std::vector<std::string> &paths, unsigned bufsize = 1L << 16)
+    {
+      assert(cur == NULL);
+      this->paths = paths;
+      this->bufsize = bufsize;
+      this->next_index = 0;
+
+      prefetch();
+      if (!advance())
+      {
+        close_files();
+        return false;
+      }
+      return true;
+    }
+
+    virtual void close()
+    {
+      close_files();
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      if (buflen == 0) return 0;
+
+      while (cur)
+      {
+        ssize_t n = cur->read(buf, buflen);
+        if (n < 0)
+          return -1;
+        if (n > 0)
+        {
+          last_char = ((char*)buf)[n-1];
+          return n;
+        }
+
+        // end of the current file
+        bool add_newline = (last_char != 0 && last_char != '\n');
+        cur->close();
+        delete cur;
+        cur = NULL;
+
+        if (!advance())
+          return -1;
+
+        if (add_newline && cur)
+        {
+          *(char*)buf = '\n';
+          return 1;
+        }
+      }
+
+      return 0;
+    }
+
+  private:
+
+    /*
+     * Makes the prefetched file the current one and prefetches the next.
+     * Returns false if the prefetched file could not be opened.
+     */
+    bool advance()
+    {
+      assert(cur == NULL);
+      if (next_failed)
+        return false;
+
+      cur = next;
+      next = NULL;
+      last_char = 0;
+      prefetch();
+      return true;
+    }
+
+    void prefetch()
+    {
+      assert(next == NULL);
+      if (next_index >= paths.size())
+        return;
+
+      next = new AutoFileReader();
+      if (!next->open(paths[next_index].c_str(), bufsize))
+      {
+        delete next;
+        next = NULL;
+        next_failed = true;
+        return;
+      }
+      next->prefetch();
+      ++next_index;
+    }
+
+    void close_files()
+    {
+      if (cur)
+      {
+        cur->close();
+        delete cur;
+        cur = NULL;
+      }
+      if (next)
+      {
+        next->close();
+        delete next;
+        next = NULL;
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,513 @@
+#ifndef __PARALLEL_LINE_PARSER__HEADER__
+#define __PARALLEL_LINE_PARSER__HEADER__
+
+#include "RecordModel.h"
+#include "AutoFileReader.h"
+#include "RM_ParsePlan.h"
+#include <pthread.h> // pthread_create
+#include <stdlib.h>  // malloc
+#include <string.h>  // memchr, memmove
+#include <assert.h>  // assert
+#include <vector>    // std::vector
+
+/*
+ * Parses lines read from an AutoFileReader on multiple threads into a
+ * RecordModelInstanceArray.
+ *
+ * The input is read in blocks of "num_threads * chunk_size" bytes. Each block
+ * is cut into "num_threads" chunks at newline boundaries, and each chunk is
+ * parsed by its own thread into a per-thread array. The per-thread arrays
+ * are then appended to the target array in chunk order, so the records end
+ * up in the same order as the lines in the input.
+ *
+ * Lines with a parse error or an invalid number of tokens are always rejected
+ * (there is no way to call back into Ruby from the worker threads) and counted
+ * per thread.
+ *
+ * If the target array becomes full in the middle of a block, the unconsumed
+ * input is given back to the reader (AutoFileReader::unread), so a following
+ * call continues exactly after the last stored line.
+ *
+ * If the reader returns spans (FileReader::read_span, e.g. memory mapped),
+ * the blocks are taken directly from them instead of being copied into a
+ * buffer. Only a line continuing over the end of a span is copied.
+ */
+struct ParallelLineParser
+{
+  struct Stats
+  {
+    size_t lines_read;
+    size_t lines_ok;
+    size_t parse_errors;
+    size_t invalid_num_tokens;
+
+    Stats() : lines_read(0), lines_ok(0), parse_errors(0), invalid_num_tokens(0) {}
+  };
+
+  struct Mark
+  {
+    size_t line_end; // relative to the block
+    size_t lines_read;
+    size_t parse_errors;
+  };
+
+  struct Worker
+  {
+    ParallelLineParser *parser;
+    RecordModelInstanceArray arr;
+    RecordModelInstance *rec;
+    const char *beg;
+    const char *end;
+    bool failed;  // out of memory in the current block
+
+    // for each record in arr: position behind its line and the stats up to there
+    std::vector<Mark> marks;
+
+    Stats round;  // stats of the current block
+    Stats total;  // stats of all blocks (per thread)
+  };
+
+  RecordModelInstanceArray *target;
+  AutoFileReader *reader;
+  const RM_ParsePlan *plan;  // shared by all threads
+  int min_num_tokens;
+  int max_num_tokens;
+
+  size_t num_threads;
+  size_t chunk_size;
+
+  Worker *workers;
+  char *buf;          // the blocks if the reader can't return spans, else a carried line
+  size_t carry_len;
+  size_t carry_cap;
+  const char *block;  // current block (either within buf or a span)
+  size_t block_size;
+
+  Stats stats;
+
+  ParallelLineParser(RecordModelInstanceArray *target, AutoFileReader *reader, const RM_ParsePlan *plan,
+                     int min_num_tokens, int max_num_tokens, size_t num_threads, size_t chunk_size)
+  {
+    assert(num_threads > 0);
+    assert(chunk_size > 0);
+
+    this->target = target;
+    this->reader = reader;
+    this->plan = plan;
+    this->min_num_tokens = min_num_tokens;
+    this->max_num_tokens = max_num_tokens;
+    this->num_threads = num_threads;
+    this->chunk_size = chunk_size;
+    this->block_size = num_threads * chunk_size;
+    this->buf = NULL;
+    this->carry_len = 0;
+    this->carry_cap = 0;
+    this->block = NULL;
+    this->workers = new Worker[num_threads];
+
+    for (size_t t = 0; t < num_threads; ++t)
+    {
+      Worker &w = workers[t];
+      w.parser = this;
+      w.arr.model = target->model;
+      w.arr.expandable = true;
+      w.rec = NULL;
+      w.failed = false;
+    }
+  }
+
+  ~ParallelLineParser()
+  {
+    for (size_t t = 0; t < num_threads; ++t)
+    {
+      RecordModelInstance::deallocate(workers[t].rec);
+    }
+    delete [] workers;
+    if (buf) free(buf);
+  }
+
+  /*
+   * Returns 1 if the target array is full (there might be more input), 0 on
+   * end of input and -1 on a read or memory error.
+   */
+  int run()
+  {
+    if (target->full())
+      return 1;
+
+    for (size_t t = 0; t < num_threads; ++t)
+    {
+      Worker &w = workers[t];
+      w.rec = RecordModelInstance::allocate(target->model);
+      if (!w.rec || !w.arr.allocate(chunk_size / 64 + 1))
+        return -1;
+    }
+
+    const char *span;
+    size_t span_len;
+    if (reader->read_span(span, span_len))
+      return run_spans(span, span_len);
+
+    buf = (char*)malloc(block_size);
+    if (!buf) return -1;
+    block = buf;
+
+    size_t len = 0;
+    bool eof = false;
+
+    for (;;)
+    {
+      // fill up the block
+      while (!eof && len < block_size)
+      {
+        ssize_t nread = reader->read(buf + len, block_size - len);
+        if (nread < 0) return -1;
+        if (nread == 0) eof = true;
+        len += nread;
+      }
+
+      if (len == 0)
+        return 0;
+
+      // the data behind the last newline is carried over into the next block,
+      // unless we are at the end of the input or the block contains no newline
+      // at all (then the line is too long and split, like LineReader does).
+      size_t data_len = len;
+      if (!eof)
+      {
+        size_t i = len;
+        while (i > 0 && buf[i-1] != '\n') --i;
+        if (i > 0) data_len = i;
+      }
+
+      if (!split_and_parse(data_len))
+        return -1;
+
+      size_t consumed;
+      bool full = merge(consumed);
+      assert(consumed <= len);
+
+      if (full)
+      {
+        if (!reader->unread(buf + consumed, len - consumed))
+          return -1;
+        return 1;
+      }
+
+      assert(consumed == data_len);
+      memmove(buf, buf + consumed, len - consumed);
+      len -= consumed;
+
+      if (eof && len == 0)
+        return 0;
+    }
+  }
+
+  const Stats &thread_stats(size_t t) const
+  {
+    assert(t < num_threads);
+    return workers[t].total;
+  }
+
+private:
+
+  /*
+   * Zero-copy variant of run(). Each block is a window of the span, extended
+   * up to the next newline, so lines are never split. The last line of a
+   * span without a newline is carried over into "buf" and completed from
+   * the following span(s).
+   */
+  int run_spans(const char *span, size_t span_len)
+  {
+    for (;;)
+    {
+      while (span_len > 0)
+      {
+        size_t data_len = span_len;
+        if (data_len > block_size)
+        {
+          const char *nl = (const char*)memchr(span + block_size, '\n', span_len - block_size);
+          data_len = nl ? (nl + 1 - span) : span_len;
+        }
+        if (data_len == span_len && span[span_len - 1] != '\n')
+        {
+          const char *nl = last_newline(span, span_len);
+          if (!nl) break; // carried over
+          data_len = nl + 1 - span;
+        }
+
+        block = span;
+        if (!split_and_parse(data_len))
+          return -1;
+
+        size_t consumed;
+        bool full = merge(consumed);
+        assert(consumed <= data_len);
+
+        if (full)
+        {
+          if (!reader->unread(span + consumed, span_len - consumed))
+            return -1;
+          return 1;
+        }
+
+        assert(consumed == data_len);
+        span += consumed;
+        span_len -= consumed;
+      }
+
+      // copy the carried line before the reader may give back its memory
+      if (span_len > 0 && !carry(span, span_len))
+        return -1;
+
+      if (!reader->read_span(span, span_len))
+        return -1;
+
+      if (carry_len == 0)
+      {
+        if (span_len == 0)
+          return 0;
+        continue;
+      }
+
+      // complete the carried line, unless it continues in the next span, too
+      const char *nl = (const char*)memchr(span, '\n', span_len);
+      if (!nl && span_len > 0)
+        continue;
+
+      size_t n = nl ? (nl + 1 - span) : 0;
+      if (!carry(span, n))
+        return -1;
+      span += n;
+      span_len -= n;
+
+      block = buf;
+      if (!split_and_parse(carry_len))
+        return -1;
+
+      size_t consumed;
+      bool full = merge(consumed);
+      assert(consumed <= carry_len);
+
+      if (full)
+      {
+        // the rest of the span goes back first, the rest of the line in front of it
+        if (!reader->unread(span, span_len) || !reader->unread(buf + consumed, carry_len - consumed))
+          return -1;
+        carry_len = 0;
+        return 1;
+      }
+
+      carry_len = 0;
+      if (span_len == 0 && !nl)
+        return 0; // the carried line was the last one
+    }
+  }
+
+  static const char *last_newline(const char *data, size_t len)
+  {
+    while (len > 0)
+    {
+      if (data[--len] == '\n')
+        return data + len;
+    }
+    return NULL;
+  }
+
+  /*
+   * Appends "len" bytes to the line carried over between spans.
+   */
+  bool carry(const char *data, size_t len)
+  {
+    if (carry_len + len > carry_cap)
+    {
+      size_t cap = 2 * carry_cap;
+      if (cap < carry_len + len) cap = carry_len + len;
+      char *p = (char*)realloc(buf, cap);
+      if (!p) return false;
+      buf = p;
+      carry_cap = cap;
+    }
+    memcpy(buf + carry_len, data, len);
+    carry_len += len;
+    return true;
+  }
+
+  /*
+   * Parses the first "data_len" bytes of the block into the per-thread
+   * arrays. Returns false if a thread ran out of memory.
+   */
+  bool split_and_parse(size_t data_len)
+  {
+    const char *pos = block;
+    const char *data_end = block + data_len;
+
+    for (size_t t = 0; t < num_threads; ++t)
+    {
+      Worker &w = workers[t];
+      w.beg = pos;
+      if (t == num_threads - 1)
+      {
+        w.end = data_end;
+      }
+      else
+      {
+        const char *cut = block + (data_len * (t + 1)) / num_threads;
+        if (cut < pos) cut = pos;
+        const char *nl = (cut < data_end) ? (const char*)memchr(cut, '\n', data_end - cut) : NULL;
+        w.end = nl ? nl + 1 : data_end;
+      }
+      pos = w.end;
+    }
+
+    std::vector<pthread_t> threads(num_threads);
+    std::vector<bool> started(num_threads, false);
+
+    // worker 0 runs on the calling thread
+    for (size_t t = 1; t < num_threads; ++t)
+    {
+      if (workers[t].beg == workers[t].end)
+      {
+        parse_chunk(&workers[t]);
+        continue;
+      }
+      started[t] = (pthread_create(&threads[t], NULL, parse_chunk, &workers[t]) == 0);
+      if (!started[t])
+        parse_chunk(&workers[t]);
+    }
+
+    parse_chunk(&workers[0]);
+
+    bool ok = true;
+    for (size_t t = 0; t < num_threads; ++t)
+    {
+      if (started[t])
+        pthread_join(threads[t], NULL);
+      if (workers[t].failed)
+        ok = false;
+    }
+    return ok;
+  }
+
+  static void *parse_chunk(void *ptr)
+  {
+    Worker *w = (Worker*)ptr;
+    ParallelLineParser *p = w->parser;
+
+    w->arr.reset();
+    w->marks.clear();
+    w->round = Stats();
+    w->failed = false;
+
+    const char *line = w->beg;
+    while (line < w->end)
+    {
+      const char *nl = (const char*)memchr(line, '\n', w->end - line);
+      // an unterminated line can only be the last line of the data
+      const char *line_end = nl ? nl : w->end;
+      ++w->round.lines_read;
+
+      int err;
+      int num_tokens = p->plan->parse_line(w->rec, line, line_end, err);
+
+      size_t next = (line_end - p->block) + (nl ? 1 : 0);
+
+      if (err)
+      {
+        ++w->round.parse_errors;
+      }
+      else if (num_tokens < p->min_num_tokens || (p->max_num_tokens > 0 && num_tokens > p->max_num_tokens))
+      {
+        ++w->round.invalid_num_tokens;
+      }
+      else
+      {
+        if (!w->arr.push(w->rec))
+        {
+          w->failed = true;
+          break;
+        }
+        ++w->round.lines_ok;
+        Mark m;
+        m.line_end = next;
+        m.lines_read = w->round.lines_read;
+        m.parse_errors = w->round.parse_errors;
+        w->marks.push_back(m);
+      }
+
+      line = p->block + next;
+    }
+
+    return NULL;
+  }
+
+  /*
+   * Appends the per-thread arrays to the target array. Returns true if the
+   * target became full, and the number of consumed bytes of the block in
+   * "consumed".
+   */
+  bool merge(size_t &consumed)
+  {
+    consumed = 0;
+
+    for (size_t t = 0; t < num_threads; ++t)
+    {
+      Worker &w = workers[t];
+      size_t room = target->capacity() - target->entries();
+      size_t n = w.arr.entries();
+      if (n > room) n = room;
+
+      for (size_t i = 0; i < n; ++i)
+      {
+        RecordModelInstance src(target->model, w.arr.ptr_at(i));
+        // cannot fail, as it is bounded by "room"
+        target->push(&src);
+      }
+
+      if (n == w.arr.entries())
+      {
+        account(w, w.round);
+        consumed = w.end - block;
+      }
+      else
+      {
+        // only the first "n" records fit in. the lines behind the last
+        // stored one are read again by the next call.
+        Stats partial;
+        if (n > 0)
+        {
+          const Mark &m = w.marks[n-1];
+          partial.lines_read = m.lines_read;
+          partial.lines_ok = n;
+          partial.parse_errors = m.parse_errors;
+          partial.invalid_num_tokens = m.lines_read - n - m.parse_errors;
+          consumed = m.line_end;
+        }
+        else
+        {
+          consumed = w.beg - block;
+        }
+        account(w, partial);
+      }
+
+      if (target->full())
+        return true;
+    }
+
+    return false;
+  }
+
+  void account(Worker &w, const Stats &s)
+  {
+    w.total.lines_read += s.lines_read;
+    w.total.lines_ok += s.lines_ok;
+    w.total.parse_errors += s.parse_errors;
+    w.total.invalid_num_tokens += s.invalid_num_tokens;
+    stats.lines_read += s.lines_read;
+    stats.lines_ok += s.lines_ok;
+    stats.parse_errors += s.parse_errors;
+    stats.invalid_num_tokens += s.invalid_num_tokens;
+  }
+};
+
+#endif
@@ -37,6 +37,7 @@ class PosixFileReader : public FileReader
     {
       assert(fd >= 0);
       ::close(fd);
+      fd = -1;
     }
 
     virtual ssize_t read(void *buf, size_t buflen)
@@ -0,0 +1,318 @@
+#ifndef __RECORD_MODEL_COLUMN_ARRAY__HEADER__
+#define __RECORD_MODEL_COLUMN_ARRAY__HEADER__
+
+#include "RecordModel.h"
+#include <stdlib.h>  // malloc
+#include <string.h>  // memcpy
+#include <assert.h>  // assert
+#include <vector>    // std::vector
+#include <algorithm> // std::sort
+
+/*
+ * Columnar (struct-of-arrays) variant of RecordModelInstanceArray. Each field
+ * of the model is stored in a contiguous buffer of its own (a column), with
+ * field->size() bytes per entry in the layout of RM_Type::copy_to_memory.
+ * That is the layout of the key files of MMDB, so a column can be written
+ * out with a single memcpy.
+ *
+ * Operations on a single field (bulk_set, min/max, sketches) only touch its
+ * column. Records are assembled on demand (copy_out).
+ *
+ * Like RecordModelInstanceArray, sort() orders a separate index, which all
+ * indices "i" of the accessors refer to. apply_sort() moves the entries of
+ * all columns into that order.
+ */
+struct RecordModelInstanceColumnArray
+{
+  typedef RecordModelInstanceArray::SORT_IDX SORT_IDX;
+
+  RecordModel *model;
+  char **columns;  // indexed like model->_all_fields
+  size_t _capacity;
+  size_t _entries;
+  bool expandable;
+
+  std::vector<SORT_IDX> *sort_arr;
+
+  size_t entries() const { return _entries; }
+  size_t capacity() const { return _capacity; }
+  bool empty() const { return (_entries == 0); }
+  bool full() const { return (_entries >= _capacity); }
+
+  RecordModelInstanceColumnArray()
+  {
+    model = NULL;
+    columns = NULL;
+    _capacity = 0;
+    _entries = 0;
+    expandable = false;
+    sort_arr = NULL;
+  }
+
+  bool is_virgin()
+  {
+    return (model == NULL && columns == NULL && _capacity == 0 && _entries == 0 && expandable == false && sort_arr == NULL);
+  }
+
+  ~RecordModelInstanceColumnArray()
+  {
+    if (columns)
+    {
+      for (size_t k = 0; k < model->_num_fields; ++k)
+      {
+        free(columns[k]);
+      }
+      free(columns);
+      columns = NULL;
+    }
+    if (sort_arr)
+    {
+      delete sort_arr;
+      sort_arr = NULL;
+    }
+  }
+
+  bool allocate(size_t capacity)
+  {
+    if (columns) return false;
+    columns = (char**)calloc(model->_num_fields, sizeof(char*));
+    if (!columns) return false;
+    return _alloc(capacity);
+  }
+
+  bool expand(size_t capacity)
+  {
+    if (!expandable) return false;
+    return _alloc(capacity);
+  }
+
+  void reset()
+  {
+    _entries = 0;
+    if (sort_arr)
+      sort_arr->clear();
+  }
+
+  /*
+   * Column of field "k" (index into model->_all_fields).
+   */
+  inline char *column(size_t k)
+  {
+    assert(k < model->_num_fields);
+    return columns[k];
+  }
+
+  /*
+   * Raw (unsorted) position of the entry at index 'i' (in sorted order).
+   */
+  inline size_t raw_index(size_t i)
+  {
+    assert(i < _entries);
+    return sort_arr ? (*sort_arr)[i] : i;
+  }
+
+  /*
+   * Index of the column of "field".
+   */
+  size_t field_index(RM_Type *field)
+  {
+    for (size_t k = 0; k < model->_num_fields; ++k)
+    {
+      if (model->_all_fields[k] == field)
+        return k;
+    }
+    assert(false);
+    return 0;
+  }
+
+  bool is_value(size_t k)
+  {
+    for (size_t v = 0; v < model->_num_values; ++v)
+    {
+      if (model->_values[v] == model->_all_fields[k])
+        return true;
+    }
+    return false;
+  }
+
+  inline void *element_at(size_t k, size_t i)
+  {
+    return column(k) + raw_index(i) * model->_all_fields[k]->size();
+  }
+
+  bool push(const RecordModelInstance *rec)
+  {
+    assert(model == rec->model);
+
+    if (full() && expand(capacity() * 2) == false)
+    {
+      return false;
+    }
+    assert(!full());
+
+    for (size_t k = 0; k < model->_num_fields; ++k)
+    {
+      RM_Type *field = model->_all_fields[k];
+      field->copy_to_memory(rec->ptr(), columns[k] + _entries * field->size());
+    }
+
+    if (sort_arr)
+      sort_arr->push_back(_entries);
+    ++_entries;
+    return true;
+  }
+
+  /*
+   * Copies element at index 'i' (in sorted order) into 'rec'
+   */
+  void copy_out(RecordModelInstance *rec, size_t i)
+  {
+    assert(model == rec->model);
+
+    size_t n = raw_index(i);
+    for (size_t k = 0; k < model->_num_fields; ++k)
+    {
+      RM_Type *field = model->_all_fields[k];
+      field->set_from_memory(rec->ptr(), columns[k] + n * field->size());
+    }
+  }
+
+  /*
+   * Copies 'rec' into element at index 'i' (in sorted order)
+   */
+  void copy_in(const RecordModelInstance *rec, size_t i)
+  {
+    assert(model == rec->model);
+
+    size_t n = raw_index(i);
+    for (size_t k = 0; k < model->_num_fields; ++k)
+    {
+      RM_Type *field = model->_all_fields[k];
+      field->copy_to_memory(rec->ptr(), columns[k] + n * field->size());
+    }
+  }
+
+  /*
+   * Sets field "k" of all entries to "mem" (in the layout of the column).
+   */
+  void fill(size_t k, const void *mem)
+  {
+    size_t sz = model->_all_fields[k]->size();
+    char *col = column(k);
+    for (size_t n = 0; n < _entries; ++n)
+    {
+      memcpy(col + n * sz, mem, sz);
+    }
+  }
+
+  /*
+   * Sorts the index by "keys" (default: the keys of the model). Like
+   * RecordModelInstanceArray::sort, the entries are not moved.
+   */
+  void sort(RM_Type **keys=NULL)
+  {
+    if (!keys)
+      keys = model->_keys;
+
+    // std::sort copies the comparator, so it only points to these
+    std::vector<const char*> cols;
+    for (int i = 0; keys[i] != NULL; ++i)
+    {
+      cols.push_back(columns[field_index(keys[i])]);
+    }
+
+    Sorter s;
+    s.fields = keys;
+    s.cols = cols.empty() ? NULL : &cols[0];
+    s.n = cols.size();
+
+    if (!sort_arr)
+    {
+      sort_arr = new std::vector<SORT_IDX>;
+      sort_arr->reserve(_capacity);
+      for (size_t i = 0; i < _entries; ++i)
+      {
+        sort_arr->push_back(i);
+      }
+    }
+    std::sort(sort_arr->begin(), sort_arr->end(), s);
+  }
+
+  /*
+   * Moves the entries of all columns into sorted order and drops the
+   * index. Returns false if out of memory.
+   */
+  bool apply_sort()
+  {
+    if (!sort_arr)
+      return true;
+
+    // allocate all first, so a failure leaves the array untouched
+    std::vector<char*> cols(model->_num_fields, (char*)NULL);
+    for (size_t k = 0; k < model->_num_fields; ++k)
+    {
+      cols[k] = (char*)malloc(_capacity * model->_all_fields[k]->size());
+      if (!cols[k])
+      {
+        for (size_t j = 0; j < k; ++j) free(cols[j]);
+        return false;
+      }
+    }
+
+    for (size_t k = 0; k < model->_num_fields; ++k)
+    {
+      size_t sz = model->_all_fields[k]->size();
+      for (size_t i = 0; i < _entries; ++i)
+      {
+        memcpy(cols[k] + i * sz, columns[k] + (*sort_arr)[i] * sz, sz);
+      }
+      free(columns[k]);
+      columns[k] = cols[k];
+    }
+
+    delete sort_arr;
+    sort_arr = NULL;
+    return true;
+  }
+
+private:
+
+  struct Sorter
+  {
+    RM_Type **fields;
+    const char **cols;
+    size_t n;
+
+    bool operator()(SORT_IDX a, SORT_IDX b) const
+    {
+      for (size_t j = 0; j < n; ++j)
+      {
+        size_t sz = fields[j]->size();
+        int c = fields[j]->compare_memory(cols[j] + a * sz, cols[j] + b * sz);
+        if (c != 0) return (c < 0);
+      }
+      return false;
+    }
+  };
+
+  bool _alloc(size_t capacity)
+  {
+    if (capacity < 8) capacity = 8;
+
+    // a column which was grown already is just larger than _capacity
+    for (size_t k = 0; k < model->_num_fields; ++k)
+    {
+      char *col = (char*)realloc(columns[k], capacity * model->_all_fields[k]->size());
+      if (!col)
+        return false;
+      columns[k] = col;
+    }
+
+    _capacity = capacity;
+    if (sort_arr)
+      sort_arr->reserve(capacity);
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef __RECORD_MODEL_JOIN__HEADER__
+#define __RECORD_MODEL_JOIN__HEADER__
+
+#include "RecordModel.h"
+#include <pthread.h> // pthread_create
+#include <assert.h>  // assert
+#include <typeinfo>  // typeid
+#include <vector>    // std::vector
+
+/*
+ * Sort-merge (inner) join of two RecordModelInstanceArrays, both sorted on
+ * their join keys (RecordModelInstanceArray::sort). The models of the inputs
+ * and of the target array may differ. The i-th left key is compared with the
+ * i-th right key, which must be of the same type.
+ *
+ * For every pair of records with equal join keys, a record of the target
+ * model is emitted: all fields set to their default, then each mapped field
+ * copied from the left or right record.
+ *
+ * The left input is cut into "num_threads" partitions at positions where the
+ * join key changes, and each partition is joined with the range of the right
+ * input holding the same keys (found by binary search) on a thread of its
+ * own. The per-thread results are appended to the target in partition
+ * order, so the output is the same as that of a single thread.
+ *
+ * With "combine", the emitted records are combined by the keys of the target
+ * model (RecordModelInstanceArray::combine) whenever a per-thread array
+ * becomes full, and the target once at the end. So memory use is bounded by
+ * the number of distinct target keys, not by the number of joined pairs.
+ *
+ * Nothing calls back into Ruby, so run() can be called outside the GVL.
+ */
+struct RecordModelJoin
+{
+  enum { JOIN_OK = 0, JOIN_NOT_SORTED = -1, JOIN_NO_MEMORY = -2 };
+
+  struct FieldMap
+  {
+    RM_Type *dst;  // field of the target model
+    RM_Type *src;  // field of the left or right model
+    bool right;
+  };
+
+  struct Worker
+  {
+    RecordModelJoin *join;
+    size_t l_beg, l_end;
+    size_t r_beg, r_end;
+    RecordModelInstanceArray arr;
+    std::vector<char> buf;  // the record being emitted
+    size_t pairs;
+    bool failed;
+  };
+
+  RecordModelInstanceArray *left;
+  RecordModelInstanceArray *right;
+  RecordModelInstanceArray *target;
+  std::vector<RM_Type*> left_keys;
+  std::vector<RM_Type*> right_keys;
+  std::vector<FieldMap> maps;
+  size_t num_threads;
+  bool combine;
+  size_t array_size;  // initial capacity of the per-thread arrays
+
+  size_t pairs;  // number of joined pairs
+
+  RecordModelJoin(RecordModelInstanceArray *left, RecordModelInstanceArray *right,
+                  RecordModelInstanceArray *target, size_t num_threads = 1, bool combine = false)
+  {
+    assert(num_threads > 0);
+    this->left = left;
+    this->right = right;
+    this->target = target;
+    this->num_threads = num_threads;
+    this->combine = combine;
+    this->array_size = 4096;
+    this->pairs = 0;
+  }
+
+  /*
+   * Fields are only comparable or copyable between equal types.
+   */
+  static bool compatible(RM_Type *a, RM_Type *b)
+  {
+    return (typeid(*a) == typeid(*b) && a->size() == b->size());
+  }
+
+  bool add_key(RM_Type *l, RM_Type *r)
+  {
+    if (!compatible(l, r)) return false;
+    left_keys.push_back(l);
+    right_keys.push_back(r);
+    return true;
+  }
+
+  bool add_field(RM_Type *dst, RM_Type *src, bool from_right)
+  {
+    if (!compatible(dst, src)) return false;
+    FieldMap m = {dst, src, from_right};
+    maps.push_back(m);
+    return true;
+  }
+
+  /*
+   * Returns JOIN_OK, or JOIN_NOT_SORTED if an input is not sorted by its
+   * join keys (then the target is left untouched), or JOIN_NO_MEMORY.
+   */
+  int run()
+  {
+    assert(!left_keys.empty());
+
+    if (!is_sorted(left, left_keys) || !is_sorted(right, right_keys))
+      return JOIN_NOT_SORTED;
+
+    size_t n = left->entries();
+    size_t threads = num_threads;
+    if (threads > n) threads = (n > 0) ? n : 1;
+
+    Worker *workers = new Worker[threads];
+    int res = run_workers(workers, threads);
+    delete [] workers;
+    return res;
+  }
+
+private:
+
+  int run_workers(Worker *workers, size_t threads)
+  {
+    size_t n = left->entries();
+
+    // cut the left input, but never within a run of equal join keys
+    size_t prev = 0;
+    for (size_t t = 0; t < threads; ++t)
+    {
+      Worker &w = workers[t];
+      w.join = this;
+      w.pairs = 0;
+      w.failed = false;
+      w.arr.model = target->model;
+      w.arr.expandable = true;
+      w.buf.resize(target->model->size());
+
+      size_t cut = (t + 1 == threads) ? n : (n * (t + 1)) / threads;
+      if (cut < prev) cut = prev;
+      while (cut > 0 && cut < n && compare_left(cut - 1, cut) == 0) ++cut;
+
+      w.l_beg = prev;
+      w.l_end = cut;
+      w.r_beg = (t == 0) ? 0 : workers[t-1].r_end;
+      w.r_end = (cut < n) ? lower_bound(left->ptr_at(cut)) : right->entries();
+      prev = cut;
+
+      if (!w.arr.allocate(array_size))
+        return JOIN_NO_MEMORY;
+    }
+
+    std::vector<pthread_t> tids(threads);
+    std::vector<bool> started(threads, false);
+
+    // worker 0 runs on the calling thread
+    for (size_t t = 1; t < threads; ++t)
+    {
+      started[t] = (pthread_create(&tids[t], NULL, run_worker, &workers[t]) == 0);
+      if (!started[t])
+        run_worker(&workers[t]);
+    }
+    run_worker(&workers[0]);
+
+    for (size_t t = 1; t < threads; ++t)
+    {
+      if (started[t])
+        pthread_join(tids[t], NULL);
+    }
+
+    size_t total = 0;
+    for (size_t t = 0; t < threads; ++t)
+    {
+      if (workers[t].failed)
+        return JOIN_NO_MEMORY;
+      total += workers[t].arr.entries();
+    }
+
+    size_t room = target->capacity() - target->entries();
+    if (total > room && !target->expand(target->entries() + total))
+      return JOIN_NO_MEMORY;
+
+    pairs = 0;
+    for (size_t t = 0; t < threads; ++t)
+    {
+      Worker &w = workers[t];
+      for (size_t i = 0; i < w.arr.entries(); ++i)
+      {
+        RecordModelInstance src(target->model, w.arr.ptr_at(i));
+        if (!target->push(&src))
+          return JOIN_NO_MEMORY;
+      }
+      pairs += w.pairs;
+    }
+
+    if (combine && !target->combine())
+      return JOIN_NO_MEMORY;
+
+    return JOIN_OK;
+  }
+
+  static int compare_keys(const std::vector<RM_Type*> &ka, const void *a,
+                          const std::vector<RM_Type*> &kb, const void *b)
+  {
+    for (size_t k = 0; k < ka.size(); ++k)
+    {
+      int c = ka[k]->compare_memory((const char*)a + ka[k]->offset(), (const char*)b + kb[k]->offset());
+      if (c != 0) return c;
+    }
+    return 0;
+  }
+
+  int compare_left(size_t a, size_t b)
+  {
+    return compare_keys(left_keys, left->ptr_at(a), left_keys, left->ptr_at(b));
+  }
+
+  static bool is_sorted(RecordModelInstanceArray *arr, const std::vector<RM_Type*> &keys)
+  {
+    for (size_t i = 1; i < arr->entries(); ++i)
+    {
+      if (compare_keys(keys, arr->ptr_at(i-1), keys, arr->ptr_at(i)) > 0)
+        return false;
+    }
+    return true;
+  }
+
+  /*
+   * Position of the first right record whose keys are not less than those
+   * of left record "lrec".
+   */
+  size_t lower_bound(const void *lrec)
+  {
+    size_t lo = 0, hi = right->entries();
+    while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (compare_keys(right_keys, right->ptr_at(mid), left_keys, lrec) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo;
+  }
+
+  bool emit(Worker *w, const void *lrec, const void *rrec)
+  {
+    RecordModelInstanceArray &arr = w->arr;
+
+    if (arr.full() && combine)
+    {
+      // combining is worthwhile only if it frees a good part of the array
+      if (!arr.combine())
+        return false;
+      if (arr.entries() > arr.capacity() / 2 && !arr.expand(arr.capacity() * 2))
+        return false;
+    }
+
+    RecordModelInstance rec(arr.model, &w->buf[0]);
+    rec.zero();
+    for (size_t m = 0; m < maps.size(); ++m)
+    {
+      const FieldMap &fm = maps[m];
+      const char *src = (const char*)(fm.right ? rrec : lrec);
+      fm.dst->set_from_memory(rec.ptr(), src + fm.src->offset());
+    }
+    return arr.push(&rec);
+  }
+
+  static void *run_worker(void *ptr)
+  {
+    Worker *w = (Worker*)ptr;
+    RecordModelJoin *j = w->join;
+
+    size_t i = w->l_beg;
+    size_t k = w->r_beg;
+
+    while (i < w->l_end && k < w->r_end)
+    {
+      const void *lrec = j->left->ptr_at(i);
+      int c = compare_keys(j->left_keys, lrec, j->right_keys, j->right->ptr_at(k));
+      if (c < 0) { ++i; continue; }
+      if (c > 0) { ++k; continue; }
+
+      // runs of equal keys on both sides
+      size_t i_end = i + 1;
+      while (i_end < w->l_end && j->compare_left(i, i_end) == 0) ++i_end;
+      size_t k_end = k + 1;
+      while (k_end < w->r_end &&
+             compare_keys(j->left_keys, lrec, j->right_keys, j->right->ptr_at(k_end)) == 0) ++k_end;
+
+      for (size_t a = i; a < i_end; ++a)
+      {
+        for (size_t b = k; b < k_end; ++b)
+        {
+          if (!j->emit(w, j->left->ptr_at(a), j->right->ptr_at(b)))
+          {
+            w->failed = true;
+            return NULL;
+          }
+          ++w->pairs;
+        }
+      }
+
+      i = i_end;
+      k = k_end;
+    }
+
+    return NULL;
+  }
+};
+
+#endif
@@ -0,0 +1,294 @@
+#ifndef __RECORD_MODEL_JSON__HEADER__
+#define __RECORD_MODEL_JSON__HEADER__
+
+#include "RM_Scan.h"
+#include <string.h>  // memchr, memcpy
+#include <stdint.h>
+
+/*
+ * Scanner for one JSON object per line (JSON lines).
+ *
+ * Only the members of the top-level object are returned. Nested objects and
+ * arrays are skipped as a whole (balanced brackets, strings within honored).
+ * String values are returned without the quotes. Only strings containing a
+ * backslash are unescaped (into "scratch"), all others point into the line.
+ * Strings are located with the vectorized RM_Scan::find_sep.
+ */
+struct RM_Json
+{
+  enum ValueType { VALUE_STRING, VALUE_LITERAL, VALUE_NULL, VALUE_NESTED };
+
+  struct Member
+  {
+    const char *key;
+    const char *key_end;
+    const char *val;
+    const char *val_end;
+    ValueType type;
+  };
+
+  const char *p;
+  const char *end;
+  char *scratch;  // room for (end - p) bytes
+  bool first;     // no member read yet
+
+  RM_Json(const char *str, const char *end, char *scratch) : p(str), end(end), scratch(scratch), first(true) {}
+
+  /*
+   * Consumes the opening brace. Returns false if the line is no object.
+   */
+  bool begin()
+  {
+    skip_ws();
+    if (p == end || *p != '{')
+      return false;
+    ++p;
+    skip_ws();
+    return true;
+  }
+
+  /*
+   * Reads the next member into "m". Returns 1 on success, 0 at the end of
+   * the object and -1 on malformed input.
+   */
+  int next(Member &m)
+  {
+    if (p == end)
+      return -1;
+    if (*p == '}')
+    {
+      ++p;
+      skip_ws();
+      return (p == end) ? 0 : -1;
+    }
+    if (*p == ',')
+    {
+      // a comma only separates members
+      if (first)
+        return -1;
+      ++p;
+      skip_ws();
+    }
+
+    if (p == end || *p != '"' || !parse_string(m.key, m.key_end))
+      return -1;
+    skip_ws();
+    if (p == end || *p != ':')
+      return -1;
+    ++p;
+    skip_ws();
+    if (p == end)
+      return -1;
+
+    switch (*p)
+    {
+      case '"':
+        if (!parse_string(m.val, m.val_end))
+          return -1;
+        m.type = VALUE_STRING;
+        break;
+
+      case '{':
+      case '[':
+        m.val = p;
+        if (!skip_nested())
+          return -1;
+        m.val_end = p;
+        m.type = VALUE_NESTED;
+        break;
+
+      default:
+        m.val = p;
+        while (p != end && *p != ',' && *p != '}' && !RM_Scan::is_space(*p)) ++p;
+        m.val_end = p;
+        if (m.val == m.val_end)
+          return -1;
+        if (m.val_end - m.val == 4 && memcmp(m.val, "null", 4) == 0)
+          m.type = VALUE_NULL;
+        else
+          m.type = VALUE_LITERAL;
+    }
+
+    skip_ws();
+    if (p == end || (*p != ',' && *p != '}'))
+      return -1;
+    first = false;
+    return 1;
+  }
+
+private:
+
+  void skip_ws()
+  {
+    p = RM_Scan::skip_space(p, end);
+  }
+
+  /*
+   * "p" points to the opening quote.
+   */
+  bool parse_string(const char *&beg, const char *&str_end)
+  {
+    ++p;
+    const char *q = RM_Scan::find_sep(p, end, '"');
+    if (q == end)
+      return false;
+
+    if (!memchr(p, '\\', q - p))
+    {
+      beg = p;
+      str_end = q;
+      p = q + 1;
+      return true;
+    }
+
+    // slow path: unescape
+    char *out = scratch;
+    beg = out;
+    while (p != end && *p != '"')
+    {
+      if (*p != '\\')
+      {
+        *out++ = *p++;
+        continue;
+      }
+      if (++p == end)
+        return false;
+      switch (*p++)
+      {
+        case '"': *out++ = '"'; break;
+        case '\\': *out++ = '\\'; break;
+        case '/': *out++ = '/'; break;
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u':
+        {
+          uint32_t cp;
+          if (!parse_hex4(cp))
+            return false;
+          if (cp >= 0xD800 && cp < 0xDC00)
+          {
+            // surrogate pair
+            uint32_t lo;
+            if (end - p < 6 || p[0] != '\\' || p[1] != 'u')
+              return false;
+            p += 2;
+            if (!parse_hex4(lo) || lo < 0xDC00 || lo > 0xDFFF)
+              return false;
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+          }
+          else if (cp >= 0xDC00 && cp <= 0xDFFF)
+          {
+            // low surrogate without a high one
+            return false;
+          }
+          out = encode_utf8(out, cp);
+          break;
+        }
+        default:
+          return false;
+      }
+    }
+    if (p == end)
+      return false;
+    str_end = out;
+    scratch = out;
+    ++p;
+    return true;
+  }
+
+  bool parse_hex4(uint32_t &cp)
+  {
+    if (end - p < 4)
+      return false;
+    cp = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+      char c = *p++;
+      cp <<= 4;
+      if (c >= '0' && c <= '9') cp |= c - '0';
+      else if (c >= 'a' && c <= 'f') cp |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F') cp |= c - 'A' + 10;
+      else return false;
+    }
+    return true;
+  }
+
+  /*
+   * An escape sequence is at least 6 bytes long, its UTF-8 encoding at
+   * most 4, so unescaping never needs more room than the input.
+   */
+  static char *encode_utf8(char *out, uint32_t cp)
+  {
+    if (cp < 0x80)
+    {
+      *out++ = cp;
+    }
+    else if (cp < 0x800)
+    {
+      *out++ = 0xC0 | (cp >> 6);
+      *out++ = 0x80 | (cp & 0x3F);
+    }
+    else if (cp < 0x10000)
+    {
+      *out++ = 0xE0 | (cp >> 12);
+      *out++ = 0x80 | ((cp >> 6) & 0x3F);
+      *out++ = 0x80 | (cp & 0x3F);
+    }
+    else
+    {
+      *out++ = 0xF0 | (cp >> 18);
+      *out++ = 0x80 | ((cp >> 12) & 0x3F);
+      *out++ = 0x80 | ((cp >> 6) & 0x3F);
+      *out++ = 0x80 | (cp & 0x3F);
+    }
+    return out;
+  }
+
+  /*
+   * "p" points to the opening bracket.
+   */
+  bool skip_nested()
+  {
+    int depth = 0;
+    while (p != end)
+    {
+      char c = *p;
+      if (c == '"')
+      {
+        // skip the string, honoring escaped quotes
+        ++p;
+        for (;;)
+        {
+          const char *q = RM_Scan::find_sep(p, end, '"');
+          if (q == end)
+            return false;
+          const char *b = q;
+          while (b > p && b[-1] == '\\') --b;
+          p = q + 1;
+          if ((q - b) % 2 == 0)
+            break;
+        }
+        continue;
+      }
+      if (c == '{' || c == '[')
+      {
+        ++depth;
+      }
+      else if (c == '}' || c == ']')
+      {
+        if (--depth == 0)
+        {
+          ++p;
+          return true;
+        }
+      }
+      ++p;
+    }
+    return false;
+  }
+};
+
+#endif
@@ -0,0 +1,325 @@
+#ifndef __RECORD_MODEL_PARSE_PLAN__HEADER__
+#define __RECORD_MODEL_PARSE_PLAN__HEADER__
+
+#include "RecordModel.h"
+#include "RM_Json.h"
+#include <typeinfo>  // typeid
+#include <vector>    // std::vector
+#include <string>    // std::string
+#include <algorithm> // std::sort
+#include <stdlib.h>  // malloc
+#include <string.h>  // memcpy
+
+// quoted lines up to this length are unescaped without allocating memory
+#define RM_MAX_STACK_SCRATCH 4096
+
+/*
+ * A parse plan is built once for a model, field array and dialect (see
+ * RM_Dialect), and then used to parse many lines:
+ *
+ *   - Ignored columns (field_arr[i] < 0) are not part of the plan. Each step
+ *     directly refers to the token it parses.
+ *
+ *   - Each step calls set_from_string of the concrete type through a
+ *     trampoline with a qualified (non-virtual, inlinable) call.
+ *
+ *   - The record is reset by copying a template record holding the default
+ *     values, instead of calling set_default for every field. Empty
+ *     (CSV) fields keep that default.
+ *
+ * parse_line returns exactly what RecordModelInstance::parse_line returns.
+ *
+ * A plan built from a list of keys instead parses JSON lines (see RM_Json):
+ * each member of the object whose key is in the list is parsed into the
+ * corresponding field (true/false as 1/0, null keeps the default). Unknown
+ * keys and nested values are ignored. parse_line then returns the number of
+ * parsed members (including nulls), or the number parsed before the failing
+ * member (err is RM_ERR_JSON for malformed JSON).
+ */
+struct RM_ParsePlan
+{
+  typedef int (*set_fn)(RM_Type *field, void *rec, const char *s, const char *e);
+
+  struct Step
+  {
+    int token;       // index of the token in the line
+    RM_Type *field;
+    set_fn set;
+  };
+
+  struct KeyStep
+  {
+    std::string key;
+    Step step;
+
+    bool operator<(const KeyStep &other) const { return key < other.key; }
+  };
+
+  RecordModel *model;
+  std::vector<Step> steps;
+  std::vector<KeyStep> key_steps;  // sorted by key
+  bool json;
+  int field_arr_sz;
+  RM_Dialect dialect;
+  void *defaults;  // record with all fields set to their default value
+
+  RM_ParsePlan(RecordModel *model, const int *field_arr, int field_arr_sz, const RM_Dialect &dialect)
+  {
+    this->model = model;
+    this->field_arr_sz = field_arr_sz;
+    this->dialect = dialect;
+    this->json = false;
+
+    for (int i = 0; i < field_arr_sz; ++i)
+    {
+      if (field_arr[i] < 0)
+        continue;
+
+      Step step;
+      step.token = i;
+      step.field = model->get_field(field_arr[i]);
+      assert(step.field);
+      step.set = trampoline_for(step.field);
+      steps.push_back(step);
+    }
+
+    init_defaults();
+  }
+
+  RM_ParsePlan(RecordModel *model, const std::vector<std::string> &keys, const int *fields)
+  {
+    this->model = model;
+    this->field_arr_sz = keys.size();
+    this->json = true;
+
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+      KeyStep ks;
+      ks.key = keys[i];
+      ks.step.token = i;
+      ks.step.field = model->get_field(fields[i]);
+      assert(ks.step.field);
+      ks.step.set = trampoline_for(ks.step.field);
+      key_steps.push_back(ks);
+    }
+    std::sort(key_steps.begin(), key_steps.end());
+
+    init_defaults();
+  }
+
+  ~RM_ParsePlan()
+  {
+    free(defaults);
+  }
+
+  /*
+   * Sets all fields of "rec" to their default values.
+   */
+  inline void zero(RecordModelInstance *rec) const
+  {
+    assert(rec->model == model);
+    memcpy(rec->ptr(), defaults, model->size());
+  }
+
+  /*
+   * Resets "rec" and parses the line [str, end) into it. See RecordModelInstance::parse_line.
+   * Malformed quoting is reported as RM_ERR_QUOTE for token 0.
+   */
+  int parse_line(RecordModelInstance *rec, const char *str, const char *end, int &err) const
+  {
+    if (json)
+      return parse_json(rec, str, end, err);
+
+    zero(rec);
+
+    RM_Token stack_tokens[RM_MAX_STACK_TOKENS];
+    RM_Token *tokens = stack_tokens;
+    if (field_arr_sz + 1 > RM_MAX_STACK_TOKENS)
+    {
+      tokens = new RM_Token[field_arr_sz + 1];
+    }
+
+    int res;
+    if (dialect.quoted())
+    {
+      char stack_scratch[RM_MAX_STACK_SCRATCH];
+      char *scratch = stack_scratch;
+      if ((size_t)(end - str) > sizeof(stack_scratch))
+      {
+        scratch = new char[end - str];
+      }
+
+      int num_tokens = RM_Token::split_quoted(str, end, dialect, tokens, field_arr_sz + 1, scratch);
+      if (num_tokens < 0)
+      {
+        err = RM_ERR_QUOTE;
+        res = 0;
+      }
+      else
+      {
+        res = parse_tokens(rec, tokens, num_tokens, err);
+      }
+
+      if (scratch != stack_scratch)
+      {
+        delete [] scratch;
+      }
+    }
+    else
+    {
+      int num_tokens = RM_Token::split(str, end, dialect.sep, tokens, field_arr_sz + 1);
+      res = parse_tokens(rec, tokens, num_tokens, err);
+    }
+
+    if (tokens != stack_tokens)
+    {
+      delete [] tokens;
+    }
+
+    return res;
+  }
+
+  int parse_tokens(RecordModelInstance *rec, const RM_Token *tokens, int num_tokens, int &err) const
+  {
+    err = RM_ERR_OK;
+
+    for (size_t k = 0; k < steps.size(); ++k)
+    {
+      const Step &step = steps[k];
+      if (step.token >= num_tokens)
+        break;
+      if (tokens[step.token].beg == tokens[step.token].end)
+        continue; // empty field
+
+      err = step.set(step.field, rec->ptr(), tokens[step.token].beg, tokens[step.token].end);
+      if (err)
+        return step.token;
+    }
+
+    if (num_tokens < field_arr_sz)
+      return num_tokens; // premature end
+    if (num_tokens == field_arr_sz)
+      return field_arr_sz; // means, OK
+    return field_arr_sz+1; // means, has additional items
+  }
+
+  int parse_json(RecordModelInstance *rec, const char *str, const char *end, int &err) const
+  {
+    zero(rec);
+    err = RM_ERR_OK;
+
+    char stack_scratch[RM_MAX_STACK_SCRATCH];
+    char *scratch = stack_scratch;
+    if ((size_t)(end - str) > sizeof(stack_scratch))
+    {
+      scratch = new char[end - str];
+    }
+
+    RM_Json scanner(str, end, scratch);
+    RM_Json::Member m;
+    int num_parsed = 0;
+
+    if (!scanner.begin())
+    {
+      err = RM_ERR_JSON;
+    }
+    else
+    {
+      for (;;)
+      {
+        int r = scanner.next(m);
+        if (r == 0)
+          break;
+        if (r < 0)
+        {
+          err = RM_ERR_JSON;
+          break;
+        }
+
+        const Step *step = find_key(m.key, m.key_end);
+        if (!step || m.type == RM_Json::VALUE_NESTED)
+          continue;
+        if (m.type == RM_Json::VALUE_NULL)
+        {
+          ++num_parsed;
+          continue;
+        }
+
+        const char *v = m.val, *v_end = m.val_end;
+        if (m.type == RM_Json::VALUE_LITERAL)
+        {
+          if (v_end - v == 4 && memcmp(v, "true", 4) == 0) { v = "1"; v_end = v + 1; }
+          else if (v_end - v == 5 && memcmp(v, "false", 5) == 0) { v = "0"; v_end = v + 1; }
+        }
+
+        err = step->set(step->field, rec->ptr(), v, v_end);
+        if (err)
+          break;
+        ++num_parsed;
+      }
+    }
+
+    if (scratch != stack_scratch)
+    {
+      delete [] scratch;
+    }
+
+    return num_parsed;
+  }
+
+private:
+
+  void init_defaults()
+  {
+    defaults = malloc(model->size());
+    assert(defaults);
+    RecordModelInstance rec(model, defaults);
+    rec.zero();
+  }
+
+  const Step *find_key(const char *key, const char *key_end) const
+  {
+    size_t len = key_end - key;
+    size_t l = 0, r = key_steps.size();
+    while (l < r)
+    {
+      size_t m = (l + r) / 2;
+      int c = key_steps[m].key.compare(0, std::string::npos, key, len);
+      if (c == 0) return &key_steps[m].step;
+      if (c < 0) l = m + 1;
+      else r = m;
+    }
+    return NULL;
+  }
+
+  template <class T>
+  static int set_from_string_of(RM_Type *field, void *rec, const char *s, const char *e)
+  {
+    return static_cast<T*>(field)->T::set_from_string(rec, s, e);
+  }
+
+  static int set_from_string_virtual(RM_Type *field, void *rec, const char *s, const char *e)
+  {
+    return field->set_from_string(rec, s, e);
+  }
+
+  static set_fn trampoline_for(RM_Type *field)
+  {
+    const std::type_info &t = typeid(*field);
+
+    if (t == typeid(RM_UINT8)) return set_from_string_of<RM_UINT8>;
+    if (t == typeid(RM_UINT16)) return set_from_string_of<RM_UINT16>;
+    if (t == typeid(RM_UINT32)) return set_from_string_of<RM_UINT32>;
+    if (t == typeid(RM_UINT64)) return set_from_string_of<RM_UINT64>;
+    if (t == typeid(RM_TIMESTAMP)) return set_from_string_of<RM_TIMESTAMP>;
+    if (t == typeid(RM_TIMESTAMP_DESC)) return set_from_string_of<RM_TIMESTAMP_DESC>;
+    if (t == typeid(RM_DOUBLE)) return set_from_string_of<RM_DOUBLE>;
+    if (t == typeid(RM_IP)) return set_from_string_of<RM_IP>;
+    if (t == typeid(RM_HEXSTR)) return set_from_string_of<RM_HEXSTR>;
+    if (t == typeid(RM_STR)) return set_from_string_of<RM_STR>;
+
+    return set_from_string_virtual;
+  }
+};
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef __RECORD_MODEL_SCAN__HEADER__
+#define __RECORD_MODEL_SCAN__HEADER__
+
+#include <stdint.h>  // uintptr_t
+#include <string.h>  // memchr
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RM_SCAN_X86
+#endif
+
+/*
+ * Vectorized scanning of the range [ptr, end), used by RM_Token.
+ *
+ * The SSE2 and AVX2 variants only ever use aligned loads, and only of blocks
+ * which contain at least one byte of the range. An aligned block never
+ * crosses a page boundary, so reading the bytes before "ptr" and behind "end"
+ * is safe (the same trick libc's str* functions use), even at the end of a
+ * memory mapped file. The variant is chosen once at runtime, depending on
+ * the CPU.
+ *
+ * Whitespace means the isspace characters of the "C" locale: ' ', '\t',
+ * '\n', '\v', '\f' and '\r'.
+ */
+struct RM_Scan
+{
+  typedef const char *(*find_sep_fn)(const char *ptr, const char *end, char sep);
+  typedef const char *(*find_space_fn)(const char *ptr, const char *end);
+
+  struct Impl
+  {
+    find_sep_fn find_sep;
+    find_space_fn find_space;
+    find_space_fn skip_space;
+    const char *name;
+  };
+
+  /*
+   * Returns a pointer to the first "sep" or "end".
+   */
+  static inline const char *find_sep(const char *ptr, const char *end, char sep)
+  {
+    if (ptr >= end) return end;
+    return impl().find_sep(ptr, end, sep);
+  }
+
+  /*
+   * Returns a pointer to the first whitespace or "end".
+   */
+  static inline const char *find_space(const char *ptr, const char *end)
+  {
+    if (ptr >= end) return end;
+    return impl().find_space(ptr, end);
+  }
+
+  /*
+   * Returns a pointer to the first non-whitespace or "end".
+   */
+  static inline const char *skip_space(const char *ptr, const char *end)
+  {
+    if (ptr >= end) return end;
+    return impl().skip_space(ptr, end);
+  }
+
+  /*
+   * Returns a pointer to the first "c" within [ptr, end) or NULL.
+   * memchr is already vectorized by the libc.
+   */
+  static inline const char *find_byte(const char *ptr, const char *end, char c)
+  {
+    return (const char*)memchr(ptr, c, end - ptr);
+  }
+
+  /*
+   * Name of the selected variant ("avx2", "sse2" or "scalar").
+   */
+  static const char *variant()
+  {
+    return impl().name;
+  }
+
+  static inline bool is_space(char c)
+  {
+    return (c == ' ' || (unsigned char)(c - '\t') < 5);
+  }
+
+  static const Impl &impl()
+  {
+    static const Impl i = select();
+    return i;
+  }
+
+private:
+
+  static Impl select()
+  {
+    Impl i;
+#ifdef RM_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+      i.find_sep = find_sep_avx2;
+      i.find_space = find_space_avx2;
+      i.skip_space = skip_space_avx2;
+      i.name = "avx2";
+      return i;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+      i.find_sep = find_sep_sse2;
+      i.find_space = find_space_sse2;
+      i.skip_space = skip_space_sse2;
+      i.name = "sse2";
+      return i;
+    }
+#endif
+    i.find_sep = find_sep_scalar;
+    i.find_space = find_space_scalar;
+    i.skip_space = skip_space_scalar;
+    i.name = "scalar";
+    return i;
+  }
+
+  static const char *find_sep_scalar(const char *ptr, const char *end, char sep)
+  {
+    while (ptr != end && *ptr != sep) ++ptr;
+    return ptr;
+  }
+
+  static const char *find_space_scalar(const char *ptr, const char *end)
+  {
+    while (ptr != end && !is_space(*ptr)) ++ptr;
+    return ptr;
+  }
+
+  static const char *skip_space_scalar(const char *ptr, const char *end)
+  {
+    while (ptr != end && is_space(*ptr)) ++ptr;
+    return ptr;
+  }
+
+#ifdef RM_SCAN_X86
+
+  /*
+   * Each matcher returns a bitmask of the bytes of a block which stop the
+   * scan.
+   */
+
+  __attribute__((target("sse2")))
+  static inline __m128i space_mask_sse2(__m128i x)
+  {
+    // (x == ' ') || (x - '\t') <= 4 (unsigned)
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+    __m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(4)), d);
+    return _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), in_range);
+  }
+
+  struct SepMatcherSSE2
+  {
+    __m128i vsep;
+    __attribute__((target("sse2"))) SepMatcherSSE2(char sep) : vsep(_mm_set1_epi8(sep)) {}
+    __attribute__((target("sse2"))) inline uint32_t operator()(__m128i x) const
+    {
+      return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, vsep));
+    }
+  };
+
+  struct SpaceMatcherSSE2
+  {
+    __attribute__((target("sse2"))) inline uint32_t operator()(__m128i x) const
+    {
+      return (uint32_t)_mm_movemask_epi8(space_mask_sse2(x));
+    }
+  };
+
+  struct NonSpaceMatcherSSE2
+  {
+    __attribute__((target("sse2"))) inline uint32_t operator()(__m128i x) const
+    {
+      return (~(uint32_t)_mm_movemask_epi8(space_mask_sse2(x))) & 0xFFFF;
+    }
+  };
+
+  template <class M>
+  __attribute__((target("sse2")))
+  static inline const char *scan_sse2(const char *ptr, const char *end, const M &match)
+  {
+    // ptr < end
+    uintptr_t misalign = (uintptr_t)ptr & 15;
+    const __m128i *p = (const __m128i*)(ptr - misalign);
+    uint32_t mask = match(_mm_load_si128(p)) & (0xFFFFu << misalign);
+    while (mask == 0)
+    {
+      ++p;
+      if ((const char*)p >= end) return end;
+      mask = match(_mm_load_si128(p));
+    }
+    const char *r = ((const char*)p) + __builtin_ctz(mask);
+    return (r < end) ? r : end;
+  }
+
+  __attribute__((target("sse2")))
+  static const char *find_sep_sse2(const char *ptr, const char *end, char sep)
+  {
+    return scan_sse2(ptr, end, SepMatcherSSE2(sep));
+  }
+
+  __attribute__((target("sse2")))
+  static const char *find_space_sse2(const char *ptr, const char *end)
+  {
+    return scan_sse2(ptr, end, SpaceMatcherSSE2());
+  }
+
+  __attribute__((target("sse2")))
+  static const char *skip_space_sse2(const char *ptr, const char *end)
+  {
+    return scan_sse2(ptr, end, NonSpaceMatcherSSE2());
+  }
+
+  __attribute__((target("avx2")))
+  static inline __m256i space_mask_avx2(__m256i x)
+  {
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8('\t'));
+    __m256i in_range = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(4)), d);
+    return _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), in_range);
+  }
+
+  struct SepMatcherAVX2
+  {
+    __m256i vsep;
+    __attribute__((target("avx2"))) SepMatcherAVX2(char sep) : vsep(_mm256_set1_epi8(sep)) {}
+    __attribute__((target("avx2"))) inline uint32_t operator()(__m256i x) const
+    {
+      return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, vsep));
+    }
+  };
+
+  struct SpaceMatcherAVX2
+  {
+    __attribute__((target("avx2"))) inline uint32_t operator()(__m256i x) const
+    {
+      return (uint32_t)_mm256_movemask_epi8(space_mask_avx2(x));
+    }
+  };
+
+  struct NonSpaceMatcherAVX2
+  {
+    __attribute__((target("avx2"))) inline uint32_t operator()(__m256i x) const
+    {
+      return ~(uint32_t)_mm256_movemask_epi8(space_mask_avx2(x));
+    }
+  };
+
+  template <class M>
+  __attribute__((target("avx2")))
+  static inline const char *scan_avx2(const char *ptr, const char *end, const M &match)
+  {
+    // ptr < end
+    uintptr_t misalign = (uintptr_t)ptr & 31;
+    const __m256i *p = (const __m256i*)(ptr - misalign);
+    uint32_t mask = match(_mm256_load_si256(p)) & (0xFFFFFFFFu << misalign);
+    while (mask == 0)
+    {
+      ++p;
+      if ((const char*)p >= end) return end;
+      mask = match(_mm256_load_si256(p));
+    }
+    const char *r = ((const char*)p) + __builtin_ctz(mask);
+    return (r < end) ? r : end;
+  }
+
+  __attribute__((target("avx2")))
+  static const char *find_sep_avx2(const char *ptr, const char *end, char sep)
+  {
+    return scan_avx2(ptr, end, SepMatcherAVX2(sep));
+  }
+
+  __attribute__((target("avx2")))
+  static const char *find_space_avx2(const char *ptr, const char *end)
+  {
+    return scan_avx2(ptr, end, SpaceMatcherAVX2());
+  }
+
+  __attribute__((target("avx2")))
+  static const char *skip_space_avx2(const char *ptr, const char *end)
+  {
+    return scan_avx2(ptr, end, NonSpaceMatcherAVX2());
+  }
+
+#endif
+};
+
+#endif
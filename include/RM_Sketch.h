@@ -0,0 +1,257 @@
+#ifndef __RECORD_MODEL_SKETCH__HEADER__
+#define __RECORD_MODEL_SKETCH__HEADER__
+
+#include <stdint.h>  // uint64_t...
+#include <string.h>  // memcpy, memset
+#include <math.h>    // pow, log
+#include <vector>    // std::vector
+#include <algorithm> // std::sort
+#include <utility>   // std::pair
+
+/*
+ * Hash function used by the sketches (MurmurHash64A).
+ */
+struct RM_Hash
+{
+  static uint64_t hash64(const void *key, size_t len, uint64_t seed = 0x9E3779B97F4A7C15ULL)
+  {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    uint64_t h = seed ^ (len * m);
+
+    const unsigned char *data = (const unsigned char*)key;
+    const unsigned char *end = data + (len / 8) * 8;
+
+    for (; data != end; data += 8)
+    {
+      uint64_t k;
+      memcpy(&k, data, 8);
+
+      k *= m;
+      k ^= k >> r;
+      k *= m;
+
+      h ^= k;
+      h *= m;
+    }
+
+    switch (len & 7)
+    {
+      case 7: h ^= uint64_t(data[6]) << 48; /* fallthrough */
+      case 6: h ^= uint64_t(data[5]) << 40; /* fallthrough */
+      case 5: h ^= uint64_t(data[4]) << 32; /* fallthrough */
+      case 4: h ^= uint64_t(data[3]) << 24; /* fallthrough */
+      case 3: h ^= uint64_t(data[2]) << 16; /* fallthrough */
+      case 2: h ^= uint64_t(data[1]) << 8;  /* fallthrough */
+      case 1: h ^= uint64_t(data[0]);
+              h *= m;
+    };
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+  }
+};
+
+/*
+ * HyperLogLog sketch to estimate the number of distinct values.
+ *
+ * The registers are a plain byte array of size NUM_REGISTERS, so they can be
+ * stored as is (e.g. per slice within MMDB) and merged later.
+ */
+struct RM_HyperLogLog
+{
+  static const int P = 12;
+  static const size_t NUM_REGISTERS = (1 << P);
+
+  uint8_t registers[NUM_REGISTERS];
+
+  RM_HyperLogLog()
+  {
+    clear();
+  }
+
+  void clear()
+  {
+    memset(registers, 0, NUM_REGISTERS);
+  }
+
+  static void add_hash(uint8_t *regs, uint64_t h)
+  {
+    size_t idx = h >> (64 - P);
+    uint64_t w = (h << P) | (1ULL << (P - 1)); // guard bit, so w != 0
+    uint8_t rank = __builtin_clzll(w) + 1;
+    if (rank > regs[idx]) regs[idx] = rank;
+  }
+
+  void add_hash(uint64_t h)
+  {
+    add_hash(registers, h);
+  }
+
+  void add(const void *mem, size_t len)
+  {
+    add_hash(RM_Hash::hash64(mem, len));
+  }
+
+  void merge(const uint8_t *regs)
+  {
+    for (size_t i = 0; i < NUM_REGISTERS; ++i)
+    {
+      if (regs[i] > registers[i]) registers[i] = regs[i];
+    }
+  }
+
+  double estimate() const
+  {
+    const double m = NUM_REGISTERS;
+    const double alpha = 0.7213 / (1.0 + 1.079 / m);
+
+    double sum = 0.0;
+    size_t zeros = 0;
+    for (size_t i = 0; i < NUM_REGISTERS; ++i)
+    {
+      sum += 1.0 / (double)(1ULL << registers[i]);
+      if (registers[i] == 0) ++zeros;
+    }
+
+    double e = alpha * m * m / sum;
+
+    // small range correction (linear counting)
+    if (e <= 2.5 * m && zeros > 0)
+    {
+      e = m * log(m / (double)zeros);
+    }
+
+    return e;
+  }
+};
+
+/*
+ * KLL quantile sketch (Karnin, Lang, Liberty) over doubles.
+ *
+ * Level h holds items of weight 2^h. When a level exceeds its capacity, it is
+ * sorted and every other item (starting at a random offset) is promoted to the
+ * next level.
+ */
+struct RM_KLL
+{
+  size_t k;
+  uint64_t n;
+  uint64_t rnd;
+  std::vector< std::vector<double> > levels;
+
+  RM_KLL(size_t k = 200) : k(k), n(0), rnd(0x2545F4914F6CDD1DULL)
+  {
+    levels.resize(1);
+  }
+
+  size_t capacity(size_t level) const
+  {
+    size_t depth = levels.size() - level - 1;
+    size_t cap = (size_t)(k * pow(2.0/3.0, (double)depth));
+    return (cap < 2) ? 2 : cap;
+  }
+
+  void add(double v)
+  {
+    levels[0].push_back(v);
+    ++n;
+    if (levels[0].size() >= capacity(0))
+      compress();
+  }
+
+  void merge(const RM_KLL &other)
+  {
+    if (other.levels.size() > levels.size())
+      levels.resize(other.levels.size());
+
+    for (size_t h = 0; h < other.levels.size(); ++h)
+    {
+      levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+    }
+    n += other.n;
+    compress();
+  }
+
+  /*
+   * Returns the approximate value at quantile q (0.0 <= q <= 1.0), or NAN
+   * if the sketch is empty.
+   */
+  double quantile(double q) const
+  {
+    if (n == 0) return NAN;
+
+    std::vector< std::pair<double, uint64_t> > items;
+    uint64_t total = 0;
+    for (size_t h = 0; h < levels.size(); ++h)
+    {
+      for (size_t i = 0; i < levels[h].size(); ++i)
+      {
+        items.push_back(std::make_pair(levels[h][i], 1ULL << h));
+        total += 1ULL << h;
+      }
+    }
+    std::sort(items.begin(), items.end());
+
+    double rank = q * (double)total;
+    uint64_t cum = 0;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+      cum += items[i].second;
+      if ((double)cum >= rank) return items[i].first;
+    }
+    return items.back().first;
+  }
+
+private:
+
+  bool random_bit()
+  {
+    // xorshift64
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    return (rnd & 1);
+  }
+
+  void compress()
+  {
+    for (size_t h = 0; h < levels.size(); ++h)
+    {
+      if (levels[h].size() < capacity(h))
+        continue;
+
+      if (h + 1 == levels.size())
+        levels.resize(levels.size() + 1);
+
+      std::vector<double> &cur = levels[h];
+      std::vector<double> &next = levels[h+1];
+
+      std::sort(cur.begin(), cur.end());
+
+      // keep one item back if the number of items is odd
+      double leftover = 0.0;
+      bool has_leftover = (cur.size() % 2 == 1);
+      if (has_leftover)
+      {
+        leftover = cur.back();
+        cur.pop_back();
+      }
+
+      for (size_t i = random_bit() ? 1 : 0; i < cur.size(); i += 2)
+      {
+        next.push_back(cur[i]);
+      }
+
+      cur.clear();
+      if (has_leftover)
+        cur.push_back(leftover);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef __RECORD_MODEL_SLAB__HEADER__
+#define __RECORD_MODEL_SLAB__HEADER__
+
+#include <stdlib.h>  // malloc
+#include <stdint.h>
+#include <pthread.h> // pthread_mutex_t
+#include <assert.h>
+
+/*
+ * Allocator for the many small, equally sized blocks of RecordModelInstance
+ * objects (a header plus one record).
+ *
+ * Requests are rounded up to a multiple of ALIGN bytes (the size class).
+ * Each size class carves its blocks out of SLAB_SIZE byte slabs and keeps
+ * released blocks on a free list, so allocating and releasing an instance
+ * usually is a pointer swap. Models whose records fall into the same size
+ * class share the blocks. Slabs are never given back to the system, the
+ * pools stay at their peak size. Blocks larger than MAX_BLOCK go to malloc.
+ *
+ * Every block is preceded by a header storing its size class, so release()
+ * works without knowing the model (which the GC might have freed already).
+ *
+ * Thread-safe: worker threads allocate outside the GVL.
+ */
+struct RM_Slab
+{
+  static const size_t ALIGN = 16;
+  static const size_t MAX_BLOCK = 2048;
+  static const size_t NUM_CLASSES = MAX_BLOCK / ALIGN;
+  static const size_t SLAB_SIZE = 64 * 1024;
+
+  static void *alloc(size_t size)
+  {
+    size_t cls = (size + ALIGN - 1) / ALIGN;
+    if (cls == 0) cls = 1;
+
+    if (cls > NUM_CLASSES)
+    {
+      Header *h = (Header*)malloc(sizeof(Header) + size);
+      if (!h) return NULL;
+      h->cls = 0;
+      return h + 1;
+    }
+
+    return instance().classes[cls-1].alloc(cls);
+  }
+
+  static void release(void *ptr)
+  {
+    if (!ptr) return;
+    Header *h = ((Header*)ptr) - 1;
+    if (h->cls == 0)
+    {
+      free(h);
+      return;
+    }
+    assert(h->cls <= NUM_CLASSES);
+    instance().classes[h->cls-1].release(h);
+  }
+
+  /*
+   * Bytes of all slabs allocated so far (the peak size of the pools).
+   */
+  static size_t slab_bytes()
+  {
+    size_t total = 0;
+    for (size_t i = 0; i < NUM_CLASSES; ++i)
+    {
+      SizeClass &c = instance().classes[i];
+      pthread_mutex_lock(&c.mutex);
+      total += c.bytes;
+      pthread_mutex_unlock(&c.mutex);
+    }
+    return total;
+  }
+
+private:
+
+  union Header
+  {
+    size_t cls;       // 1-based size class, 0 if malloced
+    Header *next;     // free list link while released
+    char pad[ALIGN];  // keeps the block aligned
+  };
+
+  struct SizeClass
+  {
+    pthread_mutex_t mutex;
+    Header *free_list;
+    size_t bytes;     // of all slabs of this class
+
+    SizeClass()
+    {
+      pthread_mutex_init(&mutex, NULL);
+      free_list = NULL;
+      bytes = 0;
+    }
+
+    void *alloc(size_t cls)
+    {
+      pthread_mutex_lock(&mutex);
+      if (!free_list && !grow(cls))
+      {
+        pthread_mutex_unlock(&mutex);
+        return NULL;
+      }
+      Header *h = free_list;
+      free_list = h->next;
+      pthread_mutex_unlock(&mutex);
+
+      h->cls = cls;
+      return h + 1;
+    }
+
+    void release(Header *h)
+    {
+      pthread_mutex_lock(&mutex);
+      h->next = free_list;
+      free_list = h;
+      pthread_mutex_unlock(&mutex);
+    }
+
+    /*
+     * Puts the blocks of a new slab onto the free list.
+     */
+    bool grow(size_t cls)
+    {
+      size_t block_size = sizeof(Header) + cls * ALIGN;
+      size_t n = SLAB_SIZE / block_size;
+      if (n == 0) n = 1;
+      char *slab = (char*)malloc(n * block_size);
+      if (!slab) return false;
+      bytes += n * block_size;
+
+      for (size_t i = n; i > 0; --i)
+      {
+        Header *h = (Header*)(slab + (i-1) * block_size);
+        h->next = free_list;
+        free_list = h;
+      }
+      return true;
+    }
+  };
+
+  SizeClass classes[NUM_CLASSES];
+
+  static RM_Slab &instance()
+  {
+    static RM_Slab slab;
+    return slab;
+  }
+};
+
+#endif
@@ -1,7 +1,36 @@
 #ifndef __RECORD_MODEL_TOKEN__HEADER__
 #define __RECORD_MODEL_TOKEN__HEADER__
 
-#include <ctype.h>   // isspace
+#include "RM_Scan.h"
+#include <string.h> // memcpy
+
+// lines with up to this many tokens are split without allocating memory
+#define RM_MAX_STACK_TOKENS 64
+
+/*
+ * How a line is split into tokens. Without a quote character (the default),
+ * the line is split at "sep" only (see RM_Token::split). Otherwise fields are
+ * CSV-style:
+ *
+ *   - A field starting with "quote" extends up to the matching closing quote
+ *     and may contain "sep". Within, "escape" makes the next character
+ *     literal. If "escape" equals "quote", a doubled quote is a literal quote.
+ *   - A closing quote must be followed by "sep" or the end of the line.
+ *   - Empty fields are counted (and leave the field at its default).
+ *   - A trailing "\r" (CRLF line ending) is ignored.
+ *
+ * Fields spanning multiple lines are not supported.
+ */
+struct RM_Dialect
+{
+  char sep;
+  char quote;   // 0 = no quoting
+  char escape;  // 0 = no escape character
+
+  RM_Dialect(char sep = ' ', char quote = 0, char escape = 0) : sep(sep), quote(quote), escape(escape) {}
+
+  bool quoted() const { return quote != 0; }
+};
 
 /*
  * Used to parse line
@@ -19,37 +48,25 @@ struct RM_Token
     return false;
   }
 
-  const char *parse_space_sep(const char *ptr)
+  const char *parse_space_sep(const char *ptr, const char *end)
   {
     // at first skip whitespaces
-    while (isspace(*ptr)) ++ptr;
+    ptr = RM_Scan::skip_space(ptr, end);
 
     this->beg = ptr;
-
-    // copy the token into the buffer
-    while (*ptr != '\0' && !isspace(*ptr))
-    {
-      ++ptr;
-    }
-
+    ptr = RM_Scan::find_space(ptr, end);
     this->end = ptr; // endptr
 
     return ptr;
   }
 
-  const char *parse_sep(const char *ptr, char sep)
+  const char *parse_sep(const char *ptr, const char *end, char sep)
   {
     this->beg = ptr;
-
-    // copy the token into the buffer
-    while (*ptr != '\0' && *ptr != sep)
-    {
-      ++ptr;
-    }
-
+    ptr = RM_Scan::find_sep(ptr, end, sep);
     this->end = ptr; // endptr
 
-    if (*ptr == sep) ++ptr;
+    if (ptr != end) ++ptr; // skip sep
 
     return ptr;
   }
@@ -58,12 +75,127 @@ struct RM_Token
    * Treat a whitespace as separator as all isspace characters, not just
    * the whitespace (ASCII 32) itself.
    */
-  const char *parse(const char *ptr, char sep)
+  const char *parse(const char *ptr, const char *end, char sep)
   {
     if (sep == 32)
-      return parse_space_sep(ptr);
+      return parse_space_sep(ptr, end);
     else
-      return parse_sep(ptr, sep);
+      return parse_sep(ptr, end, sep);
+  }
+
+  /*
+   * Splits the line [str, end) into at most "max_tokens" tokens. Stops at the
+   * first empty token.
+   *
+   * Returns the number of (non-empty) tokens stored into "tokens".
+   */
+  static int split(const char *str, const char *end, char sep, RM_Token *tokens, int max_tokens)
+  {
+    const char *next = str;
+    int n;
+    for (n = 0; n < max_tokens; ++n)
+    {
+      next = tokens[n].parse(next, end, sep);
+      if (tokens[n].empty())
+        break;
+    }
+    return n;
+  }
+
+  /*
+   * Splits the line [str, end) into at most "max_tokens" fields according to
+   * "dialect" (which must be quoted). Unescaped field values are written into
+   * "scratch", which must have room for (end - str) bytes.
+   *
+   * Returns the number of fields stored into "tokens", or -1 if a quoted field
+   * is not terminated or its closing quote is not followed by a separator.
+   */
+  static int split_quoted(const char *str, const char *end, const RM_Dialect &dialect,
+                          RM_Token *tokens, int max_tokens, char *scratch)
+  {
+    const char sep = dialect.sep;
+    const char quote = dialect.quote;
+    const char escape = dialect.escape;
+
+    if (end > str && end[-1] == '\r')
+      --end;
+
+    const char *p = str;
+    int n = 0;
+
+    while (n < max_tokens)
+    {
+      RM_Token &tok = tokens[n++];
+
+      if (p < end && *p == quote)
+      {
+        ++p;
+        const char *seg = p;  // start of the not yet copied part
+        char *out = NULL;     // != NULL once unescaping started
+        for (;;)
+        {
+          // searching for just the quote is vectorized
+          const char *q = (escape == 0 || escape == quote) ?
+                          RM_Scan::find_sep(p, end, quote) : find_either(p, end, quote, escape);
+          if (q == end)
+            return -1; // not terminated
+
+          if (*q == quote && !(escape == quote && q + 1 < end && q[1] == quote))
+          {
+            // closing quote
+            if (out)
+            {
+              memcpy(out, seg, q - seg); out += q - seg;
+              tok.end = out;
+              scratch = out;
+            }
+            else
+            {
+              tok.beg = seg;
+              tok.end = q;
+            }
+            p = q + 1;
+            break;
+          }
+
+          // escape character (or doubled quote): the next character is literal
+          if (q + 1 >= end)
+            return -1;
+          if (!out)
+          {
+            out = scratch;
+            tok.beg = out;
+          }
+          memcpy(out, seg, q - seg); out += q - seg;
+          *out++ = q[1];
+          p = seg = q + 2;
+        }
+
+        if (p == end)
+          return n;
+        if (*p != sep)
+          return -1;
+        ++p;
+      }
+      else
+      {
+        tok.beg = p;
+        p = RM_Scan::find_sep(p, end, sep);
+        tok.end = p;
+        if (p == end)
+          return n;
+        ++p;
+      }
+    }
+    return n;
+  }
+
+private:
+
+  static const char *find_either(const char *p, const char *end, char a, char b)
+  {
+    while (p != end && *p != a && *p != b) ++p;
+    return p;
   }
 };
 
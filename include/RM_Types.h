@@ -15,6 +15,8 @@
 #include <math.h>    // pow
 #include "ruby.h"    // Ruby
 #include <ctype.h>   // isspace
+#include <vector>    // std::vector
+#include <algorithm> // std::sort, std::partition
 
 #define RM_ERR_OK 0
 #define RM_ERR_INT_RANGE 1
@@ -22,6 +24,8 @@
 #define RM_ERR_HEX_INV_SIZE 10
 #define RM_ERR_HEX_INV_DIGIT 11
 #define RM_ERR_STR_TOO_LONG 20
+#define RM_ERR_QUOTE 30 // malformed quoted field
+#define RM_ERR_JSON 31 // malformed JSON line
 
 struct RM_Conversion
 {
@@ -87,11 +91,63 @@ struct RM_Conversion
     return ip;
   }
 
+  static inline bool is_digit(char c)
+  {
+    return (c >= '0' && c <= '9');
+  }
+
+  /*
+   * Returns true if all 8 bytes at "s" are decimal digits.
+   */
+  static inline bool is_8digits(const char *s)
+  {
+    uint64_t v;
+    memcpy(&v, s, 8);
+    return (((v & 0xF0F0F0F0F0F0F0F0ULL) |
+             (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL);
+  }
+
+  /*
+   * Converts the 8 decimal digits at "s" into an integer without a
+   * multiplication per digit (SWAR). The digits must be checked with
+   * is_8digits before.
+   */
+  static inline uint32_t parse_8digits(const char *s)
+  {
+    uint64_t v;
+    memcpy(&v, s, 8);
+    v = le64toh(v); // first digit in the lowest byte
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8); // pairs of digits
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return (uint32_t)v;
+  }
+
+  static inline uint64_t power_of_10(int n)
+  {
+    static const uint64_t p[20] = {
+      1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+      100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+      10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+      100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL};
+    assert(n >= 0 && n < 20);
+    return p[n];
+  }
+
   static uint64_t str_to_uint(const char *s, const char *e, int &err)
   {
     uint64_t v = 0;
 
     err = RM_ERR_OK;
+
+    // 8 digits at once
+    while (e - s >= 8 && is_8digits(s))
+    {
+      v = v * 100000000ULL + parse_8digits(s);
+      s += 8;
+    }
+
     for (; s != e; ++s)
     {
       char c = *s;
@@ -109,66 +165,190 @@ struct RM_Conversion
     return v;
   }
 
+  /*
+   * Parses a fixed-point decimal like "1999.1234" into an integer with
+   * "precision" decimal places (1999123 for precision 3). Further decimal
+   * places are cut off.
+   */
   static uint64_t str_to_uint2(const char *s, const char *e, int precision, int &err)
   {
-    uint64_t v = 0;
-    int post_digits = -1; 
+    const char *dot = (const char*)memchr(s, '.', e - s);
+
+    uint64_t v = str_to_uint(s, dot ? dot : e, err);
+    if (err) return 0;
+
+    v *= power_of_10(precision);
+
+    if (!dot)
+      return v;
+
+    const char *frac = dot + 1;
+    int frac_digits = e - frac;
+    int take = (frac_digits < precision) ? frac_digits : precision;
+
+    uint64_t f = str_to_uint(frac, frac + take, err);
+    if (err) return 0; // invalid character (or duplicate ".")
+
+    for (const char *p = frac + take; p != e; ++p)
+    {
+      if (!is_digit(*p))
+      {
+        err = RM_ERR_INT_INV; // invalid character (or duplicate ".")
+        return 0;
+      }
+    }
 
+    return v + f * power_of_10(precision - take);
+  }
+
+  /*
+   * Days since 1970-01-01 of the given date of the proleptic Gregorian
+   * calendar (Howard Hinnant's days_from_civil).
+   */
+  static int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+  {
+    y -= (m <= 2);
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = (unsigned)(y - era * 400);
+    const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+  }
+
+  static unsigned days_in_month(unsigned y, unsigned m)
+  {
+    static const unsigned char days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    return (m == 2 && leap) ? 29 : days[m - 1];
+  }
+
+  static inline bool parse_2digits(const char *s, unsigned &v)
+  {
+    if (!is_digit(s[0]) || !is_digit(s[1])) return false;
+    v = (s[0] - '0') * 10 + (s[1] - '0');
+    return true;
+  }
+
+  /*
+   * Parses an ISO-8601 timestamp "YYYY-MM-DDTHH:MM:SS[.fff][Z|+HH:MM|-HH:MM]"
+   * (a space instead of the "T" is accepted) into milliseconds since the epoch.
+   * Without a timezone, UTC is assumed.
+   *
+   * Returns false if "s" does not look like an ISO-8601 timestamp. "err" is
+   * set if it does, but is invalid.
+   */
+  static bool iso8601_to_msec(const char *s, const char *e, uint64_t &msec, int &err)
+  {
     err = RM_ERR_OK;
-    for (; s != e; ++s)
+
+    if (e - s < 19 || s[4] != '-' || s[7] != '-' || (s[10] != 'T' && s[10] != ' ') ||
+        s[13] != ':' || s[16] != ':')
+      return false;
+
+    unsigned y_hi, y_lo, mon, day, hour, min, sec;
+    if (!parse_2digits(s, y_hi) || !parse_2digits(s+2, y_lo) || !parse_2digits(s+5, mon) ||
+        !parse_2digits(s+8, day) || !parse_2digits(s+11, hour) || !parse_2digits(s+14, min) ||
+        !parse_2digits(s+17, sec) ||
+        mon < 1 || mon > 12 || day < 1 || day > days_in_month(y_hi * 100 + y_lo, mon) ||
+        hour > 23 || min > 59 || sec > 60)
     {
-      char c = *s;
-      if (c >= '0' && c <= '9')
+      err = RM_ERR_INT_INV;
+      return true;
+    }
+
+    const char *p = s + 19;
+
+    // fraction of a second
+    unsigned ms = 0;
+    if (p != e && *p == '.')
+    {
+      ++p;
+      int n = 0;
+      for (; p != e && is_digit(*p); ++p, ++n)
       {
-        v *= 10;
-        v += (c-'0');
-        if (post_digits >= 0)
-          ++post_digits;
+        if (n < 3) ms = ms * 10 + (*p - '0');
       }
-      else if (c == '.')
+      if (n == 0)
       {
-        if (post_digits < 0)
-        {
-          post_digits = 0;
-        }
-        else
-        {
-          err = RM_ERR_INT_INV; // invalid (duplicate ".")
-          return 0;
-        }
+        err = RM_ERR_INT_INV;
+        return true;
       }
-      else
+      for (; n < 3; ++n) ms *= 10;
+    }
+
+    // timezone
+    int64_t offset = 0;
+    if (p != e && *p == 'Z')
+    {
+      ++p;
+    }
+    else if (p != e && (*p == '+' || *p == '-'))
+    {
+      int sign = (*p == '+') ? 1 : -1;
+      ++p;
+      unsigned tz_h, tz_m = 0;
+      if (e - p < 2 || !parse_2digits(p, tz_h))
       {
-        err = RM_ERR_INT_INV; // invalid character
-        return 0;
+        err = RM_ERR_INT_INV;
+        return true;
       }
+      p += 2;
+      if (p != e && *p == ':') ++p;
+      if (e - p >= 2 && parse_2digits(p, tz_m)) p += 2;
+      offset = sign * (int64_t)(tz_h * 3600 + tz_m * 60);
     }
 
-    for (; post_digits < precision; ++post_digits)
+    if (p != e)
     {
-      v *= 10;
+      err = RM_ERR_INT_INV;
+      return true;
     }
 
-    for (; post_digits > precision; --post_digits)
+    int64_t days = days_from_civil(y_hi * 100 + y_lo, mon, day);
+    int64_t secs = days * 86400 + hour * 3600 + min * 60 + sec - offset;
+    if (secs < 0)
     {
-      v /= 10;
+      err = RM_ERR_INT_RANGE;
+      return true;
     }
- 
-    return v;
+
+    msec = (uint64_t)secs * 1000 + ms;
+    return true;
   }
 
-  // XXX: remove char* cast and string modification!
-  static double str_to_double(const char *s, const char *e)
+  /*
+   * Timestamps are either given as (fractional) seconds since the epoch or
+   * in ISO-8601 format. Returns milliseconds.
+   */
+  static uint64_t str_to_timestamp(const char *s, const char *e, int &err)
   {
-    return str_to_double2((char*)s, (char*)e);
+    uint64_t msec;
+    if (iso8601_to_msec(s, e, msec, err))
+      return err ? 0 : msec;
+    return str_to_uint2(s, e, 3, err);
   }
 
-  static double str_to_double2(char *s, char *e)
+  /*
+   * The token is copied, as it might live in read-only memory (e.g. a
+   * memory mapped file) and is not NUL-terminated.
+   */
+  static double str_to_double(const char *s, const char *e)
   {
-    char c = *e;
-    *e = '\0';
-    double v = atof(s);
-    *e = c;
+    char buf[64];
+    size_t len = e - s;
+    if (len < sizeof(buf))
+    {
+      memcpy(buf, s, len);
+      buf[len] = '\0';
+      return atof(buf);
+    }
+
+    char *p = (char*)malloc(len + 1);
+    if (!p) return 0.0;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    double v = atof(p);
+    free(p);
     return v;
   }
 
@@ -322,6 +502,120 @@ struct RM_Type
   // mem is not a pointer to a record, but to the field itself
   virtual int compare_with_memory(const void *a, const void *mem) = 0;
 
+  // both are pointers to the field itself, not to records
+  virtual int compare_memory(const void *mem_a, const void *mem_b) = 0;
+
+  // true for all types which can be converted with to_double
+  virtual bool is_numeric() { return false; }
+
+  virtual double to_double(const void *a) { return 0.0; }
+
+  // rounds the value down to a multiple of "unit". returns false if not supported.
+  virtual bool truncate(void *a, uint64_t unit) { return false; }
+
+  /*
+   * Column kernels: They operate on this field of "n" records, the first at
+   * "base" and each "stride" bytes after the previous one (e.g. all records
+   * of a RecordModelInstanceArray). The numeric types override them with
+   * loops over their native type, the defaults here go through the virtual
+   * per-value methods.
+   */
+
+  // sum of to_double (numeric types only)
+  virtual double sum_strided(const char *base, size_t stride, size_t n)
+  {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      sum += to_double(base + i*stride);
+    }
+    return sum;
+  }
+
+  // sets this field of records "min" and "max". n must be > 0.
+  virtual void min_max_strided(const char *base, size_t stride, size_t n, void *min, void *max)
+  {
+    assert(n > 0);
+    copy(min, base);
+    copy(max, base);
+    for (size_t i = 1; i < n; ++i)
+    {
+      const char *c = base + i*stride;
+      if (compare(c, min) < 0) copy(min, c);
+      if (compare(c, max) > 0) copy(max, c);
+    }
+  }
+
+  // number of values within the range of records "l" and "r" (see between).
+  // their positions are stored into "out" (room for n), unless NULL.
+  virtual size_t select_between_strided(const char *base, size_t stride, size_t n,
+                                        const void *l, const void *r, uint32_t *out)
+  {
+    size_t cnt = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (between(base + i*stride, l, r) == 0)
+      {
+        if (out) out[cnt] = i;
+        ++cnt;
+      }
+    }
+    return cnt;
+  }
+
+  // multiplies all values by "factor". returns false if not supported.
+  virtual bool scale_strided(char *base, size_t stride, size_t n, double factor) { return false; }
+
+  // adds this field of record "b" to all values (like add)
+  virtual void add_strided(char *base, size_t stride, size_t n, const void *b)
+  {
+    for (size_t i = 0; i < n; ++i)
+    {
+      add(base + i*stride, b);
+    }
+  }
+
+  /*
+   * Counts the distinct values. Stores them (sorted) into "values"
+   * (room for n values, in the layout of copy_to_memory) and their number of
+   * occurrences into "counts" (room for n). Returns the number of distinct
+   * values.
+   */
+  virtual size_t histogram_strided(const char *base, size_t stride, size_t n, void *values, uint64_t *counts)
+  {
+    if (n == 0) return 0;
+
+    size_t sz = size();
+    char *mem = (char*)malloc(n * sz);
+    if (!mem) return 0;
+    std::vector<uint32_t> idx(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+      copy_to_memory(base + i*stride, mem + i*sz);
+      idx[i] = i;
+    }
+
+    MemorySorter s = {this, mem, sz};
+    std::sort(idx.begin(), idx.end(), s);
+
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      const char *v = mem + idx[i]*sz;
+      if (k > 0 && compare_memory((char*)values + (k-1)*sz, v) == 0)
+      {
+        ++counts[k-1];
+        continue;
+      }
+      memcpy((char*)values + k*sz, v, sz);
+      counts[k] = 1;
+      ++k;
+    }
+
+    free(mem);
+    return k;
+  }
+
   bool overlap(const void *a0, const void *a1, const void *b0, const void *b1)
   {
     assert(compare(a0, a1) <= 0);
@@ -337,6 +631,73 @@ struct RM_Type
 
     return true;
   }
+
+  /*
+   * Returns true if the range a0..a1 completely contains b0..b1.
+   */
+  bool contains(const void *a0, const void *a1, const void *b0, const void *b1)
+  {
+    return (compare(a0, b0) <= 0 && compare(b1, a1) <= 0);
+  }
+
+protected:
+
+  struct MemorySorter
+  {
+    RM_Type *type;
+    const char *mem;
+    size_t sz;
+
+    bool operator()(uint32_t a, uint32_t b) const
+    {
+      return (type->compare_memory(mem + a*sz, mem + b*sz) < 0);
+    }
+  };
+
+  template <typename T>
+  struct NotNaN
+  {
+    bool operator()(T v) const { return (v == v); }
+  };
+
+  /*
+   * Histogram of a column of native values (see histogram_strided). NaNs
+   * are not ordered, so they are kept out of the sort and counted as one
+   * value, which comes last.
+   */
+  template <typename T>
+  static size_t histogram_native(const char *base, size_t stride, size_t n, size_t offs, void *values, uint64_t *counts)
+  {
+    if (n == 0) return 0;
+
+    T *vals = (T*)values;
+    for (size_t i = 0; i < n; ++i)
+    {
+      vals[i] = *((const T*)(base + i*stride + offs));
+    }
+    size_t m = std::partition(vals, vals + n, NotNaN<T>()) - vals;
+    std::sort(vals, vals + m);
+
+    size_t k = 0;
+    for (size_t i = 0; i < m; ++i)
+    {
+      if (k > 0 && vals[k-1] == vals[i])
+      {
+        ++counts[k-1];
+        continue;
+      }
+      vals[k] = vals[i];
+      counts[k] = 1;
+      ++k;
+    }
+    if (m < n)
+    {
+      vals[k] = vals[m];
+      counts[k] = n - m;
+      ++k;
+    }
+    return k;
+  }
 };
 
 // order=true ==> ascending, order=false descending
@@ -476,6 +837,100 @@ struct RM_UInt : RM_Type
   {
     return cmp(element(a), *((const NT*)mem));
   }
+
+  virtual int compare_memory(const void *mem_a, const void *mem_b)
+  {
+    return cmp(*((const NT*)mem_a), *((const NT*)mem_b));
+  }
+
+  virtual bool is_numeric() { return true; }
+
+  virtual double to_double(const void *a)
+  {
+    return (double)element(a);
+  }
+
+  virtual bool truncate(void *a, uint64_t unit)
+  {
+    if (unit == 0) return false;
+    element(a) -= element(a) % unit;
+    return true;
+  }
+
+  virtual double sum_strided(const char *base, size_t stride, size_t n)
+  {
+    // 32-bit values can't overflow a 64-bit sum (an array has < 2**32 entries)
+    if (sizeof(NT) < 8)
+    {
+      uint64_t sum = 0;
+      for (size_t i = 0; i < n; ++i) sum += element(base + i*stride);
+      return (double)sum;
+    }
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) sum += (double)element(base + i*stride);
+    return sum;
+  }
+
+  virtual void min_max_strided(const char *base, size_t stride, size_t n, void *min, void *max)
+  {
+    assert(n > 0);
+    NT lo = element(base);
+    NT hi = lo;
+    for (size_t i = 1; i < n; ++i)
+    {
+      NT v = element(base + i*stride);
+      if (v < lo) lo = v;
+      if (v > hi) hi = v;
+    }
+    element(min) = order ? lo : hi;
+    element(max) = order ? hi : lo;
+  }
+
+  virtual size_t select_between_strided(const char *base, size_t stride, size_t n,
+                                        const void *l, const void *r, uint32_t *out)
+  {
+    NT lo = element(l);
+    NT hi = element(r);
+    size_t cnt = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (betw(element(base + i*stride), lo, hi) == 0)
+      {
+        if (out) out[cnt] = i;
+        ++cnt;
+      }
+    }
+    return cnt;
+  }
+
+  // the result is truncated and clamped to the range of NT
+  virtual bool scale_strided(char *base, size_t stride, size_t n, double factor)
+  {
+    const double max = (double)std::numeric_limits<NT>::max();
+    for (size_t i = 0; i < n; ++i)
+    {
+      NT &v = element(base + i*stride);
+      double d = (double)v * factor;
+      if (d <= 0.0) v = 0;
+      else if (d >= max) v = std::numeric_limits<NT>::max();
+      else v = (NT)d;
+    }
+    return true;
+  }
+
+  virtual void add_strided(char *base, size_t stride, size_t n, const void *b)
+  {
+    NT c = element(b);
+    for (size_t i = 0; i < n; ++i)
+    {
+      element(base + i*stride) += c;
+    }
+  }
+
+  virtual size_t histogram_strided(const char *base, size_t stride, size_t n, void *values, uint64_t *counts)
+  {
+    return histogram_native<NT>(base, stride, n, offset(), values, counts);
+  }
 };
 
 struct RM_UINT8 : RM_UInt<uint8_t> {
@@ -499,7 +954,7 @@ struct RM_TIMESTAMP : RM_UInt<uint64_t>
   virtual int set_from_string(void *a, const char *s, const char *e)
   {
     int err;
-    uint64_t i = RM_Conversion::str_to_uint2(s, e, 3, err);
+    uint64_t i = RM_Conversion::str_to_timestamp(s, e, err);
     if (err) return err;
     return _set_uint(a, i);
   }
@@ -512,7 +967,7 @@ struct RM_TIMESTAMP_DESC : RM_UInt<uint64_t, false>
   virtual int set_from_string(void *a, const char *s, const char *e)
   {
     int err;
-    uint64_t i = RM_Conversion::str_to_uint2(s, e, 3, err);
+    uint64_t i = RM_Conversion::str_to_timestamp(s, e, err);
     if (err) return err;
     return _set_uint(a, i);
   }
@@ -568,7 +1023,8 @@ struct RM_DOUBLE : RM_Type
 
   virtual void set_min(void *a)
   {
-    element(a) = std::numeric_limits<NT>::min();
+    // NOTE: numeric_limits<double>::min() is the smallest *positive* value
+    element(a) = -std::numeric_limits<NT>::max();
   }
 
   virtual void set_max(void *a)
@@ -620,6 +1076,85 @@ struct RM_DOUBLE : RM_Type
     if (element(a) > b) return 1;
     return 0;
   }
+
+  virtual int compare_memory(const void *mem_a, const void *mem_b)
+  {
+    NT a = *((const NT*)mem_a);
+    NT b = *((const NT*)mem_b);
+    if (a < b) return -1;
+    if (a > b) return 1;
+    return 0;
+  }
+
+  virtual bool is_numeric() { return true; }
+
+  virtual double to_double(const void *a)
+  {
+    return element(a);
+  }
+
+  virtual double sum_strided(const char *base, size_t stride, size_t n)
+  {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) sum += element(base + i*stride);
+    return sum;
+  }
+
+  virtual void min_max_strided(const char *base, size_t stride, size_t n, void *min, void *max)
+  {
+    assert(n > 0);
+    NT lo = element(base);
+    NT hi = lo;
+    for (size_t i = 1; i < n; ++i)
+    {
+      NT v = element(base + i*stride);
+      if (v < lo) lo = v;
+      if (v > hi) hi = v;
+    }
+    element(min) = lo;
+    element(max) = hi;
+  }
+
+  virtual size_t select_between_strided(const char *base, size_t stride, size_t n,
+                                        const void *l, const void *r, uint32_t *out)
+  {
+    NT lo = element(l);
+    NT hi = element(r);
+    size_t cnt = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      NT v = element(base + i*stride);
+      if (v >= lo && v <= hi)
+      {
+        if (out) out[cnt] = i;
+        ++cnt;
+      }
+    }
+    return cnt;
+  }
+
+  virtual bool scale_strided(char *base, size_t stride, size_t n, double factor)
+  {
+    for (size_t i = 0; i < n; ++i)
+    {
+      element(base + i*stride) *= factor;
+    }
+    return true;
+  }
+
+  virtual void add_strided(char *base, size_t stride, size_t n, const void *b)
+  {
+    NT c = element(b);
+    for (size_t i = 0; i < n; ++i)
+    {
+      element(base + i*stride) += c;
+    }
+  }
+
+  virtual size_t histogram_strided(const char *base, size_t stride, size_t n, void *values, uint64_t *counts)
+  {
+    return histogram_native<NT>(base, stride, n, offset(), values, counts);
+  }
 };
 
 struct RM_IP : RM_UInt<uint32_t>
@@ -776,6 +1311,11 @@ struct RM_String : RM_Type
   {
     return compare_pointers(element_ptr(a), (const uint8_t*)mem);
   }
+
+  virtual int compare_memory(const void *mem_a, const void *mem_b)
+  {
+    return compare_pointers((const uint8_t*)mem_a, (const uint8_t*)mem_b);
+  }
 };
 
 struct RM_HEXSTR : RM_String
@@ -8,8 +8,10 @@
 #include <assert.h>  // assert
 #include <vector>    // std::vector
 #include <algorithm> // std::sort
+#include <sys/mman.h> // mmap, mremap, madvise
 #include "RM_Types.h"
 #include "RM_Token.h"
+#include "RM_Slab.h"
 
 struct RecordModel
 {
@@ -64,6 +66,19 @@ struct RecordModel
     return true;
   }
 
+  /*
+   * Returns true if the range a0..a1 completely contains b0..b1 for every field.
+   */
+  bool contains_all(const void *a0, const void *a1, const void *b0, const void *b1)
+  {
+    for (size_t k = 0; k < _num_fields; ++k)
+    {
+      if (!_all_fields[k]->contains(a0, a1, b0, b1)) return false;
+    }
+
+    return true;
+  }
+
   bool is_virgin()
   {
     return (_all_fields == NULL && _keys == NULL && _values == NULL && _num_fields == 0 && _num_keys == 0 && _num_values == 0 &&
@@ -120,17 +135,18 @@ struct RecordModelInstance
     this->_ptr = ptr;
   }
 
+  /*
+   * Instances are allocated from RM_Slab pools. Only use deallocate to free
+   * them.
+   */
   static void deallocate(RecordModelInstance *rec)
   {
-    if (rec)
-    {
-      free(rec);
-    }
+    RM_Slab::release(rec);
   }
 
   static RecordModelInstance *allocate(RecordModel *model)
   {
-    RecordModelInstance *rec = (RecordModelInstance*) malloc(model->size() + sizeof(RecordModelInstance));
+    RecordModelInstance *rec = (RecordModelInstance*) RM_Slab::alloc(model->size() + sizeof(RecordModelInstance));
     if (rec)
     {
       rec->model = model;
@@ -142,7 +158,7 @@ struct RecordModelInstance
   // ptr must be of _size
   static RecordModelInstance *allocate(RecordModel *model, void *ptr)
   {
-    RecordModelInstance *rec = (RecordModelInstance*) malloc(sizeof(RecordModelInstance));
+    RecordModelInstance *rec = (RecordModelInstance*) RM_Slab::alloc(sizeof(RecordModelInstance));
     if (rec)
     {
       rec->model = model;
@@ -212,6 +228,20 @@ struct RecordModelInstance
     }
   }
 
+  /*
+   * Like add_values, but skips non-numeric values (which cannot be added).
+   */
+  void add_numeric_values(const RecordModelInstance *other)
+  {
+    assert(other->model == model);
+
+    for (int i = 0; model->_values[i] != NULL; ++i)
+    {
+      if (model->_values[i]->is_numeric())
+        model->_values[i]->add(ptr(), other->ptr());
+    }
+  }
+
   /*
    * Returns 0 if all keys are between the corresponding keys of "l" and "r".
    *
@@ -289,8 +319,38 @@ struct RecordModelInstance
    */
   int parse_line(const char *str, const int *field_arr, int field_arr_sz, char sep, int &err)
   {
-    RM_Token token;
-    const char *next = str;
+    return parse_line(str, str + strlen(str), field_arr, field_arr_sz, sep, err);
+  }
+
+  /*
+   * Same as above, for the line [str, end), which does not have to be NUL-terminated.
+   */
+  int parse_line(const char *str, const char *end, const int *field_arr, int field_arr_sz, char sep, int &err)
+  {
+    // the line is split into tokens at first (one more than needed to detect additional items)
+    RM_Token stack_tokens[RM_MAX_STACK_TOKENS];
+    RM_Token *tokens = stack_tokens;
+    if (field_arr_sz + 1 > RM_MAX_STACK_TOKENS)
+    {
+      tokens = new RM_Token[field_arr_sz + 1];
+    }
+
+    int num_tokens = RM_Token::split(str, end, sep, tokens, field_arr_sz + 1);
+    int res = parse_tokens(tokens, num_tokens, field_arr, field_arr_sz, err);
+
+    if (tokens != stack_tokens)
+    {
+      delete [] tokens;
+    }
+
+    return res;
+  }
+
+  /*
+   * Same as parse_line, but for an already split line.
+   */
+  int parse_tokens(const RM_Token *tokens, int num_tokens, const int *field_arr, int field_arr_sz, int &err)
+  {
     err = RM_ERR_OK;
 
     int i;
@@ -298,8 +358,7 @@ struct RecordModelInstance
     {
       err = RM_ERR_OK;
 
-      next = token.parse(next, sep);
-      if (token.empty())
+      if (i >= num_tokens)
 	return i; // premature end
 
       if (field_arr[i] < 0)
@@ -307,15 +366,14 @@ struct RecordModelInstance
 
       RM_Type *field = this->model->get_field(field_arr[i]);
       assert(field);
-      err = field->set_from_string(this->ptr(), token.beg, token.end);
+      err = field->set_from_string(this->ptr(), tokens[i].beg, tokens[i].end);
       if (err)
       {
 	return i;
       }
     }
 
-    next = token.parse(next, sep);
-    if (token.empty())
+    if (num_tokens <= field_arr_sz)
       return field_arr_sz; // means, OK
     else
       return field_arr_sz+1; // means, has additional items
@@ -338,13 +396,22 @@ struct RecordModelInstanceArraySorter
 
 /*
  * Represents a dynamic array of RecordModel instances
+ *
+ * Arrays of at least MMAP_THRESHOLD bytes are backed by an anonymous mapping
+ * instead of malloc (where mremap is available). Expanding such an array
+ * remaps its pages instead of copying them, and the mapping is advised to use
+ * transparent huge pages.
  */
 struct RecordModelInstanceArray
 {
+  static const size_t MMAP_THRESHOLD = 4L << 20;
+  static const size_t MMAP_ALIGN = 2L << 20; // huge page size
+
   RecordModel *model;
   void *_ptr;
   size_t _capacity;
   size_t _entries;
+  size_t _mapped; // size of the mapping at _ptr, 0 if malloced
   bool expandable;
 
   // Allows max. 2**32-1 elements to be stored within an array.
@@ -362,6 +429,7 @@ struct RecordModelInstanceArray
     _ptr = NULL;
     _capacity = 0;
     _entries = 0;
+    _mapped = 0;
     expandable = false;
     sort_arr = NULL;
   }
@@ -375,7 +443,10 @@ struct RecordModelInstanceArray
   {
     if (_ptr)
     {
-      free(_ptr);
+      if (_mapped)
+        munmap(_ptr, _mapped);
+      else
+        free(_ptr);
       _ptr = NULL;
     }
     if (sort_arr)
@@ -390,16 +461,52 @@ struct RecordModelInstanceArray
     void *new_ptr = NULL;
 
     if (capacity < 8) capacity = 8;
+    size_t size = element_size() * capacity;
+
+#ifdef MREMAP_MAYMOVE
+    if (ptr != NULL && _mapped)
+    {
+      size_t mapped = round_up(size, MMAP_ALIGN);
+      new_ptr = mremap(ptr, _mapped, mapped, MREMAP_MAYMOVE);
+      if (new_ptr == MAP_FAILED)
+        return false;
+      advise_huge(new_ptr, mapped);
+      _mapped = mapped;
+    }
+    else if (size >= MMAP_THRESHOLD)
+    {
+      size_t mapped = round_up(size, MMAP_ALIGN);
+      new_ptr = mmap(NULL, mapped, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (new_ptr == MAP_FAILED)
+        return false;
+      advise_huge(new_ptr, mapped);
+      if (ptr != NULL)
+      {
+        // switch over from malloc
+        memcpy(new_ptr, ptr, element_size() * _entries);
+        free(ptr);
+      }
+      _mapped = mapped;
+    }
+    else
+#endif
     if (ptr == NULL)
-      new_ptr = malloc(element_size() * capacity);
+      new_ptr = malloc(size);
     else
-      new_ptr = realloc(ptr, element_size() * capacity);
+      new_ptr = realloc(ptr, size);
 
     if (new_ptr == NULL)
       return false;
 
-    _capacity = capacity;
+    // an expandable array uses all of a mapping, so the next mremap is only
+    // needed beyond it. a fixed one keeps the capacity it was asked for.
+    _capacity = (_mapped && expandable) ? (_mapped / element_size()) : capacity;
     _ptr = new_ptr;
+
+    // pushing into a sorted array must not reallocate the index either
+    if (sort_arr)
+      sort_arr->reserve(_capacity);
+
     return true;
   } 
 
@@ -494,7 +601,7 @@ struct RecordModelInstanceArray
     if (!sort_arr)
     {
       sort_arr = new std::vector<SORT_IDX>; 
-      sort_arr->reserve(_entries);
+      sort_arr->reserve(_capacity);
       for (size_t i = 0; i < _entries; ++i)
       {
         sort_arr->push_back(i);
@@ -503,6 +610,147 @@ struct RecordModelInstanceArray
     std::sort(sort_arr->begin(), sort_arr->end(), s);
   }
 
+  /*
+   * Sorts the array and combines records with equal keys into one by adding
+   * up their numeric values (non-numeric values are taken from the first
+   * record). Afterwards the entries are stored in sorted order.
+   *
+   * Returns false if out of memory. Then the array is only sorted.
+   */
+  bool combine()
+  {
+    if (_entries < 2)
+      return true;
+
+    sort();
+
+    // same capacity and allocation mode. swapped in below.
+    RecordModelInstanceArray tmp;
+    tmp.model = model;
+    if (!tmp.allocate(_capacity))
+      return false;
+    void *new_ptr = tmp._ptr;
+
+    RecordModelInstance last(model, NULL);
+    RecordModelInstance cur(model, NULL);
+    size_t n = 0;
+
+    for (size_t i = 0; i < _entries; ++i)
+    {
+      cur._ptr = ptr_at(i);
+      if (n > 0 && last.compare_keys(&cur) == 0)
+      {
+        last.add_numeric_values(&cur);
+        continue;
+      }
+      last._ptr = (char*)new_ptr + n * element_size();
+      memcpy(last._ptr, cur._ptr, element_size());
+      ++n;
+    }
+
+    std::swap(_ptr, tmp._ptr);
+    std::swap(_mapped, tmp._mapped);
+    _entries = n;
+    delete sort_arr;
+    sort_arr = NULL;
+    return true;
+  }
+
+  /*
+   * Column operations on "field" of all entries, each a single call of an
+   * RM_Type column kernel (see RM_Type::sum_strided). Only filter_between
+   * honors the sort order.
+   */
+
+  double column_sum(RM_Type *field)
+  {
+    return field->sum_strided((const char*)_ptr, element_size(), _entries);
+  }
+
+  /*
+   * Returns false if the array is empty.
+   */
+  bool column_min_max(RM_Type *field, RecordModelInstance *min, RecordModelInstance *max)
+  {
+    if (_entries == 0)
+      return false;
+    field->min_max_strided((const char*)_ptr, element_size(), _entries, min->ptr(), max->ptr());
+    return true;
+  }
+
+  size_t column_count_between(RM_Type *field, const RecordModelInstance *l, const RecordModelInstance *r)
+  {
+    return field->select_between_strided((const char*)_ptr, element_size(), _entries, l->ptr(), r->ptr(), NULL);
+  }
+
+  bool column_scale(RM_Type *field, double factor)
+  {
+    return field->scale_strided((char*)_ptr, element_size(), _entries, factor);
+  }
+
+  void column_add(RM_Type *field, const RecordModelInstance *c)
+  {
+    field->add_strided((char*)_ptr, element_size(), _entries, c->ptr());
+  }
+
+  /*
+   * "values" and "counts" need room for entries() elements.
+   */
+  size_t column_histogram(RM_Type *field, void *values, uint64_t *counts)
+  {
+    return field->histogram_strided((const char*)_ptr, element_size(), _entries, values, counts);
+  }
+
+  /*
+   * Appends all entries whose "field" lies within the range of "l" and "r"
+   * to "out" (in sorted order if sorted). Returns false if out of memory.
+   */
+  bool filter_between(RM_Type *field, const RecordModelInstance *l, const RecordModelInstance *r,
+                      RecordModelInstanceArray *out)
+  {
+    assert(out->model == model);
+    assert(out != this);
+
+    if (_entries == 0)
+      return true;
+
+    SORT_IDX *sel = (SORT_IDX*)malloc(sizeof(SORT_IDX) * _entries);
+    if (!sel)
+      return false;
+
+    size_t cnt = field->select_between_strided((const char*)_ptr, element_size(), _entries, l->ptr(), r->ptr(), sel);
+
+    if (out->_entries + cnt > out->_capacity && !out->expand(out->_entries + cnt))
+    {
+      free(sel);
+      return false;
+    }
+
+    RecordModelInstance src(model, NULL);
+    if (sort_arr)
+    {
+      std::vector<bool> match(_entries, false);
+      for (size_t k = 0; k < cnt; ++k) match[sel[k]] = true;
+      for (size_t i = 0; i < _entries; ++i)
+      {
+        if (!match[(*sort_arr)[i]]) continue;
+        src._ptr = ptr_at(i);
+        out->push(&src);
+      }
+    }
+    else
+    {
+      for (size_t k = 0; k < cnt; ++k)
+      {
+        src._ptr = element_n(sel[k]);
+        out->push(&src);
+      }
+    }
+
+    free(sel);
+    return true;
+  }
+
   /*
    * 'i' is in sorted order
    */
@@ -534,6 +782,18 @@ private:
     return model->size();
   }
 
+  static size_t round_up(size_t n, size_t align)
+  {
+    return ((n + align - 1) / align) * align;
+  }
+
+  static void advise_huge(void *ptr, size_t len)
+  {
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+  }
+
   /*
    * 'n' is in raw order (un-sorted)
    */
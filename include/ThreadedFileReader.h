@@ -0,0 +1,216 @@
+#ifndef __THREADED_FILE_READER__HEADER__
+#define __THREADED_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include <pthread.h> // pthread_create
+#include <stdlib.h>  // malloc
+#include <string.h>  // memcpy
+#include <assert.h>
+
+/*
+ * Reads from another FileReader on a background thread into a ring of
+ * buffers, so that e.g. decompression runs concurrently with parsing.
+ *
+ * The background thread fills a buffer completely (unless the end of input
+ * is reached) before handing it over. A read error is reported to the reader
+ * once all buffers filled before it have been consumed.
+ */
+class ThreadedFileReader : public FileReader
+{
+  struct Buffer
+  {
+    char *data;
+    ssize_t len;   // < 0 on error
+    size_t offs;   // consumed by read()
+  };
+
+  FileReader *src;
+  Buffer *ring;
+  size_t num_buffers;
+  size_t bufsize;
+
+  // ring[head] is the next buffer to consume, "filled" buffers behind it are ready
+  size_t head;
+  size_t filled;
+  bool eof;       // the background thread is done (end of input or error)
+  bool stop;      // set by close()
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond_filled;
+  pthread_cond_t cond_free;
+
+  public:
+
+    ThreadedFileReader()
+    {
+      src = NULL;
+      ring = NULL;
+    }
+
+    ~ThreadedFileReader()
+    {
+      if (src) close();
+    }
+
+    /*
+     * Takes over "src" (it is closed by close()). Returns false if the
+     * background thread cannot be started. "src" is left open in that case.
+     */
+    bool open(FileReader *src, size_t bufsize = 1L << 16, size_t num_buffers = 4)
+    {
+      assert(this->src == NULL);
+      assert(bufsize > 0 && num_buffers > 0);
+
+      ring = (Buffer*)malloc(sizeof(Buffer) * num_buffers);
+      if (!ring) return false;
+      for (size_t i = 0; i < num_buffers; ++i)
+      {
+        ring[i].data = (char*)malloc(bufsize);
+        if (!ring[i].data)
+        {
+          while (i > 0) free(ring[--i].data);
+          free(ring); ring = NULL;
+          return false;
+        }
+      }
+
+      this->src = src;
+      this->num_buffers = num_buffers;
+      this->bufsize = bufsize;
+      head = 0;
+      filled = 0;
+      eof = false;
+      stop = false;
+
+      pthread_mutex_init(&mutex, NULL);
+      pthread_cond_init(&cond_filled, NULL);
+      pthread_cond_init(&cond_free, NULL);
+
+      if (pthread_create(&thread, NULL, run, this) != 0)
+      {
+        this->src = NULL;
+        free_buffers();
+        return false;
+      }
+
+      return true;
+    }
+
+    virtual void close()
+    {
+      assert(src);
+
+      pthread_mutex_lock(&mutex);
+      stop = true;
+      pthread_cond_signal(&cond_free);
+      pthread_mutex_unlock(&mutex);
+      pthread_join(thread, NULL);
+
+      src->close();
+      src = NULL;
+      free_buffers();
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(src);
+
+      pthread_mutex_lock(&mutex);
+      while (filled == 0 && !eof)
+      {
+        pthread_cond_wait(&cond_filled, &mutex);
+      }
+      if (filled == 0)
+      {
+        pthread_mutex_unlock(&mutex);
+        return 0;
+      }
+      pthread_mutex_unlock(&mutex);
+
+      // ring[head] is owned by us until we release it
+      Buffer &b = ring[head];
+      if (b.len < 0)
+      {
+        return -1;
+      }
+
+      size_t n = b.len - b.offs;
+      if (n > buflen) n = buflen;
+      memcpy(buf, b.data + b.offs, n);
+      b.offs += n;
+
+      if (b.offs == (size_t)b.len)
+      {
+        pthread_mutex_lock(&mutex);
+        head = (head + 1) % num_buffers;
+        --filled;
+        pthread_cond_signal(&cond_free);
+        pthread_mutex_unlock(&mutex);
+      }
+
+      return n;
+    }
+
+  private:
+
+    void free_buffers()
+    {
+      pthread_mutex_destroy(&mutex);
+      pthread_cond_destroy(&cond_filled);
+      pthread_cond_destroy(&cond_free);
+      for (size_t i = 0; i < num_buffers; ++i)
+      {
+        free(ring[i].data);
+      }
+      free(ring);
+      ring = NULL;
+    }
+
+    static void *run(void *ptr)
+    {
+      ThreadedFileReader *r = (ThreadedFileReader*)ptr;
+      size_t tail = 0;
+
+      for (;;)
+      {
+        pthread_mutex_lock(&r->mutex);
+        while (r->filled == r->num_buffers && !r->stop)
+        {
+          pthread_cond_wait(&r->cond_free, &r->mutex);
+        }
+        bool stop = r->stop;
+        pthread_mutex_unlock(&r->mutex);
+        if (stop) break;
+
+        // ring[tail] is free and owned by us until we hand it over
+        Buffer &b = r->ring[tail];
+        b.len = 0;
+        b.offs = 0;
+        while ((size_t)b.len < r->bufsize)
+        {
+          ssize_t n = r->src->read(b.data + b.len, r->bufsize - b.len);
+          if (n < 0) { b.len = -1; break; }
+          if (n == 0) break;
+          b.len += n;
+        }
+
+        pthread_mutex_lock(&r->mutex);
+        bool done = (b.len <= 0 || (size_t)b.len < r->bufsize);
+        if (b.len != 0)
+        {
+          ++r->filled;
+          tail = (tail + 1) % r->num_buffers;
+        }
+        if (done) r->eof = true;
+        pthread_cond_signal(&r->cond_filled);
+        pthread_mutex_unlock(&r->mutex);
+
+        if (done) break;
+      }
+
+      return NULL;
+    }
+};
+
+#endif
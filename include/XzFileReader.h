@@ -6,6 +6,7 @@
 #include <lzma.h>
 #include <assert.h>
 #include <stdlib.h> // malloc
+#include <string.h> // memset
 
 class XzFileReader : public FileReader
 {
@@ -15,6 +16,7 @@ class XzFileReader : public FileReader
   void *inbuf;
   size_t bufsize;
   bool is_eof;
+  bool is_end;
 
   public:
 
@@ -47,7 +49,23 @@ class XzFileReader : public FileReader
       stream = s; // XXX
       const uint32_t flags = LZMA_TELL_UNSUPPORTED_CHECK | LZMA_CONCATENATED;
       const uint64_t memory_limit = UINT64_MAX; /* no memory limit */
+#if LZMA_VERSION >= 50040002
+      /*
+       * Decodes the blocks of multi-block files (e.g. created with "xz -T0")
+       * on multiple threads. Single-block files are decoded single-threaded
+       * as before.
+       */
+      lzma_mt mt;
+      memset(&mt, 0, sizeof(mt));
+      mt.flags = flags;
+      mt.threads = lzma_cputhreads();
+      if (mt.threads == 0) mt.threads = 1;
+      mt.memlimit_threading = memory_limit;
+      mt.memlimit_stop = memory_limit;
+      lzma_ret ret = lzma_stream_decoder_mt(&stream, &mt);
+#else
       lzma_ret ret = lzma_stream_decoder(&stream, memory_limit, flags);
+#endif
       if (ret != LZMA_OK)
       {
         file->close(); file = NULL;
@@ -56,6 +74,7 @@ class XzFileReader : public FileReader
       }
 
       is_eof = false;
+      is_end = false;
 
       stream.avail_in = 0;
       stream.avail_out = 0;
@@ -76,7 +95,10 @@ class XzFileReader : public FileReader
     {
       assert(file);
 
-      do 
+      if (is_end)
+        return 0;
+
+      for (;;)
       {
 	if (!is_eof && stream.avail_in == 0)
 	{
@@ -100,27 +122,22 @@ class XzFileReader : public FileReader
 	stream.avail_out = buflen;
 
 	lzma_ret ret = lzma_code(&stream, is_eof ? LZMA_FINISH : LZMA_RUN);
-	if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+	if (ret == LZMA_STREAM_END)
 	{
-	  return -1; // error
+	  is_end = true;
+	}
+	else if (ret != LZMA_OK)
+	{
+	  return -1; // error (including truncated input)
         }
 
         ssize_t len = buflen - stream.avail_out;
-        if (len > 0 || is_eof)
+        if (len > 0 || is_end)
 	  return len;
 
-        assert(len == 0);
-
-	// XXX: Still something in input buffer, but no output -> error (?)
-        if (stream.avail_in > 0)
-	  return -1;
-
-        // nothing in output buffer. put something back again into
-	// the input buffer -> fall through to while-loop
-
-      } while (stream.avail_in == 0);
-
-      assert(false);
+        // no output yet. the (multi-threaded) decoder might have consumed
+        // input without producing output, or needs more input.
+      }
     }
 };
 
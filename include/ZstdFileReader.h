@@ -0,0 +1,119 @@
+#ifndef __ZSTD_FILE_READER__HEADER__
+#define __ZSTD_FILE_READER__HEADER__
+
+#include "FileReader.h"
+#include "PosixFileReader.h"
+#include <zstd.h>
+#include <assert.h>
+#include <stdlib.h> // malloc
+
+/*
+ * Reads Zstandard compressed files. Concatenated frames (e.g. appended
+ * log chunks) are decompressed one after the other.
+ */
+class ZstdFileReader : public FileReader
+{
+  PosixFileReader pf;
+  FileReader *file;
+  ZSTD_DStream *stream;
+  ZSTD_inBuffer in;
+  void *inbuf;
+  size_t bufsize;
+  bool is_eof;
+  bool in_frame; // within a frame (the end of input must not be here)
+
+  public:
+
+    ZstdFileReader()
+    {
+      file = NULL;
+      inbuf = NULL;
+      stream = NULL;
+    }
+
+    bool open(const char *path, unsigned bufsize = 1L << 16)
+    {
+      assert(file == NULL);
+
+      if (!pf.open(path))
+      {
+        return false;
+      }
+      file = &pf;
+
+      // ZSTD_DStreamInSize() is the recommended minimum
+      if (bufsize < ZSTD_DStreamInSize()) bufsize = ZSTD_DStreamInSize();
+      this->inbuf = malloc(bufsize);
+      this->stream = ZSTD_createDStream();
+      if (!inbuf || !stream || ZSTD_isError(ZSTD_initDStream(stream)))
+      {
+        file->close(); file = NULL;
+        free(inbuf); inbuf = NULL;
+        if (stream) { ZSTD_freeDStream(stream); stream = NULL; }
+        return false;
+      }
+      this->bufsize = bufsize;
+
+      in.src = inbuf;
+      in.size = 0;
+      in.pos = 0;
+      is_eof = false;
+      in_frame = false;
+
+      return true;
+    }
+
+    virtual void close()
+    {
+      assert(file);
+      file->close(); file = NULL;
+      free(inbuf); inbuf = NULL;
+      ZSTD_freeDStream(stream); stream = NULL;
+    }
+
+    virtual ssize_t read(void *buf, size_t buflen)
+    {
+      assert(file);
+
+      for (;;)
+      {
+        if (!is_eof && in.pos == in.size)
+        {
+          ssize_t n = file->read(this->inbuf, this->bufsize);
+          if (n < 0)
+          {
+            return -1;
+          }
+          if (n == 0)
+          {
+            is_eof = true;
+          }
+          in.size = n;
+          in.pos = 0;
+        }
+
+        ZSTD_outBuffer out = { buf, buflen, 0 };
+        size_t in_pos = in.pos;
+        size_t ret = ZSTD_decompressStream(stream, &out, &in);
+        if (ZSTD_isError(ret))
+        {
+          return -1;
+        }
+        // ret == 0: a frame is completely decoded and flushed. the next
+        // call starts with the next frame.
+        if (in.pos > in_pos || out.pos > 0)
+          in_frame = (ret != 0);
+
+        if (out.pos > 0)
+          return out.pos;
+
+        if (is_eof && in.pos == in.size)
+        {
+          // truncated frame?
+          return in_frame ? -1 : 0;
+        }
+      }
+    }
+};
+
+#endif
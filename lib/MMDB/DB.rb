@@ -1,6 +1,7 @@
 require 'RecordModelMMDBExt'
 require 'RecordModel/RecordModel'
 require 'RecordModel/Query'
+require 'MMDB/ExternalSorter'
 
 module MMDB
 
@@ -8,22 +9,150 @@ module MMDB
 
     attr_accessor :modelklass
 
-    def self.open(modelklass, path, *args)
-      db = super(modelklass.model, path, *args)
+    #
+    # With :hll => true, a HyperLogLog sketch of each key is kept per slice,
+    # so Query#distinct_count does not have to scan slices completely
+    # covered by the query. This is off by default as it slows down
+    # put_bulk.
+    #
+    def self.open(modelklass, path, num_slices, hint_slices, num_records, hint_records, readonly, opts={})
+      raise ArgumentError, "wrong keys specified" unless (opts.keys - [:hll]).empty?
+      db = super(modelklass.model, path, num_slices, hint_slices, num_records, hint_records, readonly,
+                 opts[:hll] ? true : false)
       if db
         db.modelklass = modelklass
       end
       db
     end
 
-    # Redefine snapshot method
+    #
+    # Maintains +rollup_db+ (a DB of the same model) as a rollup of this
+    # database. Only the key fields +keys+ are kept, all other keys are set to
+    # their minimum value. Each field in +truncate+ is rounded down to a
+    # multiple of the given unit, e.g. :ts => 3600_000 for hourly buckets.
+    # Records with equal keys are combined by adding up their values.
+    #
+    # Every put_bulk updates the rollups, and Query#aggregate uses them
+    # whenever the grouping and query allow it.
+    #
+    # The i-th slice of +rollup_db+ is the rollup of the i-th slice of this
+    # database, so both must always have the same number of slices. If
+    # +rollup_db+ is empty, it is filled from the existing slices, one at a
+    # time. Otherwise it must be in sync (e.g. both committed together by
+    # DBMS#commit), or an exception is raised.
+    #
+    def add_rollup(rollup_db, keys, truncate={})
+      raise ArgumentError unless rollup_db.modelklass == self.modelklass
+      rollup = DB::Rollup.new(rollup_db, keys, truncate)
+      num_slices = get_snapshot_num()
+      done = rollup_db.get_snapshot_num()
+      if done == 0
+        rollup.backfill(self.snapshot, num_slices)
+      elsif done != num_slices
+        raise "rollup out of sync: #{done} slices instead of #{num_slices}"
+      end
+      rollups << rollup
+      rollup
+    end
+
+    def rollups
+      @rollups ||= []
+    end
+
+    #
+    # Stores +arr+ as a new slice. With :combine => true, records with equal
+    # keys are first combined into one (RecordModelInstanceArray#combine!),
+    # which modifies +arr+.
+    #
+    # +arr+ might also be a RecordModelInstanceColumnArray (without
+    # :combine and rollups).
+    #
+    def put_bulk(arr, opts={})
+      raise ArgumentError, "wrong keys specified" unless (opts.keys - [:combine]).empty?
+      if arr.is_a?(RecordModelInstanceColumnArray) and (opts[:combine] or !rollups.empty?)
+        raise ArgumentError, "not supported for column arrays"
+      end
+      arr.combine! if opts[:combine]
+      return super(arr) if rollups.empty?
+
+      # a slice and its rollups must not interleave with another put_bulk
+      rollup_mutex.synchronize {
+        res = super(arr)
+        rollups.each {|rollup| rollup.update(arr) if rollup.usable?}
+        res
+      }
+    end
+
+    #
+    # Stores the records of +sorter+ (an ExternalSorter over the keys of the
+    # model) as one slice, merging its runs while writing. This builds large
+    # slices from more records than fit into memory, e.g. for backfills.
+    # Finishes +sorter+ if not done yet.
+    #
+    # Rollups are not updated, so this is only allowed without rollups.
+    #
+    def put_sorted(sorter)
+      raise ArgumentError, "put_sorted does not update rollups" unless rollups.empty?
+      super(sorter)
+    end
+
+    #
+    # Reads all lines of +reader+ (an AutoFileReader), parses them according
+    # to +line_parse_descr+ (like RecordModel::FastLineParser) and stores
+    # them, one slice per array. Reading, parsing (on :threads threads) and
+    # storing all run natively and concurrently, outside the GVL.
+    #
+    # Each array is sorted on one of :sorters threads, while a single writer
+    # thread stores the arrays sorted before, in input order. At most :arrays arrays of
+    # :array_size records are in use at a time (the pipeline depth); parsing
+    # waits while all of them are being sorted or queued for storing.
+    #
+    # With :combine => true, records with equal keys are combined within
+    # each array before it is stored (see put_bulk).
+    #
+    # Lines with a parse error or an invalid number of tokens are skipped.
+    # Returns [lines_read, lines_ok, parse_errors, invalid_num_tokens].
+    #
+    # Rollups are not updated, so this is only allowed without rollups.
+    #
+    def ingest(reader, line_parse_descr, opts={})
+      unless (opts.keys - [:sep, :quote, :escape, :valid_token_range, :threads, :chunk_size,
+                           :array_size, :arrays, :sorters, :combine]).empty?
+        raise ArgumentError, "wrong keys specified"
+      end
+      raise ArgumentError, "ingest does not update rollups" unless rollups.empty?
+
+      sep = opts[:sep] || ' '
+      if opts[:quote]
+        sep = {:sep => opts[:sep] || ',', :quote => opts[:quote], :escape => opts.fetch(:escape, opts[:quote])}
+      end
+      range = opts[:valid_token_range] || (line_parse_descr.size .. -1)
+
+      super(reader, line_parse_descr, sep, range.first, range.last, opts[:threads] || 1,
+            opts[:chunk_size] || 2**22, opts[:array_size] || 2**22, opts[:arrays] || 3, opts[:sorters] || 1,
+            opts[:combine] ? true : false)
+    end
+
+    #
+    # Redefine snapshot method. As the slices of a rollup correspond to
+    # those of this database, the rollup is viewed at the same number of
+    # slices (if it has that many, see Snapshot#rollup_for).
+    #
     def snapshot
-      DB::Snapshot.new(self, get_snapshot_num())
+      num_slices = get_snapshot_num()
+      DB::Snapshot.new(self, num_slices,
+                       rollups.map {|rollup| [rollup, rollup.snapshot(num_slices)]})
     end
 
     def query(*queries)
       RecordModel::Query.new(self.snapshot, self.modelklass, *queries)
     end
+
+    private
+
+    def rollup_mutex
+      @rollup_mutex ||= Mutex.new
+    end
   end
 
   class DB::Snapshot
@@ -31,8 +160,20 @@ module MMDB
       @db.modelklass
     end
 
-    def initialize(db, snapshot)
-      @db, @snapshot = db, snapshot
+    def initialize(db, snapshot, rollups=[])
+      @db, @snapshot, @rollups = db, snapshot, rollups
+    end
+
+    #
+    # Returns the snapshot of a rollup which can answer an aggregate grouped
+    # by +fields+ over +queries+, or nil. Rollups which failed to update or
+    # lack slices of this snapshot are never used.
+    #
+    def rollup_for(fields, queries)
+      rollup, snapshot = @rollups.find {|rollup, snapshot|
+        rollup.usable? and snapshot.get_snapshot_num == @snapshot and rollup.covers?(fields, queries)
+      }
+      snapshot
     end
 
     def snapshot
@@ -53,6 +194,10 @@ module MMDB
       RecordModel::Query.new(self, self.modelklass, *queries)
     end
 
+    def slice_into(slice, itemarr)
+      @db.slice_into(slice, itemarr, @snapshot)
+    end
+
     def query_each(from, to, item, &block)
       @db.query_each(from, to, item, @snapshot, &block)
     end
@@ -72,6 +217,119 @@ module MMDB
     def query_aggregate(from, to, item, arr, fields, sum)
       @db.query_aggregate(from, to, item, arr, fields, sum, @snapshot)
     end
+
+    def query_each_ranges(ranges, item, &block)
+      @db.query_each_ranges(ranges, item, @snapshot, &block)
+    end
+
+    def query_into_ranges(ranges, item, itemarr)
+      @db.query_into_ranges(ranges, item, itemarr, @snapshot)
+    end
+
+    def query_count_ranges(ranges, item)
+      @db.query_count_ranges(ranges, item, @snapshot)
+    end
+
+    def query_aggregate_ranges(ranges, item, arr, fields, sum)
+      @db.query_aggregate_ranges(ranges, item, arr, fields, sum, @snapshot)
+    end
+
+    def query_sum_ranges(ranges, item, sums)
+      @db.query_sum_ranges(ranges, item, sums, @snapshot)
+    end
+
+    def query_distinct_ranges(ranges, item, field)
+      @db.query_distinct_ranges(ranges, item, field, @snapshot)
+    end
+
+    def query_quantiles_ranges(ranges, item, field, qs)
+      @db.query_quantiles_ranges(ranges, item, field, qs, @snapshot)
+    end
+  end
+
+  class DB::Rollup
+    attr_reader :db, :keys, :truncate
+
+    def initialize(db, keys, truncate={})
+      klass = db.modelklass
+      @db = db
+      @keys = keys
+      @truncate = truncate
+
+      keys.each {|id| raise ArgumentError, "#{id} is not a key" unless klass.__info[klass.sym_to_fld_idx(id)][2]}
+      raise ArgumentError unless truncate.keys.all? {|id| keys.include?(id)}
+      @usable = true
+    end
+
+    #
+    # False once an update failed. The rollup then lacks a slice and is
+    # never used again.
+    #
+    def usable?
+      @usable
+    end
+
+    #
+    # The first +num_slices+ slices of the rollup db, or all of them if it
+    # has less.
+    #
+    def snapshot(num_slices)
+      DB::Snapshot.new(@db, [num_slices, @db.get_snapshot_num].min)
+    end
+
+    #
+    # Stores the rollup of +arr+ (the records of a new slice) as a new slice.
+    # If that fails, the rollup is marked as not usable and the error is
+    # raised.
+    #
+    def update(arr)
+      return if arr.empty?
+      raise "rollup is not usable" unless usable?
+      begin
+        num_slices = @db.get_snapshot_num
+        tmp = arr.model_klass.make_array(arr.size)
+        arr.rollup_into(tmp, @keys, @truncate)
+        @db.put_bulk(tmp)
+        raise "rollup slice not stored" unless @db.get_snapshot_num == num_slices + 1
+      rescue Exception
+        @usable = false
+        raise
+      end
+    end
+
+    #
+    # Rolls up the first +num_slices+ slices of +snapshot+ (of the raw db)
+    # into the empty rollup db, one slice at a time. Only the largest slice
+    # has to fit into memory.
+    #
+    def backfill(snapshot, num_slices)
+      arr = snapshot.modelklass.make_array(1024)
+      num_slices.times do |s|
+        arr.reset
+        raise "cannot read slice" unless snapshot.slice_into(s, arr)
+        update(arr)
+      end
+    end
+
+    #
+    # True if an aggregate grouped by +fields+ over +queries+ gives the same
+    # result on this rollup: all fields must be kept and not truncated, and
+    # the queries may only constrain kept keys. A range on a truncated key
+    # must be aligned to whole buckets.
+    #
+    def covers?(fields, queries)
+      return false unless fields.all? {|id| @keys.include?(id) and !@truncate.has_key?(id)}
+      queries.all? {|query| query.all? {|id, q| covers_constraint?(id, q)}}
+    end
+
+    private
+
+    def covers_constraint?(id, q)
+      return false unless @keys.include?(id)
+      unit = @truncate[id]
+      return true unless unit
+      q.is_a?(Range) and q.first % unit == 0 and (q.last + 1) % unit == 0
+    end
   end
 
 end # module MMDB
@@ -38,17 +38,34 @@ module MMDB
       end
 
       @dbs = {}
-
+      rollups = []
+
+      #
+      # A schema entry can end with an options hash to declare a rollup of
+      # another database, e.g.:
+      #
+      #   [:hourly, Klass, nil, nil, {:rollup_of => :raw, :keys => [:campaign_id, :ts], :truncate => {:ts => 3600_000}}]
+      #
+      # or to keep distinct count sketches with :hll => true (see DB.open).
+      #
       @schemas.each do |arr|
+        arr = arr.dup
+        opts = arr.last.is_a?(Hash) ? arr.pop : {}
         id, klass, hint1, hint2 = *arr
         raise ArgumentError unless id.is_a?(Symbol)
         raise ArgumentError unless klass
         raise ArgumentError if @dbs[id]
         hint0 ||= 1024 
         hint1 ||= 1024*1024
-        db = DB.open(klass, File.join(@dirname, "db_#{id}_"), cr[id][0], hint0, cr[id][1], hint1, @readonly)
+        db = DB.open(klass, File.join(@dirname, "db_#{id}_"), cr[id][0], hint0, cr[id][1], hint1, @readonly, :hll => opts[:hll])
         raise "Cannot open a database" unless db
         @dbs[id] = db
+        rollups << [opts[:rollup_of], db, opts[:keys], opts[:truncate] || {}] if opts[:rollup_of]
+      end
+
+      rollups.each do |of, db, keys, truncate|
+        raise ArgumentError, "rollup needs :keys" unless keys
+        get_db(of).add_rollup(db, keys, truncate)
       end
     end
 
@@ -0,0 +1,50 @@
+require 'RecordModelMMDBExt'
+require 'RecordModel/RecordModel'
+
+module MMDB
+
+  #
+  # Sorts more records than fit into memory. Records are collected into runs
+  # of :run_size records, each sorted and written to a temporary file within
+  # +tmp_dir+. After #finish, #each and #read_into return all records in
+  # sorted order by merging the runs.
+  #
+  # Sorts by the fields :keys (default: the keys of the model). A sorter over
+  # the keys of the model can be stored as one slice with DB#put_sorted.
+  #
+  class ExternalSorter < RecordModelExternalSorter
+
+    attr_accessor :model_klass
+
+    def self.new(model_klass, tmp_dir, opts={})
+      raise ArgumentError, "wrong keys specified" unless (opts.keys - [:keys, :run_size]).empty?
+      keys = opts[:keys] && opts[:keys].map {|id| model_klass.sym_to_fld_idx(id)}
+      sorter = super(model_klass.model, tmp_dir, keys, opts[:run_size] || 1_000_000)
+      sorter.model_klass = model_klass
+      sorter
+    end
+
+    include Enumerable
+
+    #
+    # Yields the remaining records in sorted order. Each record is returned
+    # only once, so a second call yields nothing.
+    #
+    def each(&block)
+      _each(@model_klass.new) {|rec| yield rec.dup}
+    end
+
+    def each_no_dup(&block)
+      _each(@model_klass.new, &block)
+    end
+
+    #
+    # Appends up to +max+ of the remaining records to +arr+ (by default as
+    # many as fit in). Returns the number of records appended.
+    #
+    def read_into(arr, max=nil)
+      _read_into(arr, max || arr.capacity - arr.size)
+    end
+  end
+
+end
@@ -1,8 +1,16 @@
 require 'RecordModelExt'
 
 class AutoFileReader
-  def self.open(path, buflen=2**16, &block)
-    obj = _open(path, buflen)
+  #
+  # +path+ can also be an Array of paths, which are read back to back as
+  # one stream (see also AutoFileReader.glob).
+  #
+  # Uncompressed files are memory mapped, or read with several large reads
+  # in flight if +async+ is true. By default (nil) the latter is used on
+  # network file systems.
+  #
+  def self.open(path, buflen=2**16, async=nil, &block)
+    obj = path.is_a?(Array) ? _open_multi(path, buflen) : _open(path, buflen, async)
     if block
       begin
         block.call(obj)
@@ -14,4 +22,11 @@ class AutoFileReader
       return obj
     end
   end
+
+  #
+  # Reads all files matching +pattern+ in sorted order as one stream.
+  #
+  def self.glob(pattern, buflen=2**16, &block)
+    open(Dir.glob(pattern).sort, buflen, &block)
+  end
 end
@@ -201,14 +201,23 @@ class RecordModel::FastLineParser
   end
 
   def initialize_parser(h)
-    unless (h.keys - [:line_parse_descr, :sep, :reject_token_parse_error, :reject_invalid_num_tokens, :valid_token_range]).empty?
+    unless (h.keys - [:line_parse_descr, :sep, :reject_token_parse_error, :reject_invalid_num_tokens, :valid_token_range,
+                      :threads, :chunk_size, :quote, :escape]).empty?
       raise ArgumentError, "wrong keys specified"
     end
     @line_parse_descr = h[:line_parse_descr] || (raise ArgumentError)
     @sep = h[:sep] || ' '
+    # quoted CSV fields (escape defaults to the quote character, i.e. "")
+    if h[:quote]
+      @sep = {:sep => h[:sep] || ',', :quote => h[:quote], :escape => h.fetch(:escape, h[:quote])}
+    end
     @reject_token_parse_error = h[:reject_token_parse_error] || true
     @reject_invalid_num_tokens = h[:reject_invalid_num_tokens] || true
     @valid_token_range = h[:valid_token_range] || (@line_parse_descr.size .. -1) 
+    # with more than one thread, invalid lines are always rejected (the block is not called)
+    @threads = h[:threads] || 1
+    @chunk_size = h[:chunk_size] || 2**22
+    @thread_stats = nil
   end
 
   def start
@@ -239,6 +248,7 @@ class RecordModel::FastLineParser
   def import(reader, max_line_len=4096, &block)
     lines_ok = 0
     lines_read = 0
+    @thread_stats = nil
 
     init_work()
 
@@ -253,15 +263,35 @@ class RecordModel::FastLineParser
     return lines_read, lines_ok 
   end
 
+  #
+  # Per thread [lines_read, lines_ok, parse_errors, invalid_num_tokens] of
+  # the last import (only if using multiple threads).
+  #
+  attr_reader :thread_stats
+
   protected
 
   def step(reader, max_line_len, &block)
     before = @current_arr.size
+    if @threads > 1
+      more, lread, stats = @current_arr.bulk_parse_line_parallel(reader, @line_parse_descr, @sep,
+        [@chunk_size, max_line_len].max, @valid_token_range.first, @valid_token_range.last, @threads)
+      add_thread_stats(stats)
+      return [more, lread, @current_arr.size - before]
+    end
     more, lread = @current_arr.bulk_parse_line(@item, reader, @line_parse_descr, @sep, max_line_len, 
       @reject_token_parse_error, @reject_invalid_num_tokens, @valid_token_range.first, @valid_token_range.last, &block)
     return [more, lread, @current_arr.size - before]
   end
 
+  def add_thread_stats(stats)
+    if @thread_stats.nil? or @thread_stats.size != stats.size
+      @thread_stats = stats
+    else
+      @thread_stats = @thread_stats.zip(stats).map {|a, b| a.zip(b).map {|x, y| x + y}}
+    end
+  end
+
   def init_work
     if @current_arr.nil?
       @current_arr = @free_q.pop
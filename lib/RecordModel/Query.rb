@@ -14,7 +14,11 @@ class RecordModel::Query
 
   def each(&block)
     item = @klass.new
-    @ranges.each {|from, to| @db.query_each(from, to, item, &block)}
+    if multi_range?
+      @db.query_each_ranges(@ranges, item, &block)
+    else
+      @ranges.each {|from, to| @db.query_each(from, to, item, &block)}
+    end
   end
 
   def to_a
@@ -25,30 +29,61 @@ class RecordModel::Query
 
   def count
     item = @klass.new
+    if multi_range?
+      return @db.query_count_ranges(@ranges, item)
+    end
     cnt = 0
     @ranges.each {|from, to| cnt += @db.query_count(from, to, item)}
     cnt
   end
 
   def aggregate(fields, itemarr=nil, sum=true)
+    if sum and @db.respond_to?(:rollup_for) and rollup = @db.rollup_for(fields, @queries)
+      return RecordModel::Query.new(rollup, @klass, *@queries).aggregate(fields, itemarr, sum)
+    end
     fields = fields.map {|field| @klass.sym_to_fld_idx(field) }
     itemarr ||= @klass.make_array(1024) # should be expandable!
     item = @klass.new
-    @ranges.each {|from, to|
-      @db.query_aggregate(from, to, item, itemarr, fields, sum)
-    }
+    if multi_range?
+      @db.query_aggregate_ranges(@ranges, item, itemarr, fields, sum)
+    else
+      @ranges.each {|from, to|
+        @db.query_aggregate(from, to, item, itemarr, fields, sum)
+      }
+    end
     return itemarr
   end
 
   def into(itemarr=nil)
     item = @klass.new()
     itemarr ||= @klass.make_array(1024)
-    @ranges.each {|from, to|
-      raise "query_into failed" unless @db.query_into(from, to, item, itemarr)
-    }
+    if multi_range?
+      raise "query_into failed" unless @db.query_into_ranges(@ranges, item, itemarr)
+    else
+      @ranges.each {|from, to|
+        raise "query_into failed" unless @db.query_into(from, to, item, itemarr)
+      }
+    end
     return itemarr 
   end
 
+  #
+  # Joins the matching records with +other+ (a Query or a sorted
+  # RecordModelInstanceArray) into +out+, see RecordModelInstanceArray#join.
+  # The matching records of a query are loaded into an array and sorted on
+  # the join keys first.
+  #
+  def join(other, on, out, opts={})
+    left_keys, right_keys = RecordModelInstanceArray.join_keys(on)
+    left = into
+    left.sort(left_keys)
+    if other.is_a?(RecordModel::Query)
+      other = other.into
+      other.sort(right_keys)
+    end
+    left.join(other, on, out, opts)
+  end
+
   def min
     min = nil
     item = @klass.new()
@@ -61,4 +96,39 @@ class RecordModel::Query
     }
     return min
   end
+
+  #
+  # Returns a record holding the sum of each numeric value field over all
+  # matching records, and the number of matching records.
+  #
+  def sum(sums=nil)
+    sums ||= @klass.new
+    cnt = @db.query_sum_ranges(@ranges, @klass.new, sums)
+    return sums, cnt
+  end
+
+  #
+  # Approximate number of distinct values of +field+ (HyperLogLog).
+  #
+  def distinct_count(field)
+    @db.query_distinct_ranges(@ranges, @klass.new, @klass.sym_to_fld_idx(field))
+  end
+
+  #
+  # Approximate values of +field+ at the given quantiles, e.g.
+  # quantiles(:duration, 0.5, 0.99). Returns nil values if nothing matched.
+  #
+  def quantiles(field, *qs)
+    @db.query_quantiles_ranges(@ranges, @klass.new, @klass.sym_to_fld_idx(field), qs)
+  end
+
+  protected
+
+  #
+  # Multiple ranges are queried in a single pass over the slices, if the
+  # database supports it.
+  #
+  def multi_range?
+    @ranges.size > 1 and @db.respond_to?(:query_count_ranges)
+  end
 end
@@ -184,6 +184,14 @@ class RecordModelInstance
     RecordModelInstanceArray.new(self, n, expandable)
   end
 
+  #
+  # Like make_array, but stores each field in a column of its own (see
+  # RecordModelInstanceColumnArray).
+  #
+  def self.make_column_array(n, expandable=true)
+    RecordModelInstanceColumnArray.new(self, n, expandable)
+  end
+
   def self.build_query(query)
     from = new().set_min
     to = new().set_max
@@ -219,10 +227,35 @@ class RecordModelInstance
     }
   end
 
+  #
+  # Parse description for JSON lines, mapping object keys to fields.
+  # A Symbol maps the key of the same name.
+  #
+  # Example usage: def_json_descr(:uid, :timestamp, "campaign" => :campaign_id)
+  #
+  def self.def_json_descr(*args)
+    descr = {}
+    args.each {|arg|
+      case arg
+      when Symbol
+        descr[arg.to_s] = sym_to_fld_idx(arg)
+      when Hash
+        arg.each {|key, fld| descr[key.to_s] = sym_to_fld_idx(fld) }
+      else
+        raise ArgumentError
+      end
+    }
+    descr
+  end
+
   def self.sym_to_fld_idx(sym)
     __info().index {|fld| fld.first == sym} || raise
   end
 
+  def self.has_field?(sym)
+    __info().any? {|fld| fld.first == sym}
+  end
+
   def sym_to_fld_idx(sym)
     __info().index {|fld| fld.first == sym} || raise
   end
@@ -241,9 +274,8 @@ class RecordModelInstanceArray
 
   include Enumerable
 
-  def each
-    instance = @model_klass.new
-    _each(instance) {|i| yield i.dup}
+  def each(&block)
+    _each_dup(@model_klass, &block)
   end
 
   def each_no_dup(&block)
@@ -265,6 +297,176 @@ class RecordModelInstanceArray
     [self.class, to_a]
   end
 
+  #
+  # Column operations on field +attr+ of all records, each a single native
+  # loop. +range+ is an inclusive Range of values of +attr+. Only
+  # column_filter honors the sort order.
+  #
+
+  def column_sum(attr)
+    _column_sum(@model_klass.sym_to_fld_idx(attr))
+  end
+
+  # Returns nil if empty.
+  def column_min(attr)
+    mm = _column_min_max(@model_klass.sym_to_fld_idx(attr))
+    mm && mm.first
+  end
+
+  # Returns nil if empty.
+  def column_max(attr)
+    mm = _column_min_max(@model_klass.sym_to_fld_idx(attr))
+    mm && mm.last
+  end
+
+  def column_count(attr, range=nil)
+    return size if range.nil?
+    _column_count(@model_klass.sym_to_fld_idx(attr), *column_range(attr, range))
+  end
+
+  #
+  # Appends the records whose +attr+ lies within +range+ to +out+ (by default
+  # a new array) and returns it.
+  #
+  def column_filter(attr, range, out=nil)
+    out ||= @model_klass.make_array(16)
+    _column_filter(@model_klass.sym_to_fld_idx(attr), *column_range(attr, range), out)
+  end
+
+  #
+  # Integer fields are truncated and clamped to their range.
+  #
+  def column_scale!(attr, factor)
+    _column_scale(@model_klass.sym_to_fld_idx(attr), factor)
+  end
+
+  def column_add!(attr, value)
+    _column_add(@model_klass.sym_to_fld_idx(attr), @model_klass.new(attr => value))
+  end
+
+  # Returns a Hash of value => number of occurrences.
+  def column_histogram(attr)
+    _column_histogram(@model_klass.sym_to_fld_idx(attr))
+  end
+
+  #
+  # Inner sort-merge join of this array with +right+ into +out+ (an array of
+  # any model). Both arrays must be sorted on their join keys (see #sort).
+  # +on+ is an Array of field names of both models, or a Hash mapping left
+  # to right field names.
+  #
+  # Each field of the model of +out+ is taken from the left record if its
+  # model has a field of that name, otherwise from the right one (if any).
+  # Option :fields maps field names of +out+ to [:left or :right, field name]
+  # instead.
+  #
+  # With :threads => n, the join runs on n threads partitioned by key range.
+  # With :combine => true, the output is combined by the keys of +out+
+  # while joining (see combine!), so +out+ only needs room for the distinct
+  # keys.
+  #
+  # Returns the number of joined pairs.
+  #
+  def join(right, on, out, opts={})
+    raise ArgumentError, "wrong keys specified" unless (opts.keys - [:fields, :threads, :combine]).empty?
+    left_keys, right_keys = self.class.join_keys(on)
+    explicit = opts[:fields] || {}
+
+    maps = []
+    out.model_klass.__info.each_with_index {|fld, i|
+      side, id = explicit[fld.first]
+      if side.nil?
+        if @model_klass.has_field?(fld.first)
+          side, id = :left, fld.first
+        elsif right.model_klass.has_field?(fld.first)
+          side, id = :right, fld.first
+        else
+          next
+        end
+      end
+      raise ArgumentError unless [:left, :right].include?(side)
+      src = (side == :left ? @model_klass : right.model_klass)
+      maps << [i, side == :right, src.sym_to_fld_idx(id)]
+    }
+
+    _join(right, left_keys.map {|id| @model_klass.sym_to_fld_idx(id)},
+          right_keys.map {|id| right.model_klass.sym_to_fld_idx(id)},
+          out, maps, opts[:threads] || 1, opts[:combine] || false)
+  end
+
+  #
+  # Returns the left and right field names of the +on+ argument of #join.
+  #
+  def self.join_keys(on)
+    if on.is_a?(Hash)
+      [on.keys, on.values]
+    else
+      [on, on]
+    end
+  end
+
+  #
+  # Projects all records into +dst+, keeping only the key fields in +keys+
+  # (the others are set to their minimum) and truncating the fields in
+  # +truncate+ (e.g. {:ts => 3600_000}). Records with equal keys are combined.
+  #
+  def rollup_into(dst, keys, truncate={})
+    reset = []
+    @model_klass.__info.each_with_index {|fld, i| reset << i if fld[2] and !keys.include?(fld.first)}
+    _rollup_into(dst, reset, truncate.map {|id, unit| [@model_klass.sym_to_fld_idx(id), unit]})
+  end
+
+  def sort(arr=nil)
+    if arr
+      _sort(arr.map{|attr| @model_klass.sym_to_fld_idx(attr)})
+    else
+      _sort(arr)
+    end
+  end
+
+  private
+
+  def column_range(attr, range)
+    raise ArgumentError if range.exclude_end?
+    [@model_klass.new(attr => range.first), @model_klass.new(attr => range.last)]
+  end
+end
+
+#
+# Columnar variant of RecordModelInstanceArray: one contiguous buffer per
+# field. Supports the same basic API. MMDB::DB#put_bulk stores it by
+# copying whole key columns.
+#
+class RecordModelInstanceColumnArray
+  attr_reader :model_klass
+
+  alias old_initialize initialize
+
+  def initialize(model_klass, n=16, expandable=true)
+    @model_klass = model_klass
+    old_initialize(model_klass, n, expandable)
+  end
+
+  include Enumerable
+
+  def each(&block)
+    _each_dup(@model_klass, &block)
+  end
+
+  def each_no_dup(&block)
+    instance = @model_klass.new
+    _each(instance, &block)
+  end
+
+  alias old_bulk_set bulk_set
+  def bulk_set(attr, value)
+    old_bulk_set(@model_klass.sym_to_fld_idx(attr), value)
+  end
+
+  def inspect
+    [self.class, to_a]
+  end
+
   def sort(arr=nil)
     if arr
       _sort(arr.map{|attr| @model_klass.sym_to_fld_idx(attr)})
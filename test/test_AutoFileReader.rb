@@ -1,4 +1,5 @@
 require 'test/unit'
+require 'zlib'
 
 $LOAD_PATH << "../ext/RecordModel" 
 $LOAD_PATH << "../lib" 
@@ -33,4 +34,135 @@ class TestRecordModel < Test::Unit::TestCase
     }
   end
 
+  def read_all(path)
+    str = ""
+    AutoFileReader.open(path) {|io|
+      while c = io.read(4000)
+        str << c
+      end
+    }
+    str
+  end
+
+  def big_data
+    (0...100_000).map {|i| "#{i} #{i * 7}\n"}.join
+  end
+
+  def test_xz_multi_block
+    data = big_data
+    File.write('test_big.txt', data)
+    `xz -T2 --block-size=100000 -c test_big.txt > test_big.txt.xz`
+    assert_equal data, read_all('test_big.txt.xz')
+  ensure
+    `rm -f test_big.txt test_big.txt.xz`
+  end
+
+  def test_gzip
+    data = big_data
+    Zlib::GzipWriter.open('test_big.txt.gz') {|gz| gz.write(data)}
+    assert_equal data, read_all('test_big.txt.gz')
+  ensure
+    `rm -f test_big.txt.gz`
+  end
+
+  def bgzf_block(data)
+    deflate = Zlib::Deflate.new(Zlib::DEFAULT_COMPRESSION, -Zlib::MAX_WBITS)
+    cdata = deflate.deflate(data, Zlib::FINISH)
+    deflate.close
+    header = [31, 139, 8, 4, 0, 0, 255, 6, 'B'.ord, 'C'.ord, 2, 18 + cdata.size + 8 - 1].pack("CCCCVCCvCCvv")
+    header + cdata + [Zlib.crc32(data), data.size].pack("VV")
+  end
+
+  def test_bgzf
+    data = big_data
+    File.open('test_big.txt.gz', 'wb') {|f|
+      (0...data.size).step(60_000) {|offs| f.write(bgzf_block(data[offs, 60_000]))}
+      f.write(bgzf_block("")) # EOF marker
+    }
+    assert_equal data, read_all('test_big.txt.gz')
+
+    # a corrupt block is reported as a read error
+    File.open('test_big.txt.gz', 'r+b') {|f| f.seek(30); f.write("XXXX")}
+    assert_raise(RuntimeError) { read_all('test_big.txt.gz') }
+  ensure
+    `rm -f test_big.txt.gz`
+  end
+
+  def compress_frames(format, cmd)
+    omit_unless(AutoFileReader::FORMATS.include?(format), "built without #{format} support")
+    omit_if(`which #{cmd}`.empty?, "#{cmd} not installed")
+    data = big_data
+    half = data.size / 2
+    # two concatenated frames
+    File.write('test_big_a.txt', data[0, half])
+    File.write('test_big_b.txt', data[half..-1])
+    `#{cmd} -q -c test_big_a.txt > test_big.txt.#{format}`
+    `#{cmd} -q -c test_big_b.txt >> test_big.txt.#{format}`
+    assert_equal data, read_all("test_big.txt.#{format}")
+  ensure
+    `rm -f test_big_a.txt test_big_b.txt test_big.txt.#{format}`
+  end
+
+  def test_zstd
+    compress_frames('zst', 'zstd')
+  end
+
+  def test_lz4
+    compress_frames('lz4', 'lz4')
+  end
+
+  def test_sniff_format
+    data = big_data
+    # compressed, but without a telling suffix
+    Zlib::GzipWriter.open('test_big.log') {|gz| gz.write(data)}
+    assert_equal data, read_all('test_big.log')
+    `xz -c test.xz > test_big.log` # double compressed: one layer is removed
+    assert_equal File.binread('test.xz'), read_all('test_big.log')
+  ensure
+    `rm -f test_big.log`
+  end
+
+  def test_multi_file
+    File.write('test_multi_1.txt', "a\nb\n")
+    File.write('test_multi_2.txt', "c\nd") # no trailing newline
+    Zlib::GzipWriter.open('test_multi_3.gz') {|gz| gz.write("e\n")}
+    File.write('test_multi_4.txt', "")
+    File.write('test_multi_5.txt', "f")
+
+    str = ""
+    AutoFileReader.glob('test_multi_*') {|io|
+      while c = io.read(3)
+        str << c
+      end
+    }
+    assert_equal "a\nb\nc\nd\ne\nf", str
+
+    assert_equal "a\nb\nf", read_all(['test_multi_1.txt', 'test_multi_5.txt'])
+    assert_equal "", read_all([])
+
+    # a missing file is a read error once it is reached
+    assert_raise(RuntimeError) { read_all(['test_multi_1.txt', 'test_multi_missing.txt']) }
+  ensure
+    `rm -f test_multi_*`
+  end
+
+  def test_async_read
+    data = big_data * 5
+    File.write('test_big.txt', data)
+    [true, false, nil].each do |async|
+      str = ""
+      AutoFileReader.open('test_big.txt', 2**16, async) {|io|
+        while c = io.read(100_000)
+          str << c
+        end
+      }
+      assert_equal data, str
+    end
+
+    # closed before everything was read
+    AutoFileReader.open('test_big.txt', 2**16, true) {|io| assert_equal data[0, 10], io.read(10) }
+  ensure
+    `rm -f test_big.txt`
+  end
+
 end
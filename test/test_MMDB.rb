@@ -5,6 +5,7 @@ $LOAD_PATH << "../ext/MMDB"
 $LOAD_PATH << "../lib" 
 require 'RecordModel/RecordModel'
 require 'MMDB/DB'
+require 'RecordModel/AutoFileReader'
 
 class TestMMDB < Test::Unit::TestCase
 
@@ -47,4 +48,444 @@ class TestMMDB < Test::Unit::TestCase
     db.close
   end
 
+  def test_put_bulk_combine
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(@klass, "./tmp.test/db/", 0, 1, 0, 100_000, false) 
+
+    arr = @klass.make_array(1_000)
+    1_000.times do |i|
+      arr << @klass.new(:a => i % 2, :d => i % 10, :e => 1.0)
+    end
+
+    db.put_bulk(arr, :combine => true)
+    assert_equal 10, arr.size
+
+    assert_equal 10, db.query.count
+    assert_equal [100.0], db.query(:d => 3).to_a.map {|i| i.e}
+    assert_raise(ArgumentError) { db.put_bulk(arr, :sort => true) }
+
+    db.close
+  end
+
+  def test_put_bulk_columns
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(@klass, "./tmp.test/db/", 0, 2, 0, 100_000, false) 
+
+    rows = @klass.make_array(1_000)
+    cols = @klass.make_column_array(10)
+    1_000.times do |i|
+      rec = @klass.new(:a => i % 2, :c => 1000 - i, :d => i % 10, :e => 1.0 * i, :f => "%04x" % i, :g => i)
+      rows << rec
+      cols << rec
+    end
+
+    db.put_bulk(cols)
+    assert_equal 1_000, db.query.count
+    assert_equal 100, db.query(:d => 3).count
+    assert_equal 500, db.query(:a => 1).count
+    assert_equal (0...1_000).select {|i| i % 10 == 3}.map {|i| "%032X" % i},
+                 db.query(:d => 3).to_a.map {|r| r.f}.sort
+    assert_equal [999], db.query(:c => 1).to_a.map {|r| r.g}
+
+    db.put_bulk(rows)
+    assert_equal 2_000, db.query.count
+    assert_equal 200, db.query(:d => 3 .. 3).count
+    assert_equal db.query(:d => 7).to_a.map {|r| r.e}.sort, (0...1_000).select {|i| i % 10 == 7}.map {|i| 1.0 * i}.flat_map {|e| [e, e]}.sort
+
+    assert_raise(ArgumentError) { db.put_bulk(cols, :combine => true) }
+    db.close
+  end
+
+  def test_query_join
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(@klass, "./tmp.test/db/", 0, 2, 0, 100_000, false) 
+
+    2.times do |s|
+      arr = @klass.make_array(100)
+      100.times {|i| arr << @klass.new(:c => i, :d => s, :e => 1.0)}
+      db.put_bulk(arr)
+    end
+
+    users = RecordModel.define do |r|
+      r.key :c, :uint32
+      r.val :g, :timestamp
+    end
+    u = users.make_array(8)
+    [5, 50, 500].each {|c| u << users.new(:c => c, :g => c * 10)}
+    u.sort
+
+    out = @klass.make_array(8)
+    assert_equal 4, db.query(:c => 0 .. 60).join(u, [:c], out, :fields => {:g => [:right, :g]})
+    assert_equal [[5, 0, 50], [5, 1, 50], [50, 0, 500], [50, 1, 500]],
+                 out.map {|r| [r.c, r.d, r.g]}.sort
+
+    db.close
+  end
+
+  def test_external_sorter
+    `rm -rf ./tmp.test/sort`
+    `mkdir -p ./tmp.test/sort`
+
+    recs = (0...1_000).map {|i| [(i * 7919) % 1_000, i % 3]}
+    sorter = MMDB::ExternalSorter.new(@klass, "./tmp.test/sort", :run_size => 64)
+    arr = @klass.make_array(8)
+    recs.first(500).each {|c, d| arr << @klass.new(:c => c, :d => d, :e => c * 0.5)}
+    sorter.add_array(arr)
+    recs.drop(500).each {|c, d| sorter << @klass.new(:c => c, :d => d, :e => c * 0.5)}
+
+    assert_equal 1_000, sorter.size
+    sorter.finish
+    assert_equal 16, sorter.runs
+    assert_raise(ArgumentError) { sorter << @klass.new }
+
+    out = @klass.make_array(100, false)
+    assert_equal 100, sorter.read_into(out)
+    # a full array stops reading without losing a record
+    assert_equal 0, sorter.read_into(out, 10)
+    rest = sorter.map {|r| [r.c, r.d]}
+    assert_equal recs.sort, out.map {|r| [r.c, r.d]} + rest
+    assert_equal [], sorter.to_a
+
+    # re-sort query results on a value field
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(@klass, "./tmp.test/db/", 0, 2, 0, 10_000, false) 
+    by_e = MMDB::ExternalSorter.new(@klass, "./tmp.test/sort", :keys => [:e], :run_size => 100)
+    assert_raise(ArgumentError) { db.put_sorted(by_e) }
+    db.put_bulk(arr)
+    db.query.each {|rec| by_e << rec}
+    by_e.finish
+    assert_equal arr.map {|r| r.e}.sort, by_e.map {|r| r.e}
+    db.close
+  end
+
+  def test_put_sorted
+    `rm -rf ./tmp.test/db ./tmp.test/sort`
+    `mkdir -p ./tmp.test/db ./tmp.test/sort`
+    db = MMDB::DB.open(@klass, "./tmp.test/db/", 0, 2, 0, 10_000, false) 
+
+    sorter = MMDB::ExternalSorter.new(@klass, "./tmp.test/sort", :run_size => 100)
+    5_000.times {|i| sorter << @klass.new(:a => i % 2, :d => (i * 31) % 5_000, :e => 1.0, :f => "%032X" % i)}
+    db.put_sorted(sorter)
+    assert_equal 50, sorter.runs
+
+    assert_equal 5_000, db.query.count
+    assert_equal 2_500, db.query(:a => 1).count
+    assert_equal 11, db.query(:d => 100 .. 110).count
+    assert_equal "%032X" % 1_000, db.query(:d => (1_000 * 31) % 5_000).to_a.first.f
+    sums, cnt = db.query.sum
+    assert_equal [5_000.0, 5_000], [sums.e, cnt]
+
+    slices = 0
+    db.slices(@klass.new, db.get_snapshot_num) { slices += 1 }
+    assert_equal 2, slices  # min and max of a single slice
+
+    # the slice is sorted like any other
+    prev = nil
+    db.query.each {|rec|
+      cur = [rec.a, rec.d]
+      assert prev.nil? || (prev <=> cur) <= 0
+      prev = cur
+    }
+
+    db.close
+  end
+
+  def test_query_ranges
+    klass = RecordModel.define do |r|
+      r.key :uid, :uint64
+      r.key :ts, :timestamp
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 4, 0, 10_000, false) 
+
+    2.times do |s|
+      arr = klass.make_array(1_000)
+      1_000.times do |i|
+        arr << klass.new(:uid => i, :ts => s, :v => 1)
+      end
+      db.put_bulk(arr)
+    end
+
+    uids = [999, 3, 500, 7, 3]
+    q = db.query(*uids.map {|uid| {:uid => uid}})
+    assert_equal 10, q.count
+    assert_equal 10, q.into.size
+    assert_equal [3, 3, 3, 3, 7, 7, 500, 500, 999, 999], q.to_a.map {|i| i.uid}.sort
+    assert_equal 4, q.aggregate([:uid]).size
+    assert_equal 30, db.query({:uid => 10..19}, {:uid => 15..24, :ts => 1}).count
+
+    db.close
+  end
+
+  def test_query_non_leading_keys
+    klass = RecordModel.define do |r|
+      r.key :a, :uint16
+      r.key :b, :uint16
+      r.key :c, :uint16
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 4, 0, 10_000, false) 
+
+    recs = []
+    arr = klass.make_array(8_000)
+    8_000.times do |i|
+      rec = [i % 20, (i * 7) % 50, (i * 13) % 30]
+      recs << rec
+      arr << klass.new(:a => rec[0], :b => rec[1], :c => rec[2])
+    end
+    db.put_bulk(arr)
+
+    [[3..5, 0..29], [10..10, 7..9], [0..49, 29..29], [40..49, 0..0]].each do |b, c|
+      exp = recs.count {|_, rb, rc| b.include?(rb) and c.include?(rc)}
+      assert_equal exp, db.query(:b => b, :c => c).count
+    end
+
+    db.close
+  end
+
+  def test_query_sketches
+    klass = RecordModel.define do |r|
+      r.key :uid, :uint64
+      r.key :ts, :timestamp
+      r.val :v, :uint32
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 4, 0, 100_000, false) 
+
+    [0, 1].each do |ts|
+      arr = klass.make_array(20_000)
+      20_000.times do |i|
+        arr << klass.new(:uid => i % 5_000, :ts => ts, :v => i % 1001)
+      end
+      db.put_bulk(arr)
+    end
+
+    # without :hll, there is no hll file and all slices are scanned
+    assert Dir["./tmp.test/db/hll_*"].empty?
+    assert_in_delta 5_000, db.query().distinct_count(:uid), 250
+    num_slices, num_records = db.commit
+    db.close
+
+    # the sketches of the existing slices are built upon open
+    db = MMDB::DB.open(klass, "./tmp.test/db/", num_slices, 4, num_records, 100_000, false, :hll => true)
+    assert_equal 1, Dir["./tmp.test/db/hll_*"].size
+    assert_raise(ArgumentError) { MMDB::DB.open(klass, "./tmp.test/db/", 0, 4, 0, 100_000, true, :x => 1) }
+
+    # fully covered slices (from the hll file) and scanned slices
+    assert_in_delta 5_000, db.query().distinct_count(:uid), 250
+    assert_in_delta 1_000, db.query(:uid => 0..999).distinct_count(:uid), 50
+    assert_in_delta 1_001, db.query(:ts => 1).distinct_count(:v), 50
+
+    p50, p99 = db.query().quantiles(:v, 0.5, 0.99)
+    assert_in_delta 500, p50, 30
+    assert_in_delta 990, p99, 30
+    assert_equal [nil], db.query(:uid => 10_000).quantiles(:v, 0.5)
+
+    db.close
+  end
+
+  def test_query_sum
+    klass = RecordModel.define do |r|
+      r.key :uid, :uint64
+      r.key :ts, :timestamp
+      r.val :clicks, :uint32
+      r.val :cost, :double
+      r.val :tag, :hexstr, :size => 4
+    end
+
+    `rm -rf ./tmp.test/db`
+    `mkdir -p ./tmp.test/db`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 4, 0, 10_000, false) 
+
+    [0, 1, 2].each do |ts|
+      arr = klass.make_array(1_000)
+      1_000.times do |i|
+        arr << klass.new(:uid => i % 10, :ts => ts, :clicks => 2, :cost => 0.5)
+      end
+      db.put_bulk(arr)
+    end
+
+    # completely covered slices
+    sums, cnt = db.query().sum
+    assert_equal 3_000, cnt
+    assert_equal 6_000, sums.clicks
+    assert_equal 1_500.0, sums.cost
+    assert_equal 3_000, db.query(:ts => 0..1).count + db.query(:ts => 2).count
+
+    # partially covered slices
+    sums, cnt = db.query(:uid => 0..4, :ts => 1..2).sum
+    assert_equal 1_000, cnt
+    assert_equal 2_000, sums.clicks
+
+    # single group slices
+    agg = db.query().aggregate([:ts]).to_a.sort_by {|i| i.ts}
+    assert_equal [0, 1, 2], agg.map {|i| i.ts}
+    assert_equal [2_000] * 3, agg.map {|i| i.clicks}
+
+    db.close
+  end
+
+  def test_rollup
+    klass = RecordModel.define do |r|
+      r.key :campaign, :uint32
+      r.key :uid, :uint64
+      r.key :ts, :timestamp
+      r.val :clicks, :uint32
+    end
+
+    `rm -rf ./tmp.test/db ./tmp.test/rollup`
+    `mkdir -p ./tmp.test/db ./tmp.test/rollup`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 4, 0, 10_000, false) 
+    rollup = MMDB::DB.open(klass, "./tmp.test/rollup/", 0, 4, 0, 10_000, false) 
+    db.add_rollup(rollup, [:campaign, :ts], :ts => 3600)
+
+    2.times do
+      arr = klass.make_array(1_000)
+      1_000.times do |i|
+        arr << klass.new(:campaign => i % 3, :uid => i, :ts => i * 10, :clicks => 1)
+      end
+      db.put_bulk(arr)
+    end
+
+    assert_equal 2_000, db.query.count
+    assert_equal 18, rollup.query.count # 3 campaigns * 3 hours per put_bulk
+    assert_equal [0, 3600, 7200], rollup.query.to_a.map {|i| i.ts}.uniq.sort
+    assert_equal 2_000, rollup.query.aggregate([]).to_a.first.clicks
+
+    snap = db.snapshot
+    assert snap.rollup_for([:campaign], [{:ts => 0..7199}])
+    assert_nil snap.rollup_for([:campaign], [{:ts => 0..7000}])
+    assert_nil snap.rollup_for([:uid], [{}])
+    assert_nil snap.rollup_for([:ts], [{}])
+    assert_nil snap.rollup_for([:campaign], [{:uid => 1}])
+
+    # routed to the rollup
+    agg = db.query(:ts => 0..7199).aggregate([:campaign]).to_a.sort_by {|i| i.campaign}
+    assert_equal [0, 1, 2], agg.map {|i| i.campaign}
+    assert_equal 2 * 720, agg.map {|i| i.clicks}.inject(:+)
+
+    # same result on the raw data
+    raw = db.query(:ts => 0..7199).aggregate([:campaign, :ts]).to_a.group_by {|i| i.campaign}
+    assert_equal agg.map {|i| i.clicks}, raw.keys.sort.map {|c| raw[c].map {|i| i.clicks}.inject(:+)}
+
+    # filled slice by slice when added later
+    `rm -rf ./tmp.test/rollup2`
+    `mkdir -p ./tmp.test/rollup2`
+    rollup2 = MMDB::DB.open(klass, "./tmp.test/rollup2/", 0, 4, 0, 10_000, false)
+    db.add_rollup(rollup2, [:ts], :ts => 3600)
+    assert_equal 2, rollup2.get_snapshot_num
+    assert_equal 2_000, rollup2.query.aggregate([]).to_a.first.clicks
+    rollup2.close
+
+    # reopened with a rollup committed at another slice
+    db_state = db.commit
+    rollup.put_bulk(klass.make_array(1) << klass.new(:campaign => 0, :ts => 0, :clicks => 1))
+    rollup_state = rollup.commit
+    db.close
+    rollup.close
+    db = MMDB::DB.open(klass, "./tmp.test/db/", db_state[0], 4, db_state[1], 10_000, false)
+    rollup = MMDB::DB.open(klass, "./tmp.test/rollup/", rollup_state[0], 4, rollup_state[1], 10_000, false)
+    assert_equal [2, 3], [db.get_snapshot_num, rollup.get_snapshot_num]
+    assert_raise(RuntimeError) { db.add_rollup(rollup, [:campaign, :ts], :ts => 3600) }
+
+    # a failed rollup write leaves the rollup unused, not stale
+    rollup.close
+    rollup = MMDB::DB.open(klass, "./tmp.test/rollup/", 2, 4, 18, 10_000, false)
+    db.add_rollup(rollup, [:campaign, :ts], :ts => 3600)
+    assert db.snapshot.rollup_for([:campaign], [{}])
+    def rollup.put_bulk(arr) raise Errno::ENOSPC end
+    arr = klass.make_array(1) << klass.new(:campaign => 0, :ts => 0, :clicks => 1)
+    assert_raise(Errno::ENOSPC) { db.put_bulk(arr) }
+    assert_equal 3, db.get_snapshot_num
+    assert_nil db.snapshot.rollup_for([:campaign], [{}])
+    assert_equal 2_001, db.query.aggregate([:campaign]).to_a.map {|i| i.clicks}.inject(:+)
+
+    db.close
+    rollup.close
+  end
+
+  def test_ingest
+    klass = RecordModel.define do |r|
+      r.key :uid, :uint64
+      r.key :ts, :timestamp
+      r.val :v, :uint32
+    end
+    descr = [:uid, :ts, :v].map {|fld| klass.sym_to_fld_idx(fld)}
+
+    File.open("./tmp.test/ingest.txt", "w") do |f|
+      2_500.times do |i|
+        f.puts "#{(i * 7919) % 2_500} #{i} #{i % 10}"
+        f.puts "bad line" if i % 1_000 == 0
+      end
+    end
+
+    `rm -rf ./tmp.test/db ./tmp.test/rollup`
+    `mkdir -p ./tmp.test/db ./tmp.test/rollup`
+    db = MMDB::DB.open(klass, "./tmp.test/db/", 0, 4, 0, 10_000, false) 
+
+    stats = nil
+    AutoFileReader.open("./tmp.test/ingest.txt") {|reader|
+      stats = db.ingest(reader, descr, :threads => 2, :chunk_size => 256, :array_size => 1_000, :arrays => 2)
+    }
+    assert_equal [2_503, 2_500], stats[0, 2]
+    assert_equal 3, stats[2] + stats[3] # "bad line"
+
+    # sort on multiple threads, more slices in flight than sorters
+    AutoFileReader.open("./tmp.test/ingest.txt") {|reader|
+      stats = db.ingest(reader, descr, :array_size => 300, :arrays => 4, :sorters => 2)
+    }
+    assert_equal [2_503, 2_500], stats[0, 2]
+    assert_equal 3, stats[2] + stats[3] # "bad line"
+
+    # the slices are stored in input order, no matter which sorter was first
+    arr = klass.make_array(300)
+    9.times do |s|
+      arr.reset
+      assert db.snapshot.slice_into(3 + s, arr)
+      assert_equal (s * 300 ... [(s + 1) * 300, 2_500].min).map {|i| i * 1000}, arr.map {|i| i.ts}.sort
+    end
+
+    assert_equal 2 * 2_500, db.query.count
+    assert_equal 3 + 9, db.snapshot.slices.size
+    assert_equal [1, 1], db.query(:uid => 7919 % 2_500).to_a.map {|i| i.v}
+    assert_equal 2 * 2_500 * 9 / 2, db.query.to_a.map {|i| i.v}.inject(:+)
+
+    # each slice is sorted
+    uids = db.query.to_a.map {|i| i.uid}
+    assert_equal uids.first(1_000).sort, uids.first(1_000)
+
+    # combined within each array: uid is unique, but not (uid, ts) when truncated
+    `rm -rf ./tmp.test/db2`
+    `mkdir -p ./tmp.test/db2`
+    db2 = MMDB::DB.open(klass, "./tmp.test/db2/", 0, 4, 0, 10_000, false) 
+    File.write("./tmp.test/ingest2.txt", "1 10 1\n2 10 1\n1 10 5\n")
+    AutoFileReader.open("./tmp.test/ingest2.txt") {|reader|
+      db2.ingest(reader, descr, :combine => true)
+    }
+    assert_equal [[1, 6], [2, 1]], db2.query.to_a.map {|i| [i.uid, i.v]}
+    db2.close
+    File.delete("./tmp.test/ingest2.txt")
+
+    rollup = MMDB::DB.open(klass, "./tmp.test/rollup/", 0, 4, 0, 10_000, false) 
+    db.add_rollup(rollup, [:ts])
+    assert_raise(ArgumentError) {
+      AutoFileReader.open("./tmp.test/ingest.txt") {|reader| db.ingest(reader, descr)}
+    }
+
+    db.close
+    rollup.close
+    File.delete("./tmp.test/ingest.txt")
+  end
+
 end
@@ -1,8 +1,10 @@
 require 'test/unit'
+require 'zlib'
 
 $LOAD_PATH << "../ext/RecordModel" 
 $LOAD_PATH << "../lib" 
 require 'RecordModel/RecordModel'
+require 'RecordModel/AutoFileReader'
 
 class TestRecordModel < Test::Unit::TestCase
 
@@ -41,6 +43,29 @@ class TestRecordModel < Test::Unit::TestCase
     assert_equal 10000_999, item.g
   end
 
+  def test_parse_line_long_tokens
+    k = RecordModel.define do |r|
+      r.key :a, :uint64
+      r.key :s, :string, :size => 64
+      r.val :b, :uint32
+    end
+    fields = [:a, :s, :b].map {|fld| k.sym_to_fld_idx(fld)}
+
+    # tokens crossing 16 and 32 byte blocks at every possible offset
+    (0..40).each do |pad|
+      s = "x" * (pad + 1)
+      item = k.new
+      assert_equal 3, item.parse_line(" \t" * pad + "12\t#{s} \v\r 7" + " " * pad, fields, " ")
+      assert_equal [12, s, 7], [item.a, item.s.unpack("Z*").first, item.b]
+
+      item = k.new
+      assert_equal 3, item.parse_line("12;#{s};7", fields, ";")
+      assert_equal [12, s, 7], [item.a, item.s.unpack("Z*").first, item.b]
+      assert_equal 4, item.parse_line("12;#{s};7;" + "y" * pad + "1", fields, ";")
+      assert_equal 1, item.parse_line("12;;7", fields, ";")
+    end
+  end
+
   def test_model_size
     assert_equal(91, @klass.model.size)
   end
@@ -150,6 +175,33 @@ class TestRecordModel < Test::Unit::TestCase
       from_string(rec, i, 1999123, "1999.1234")
     end
 
+    from_string(rec, :d, 12345678, "12345678")
+    from_string(rec, :d, 1234567890123456789, "1234567890123456789")
+    from_string(rec, :d, 10000000000000001, "10000000000000001")
+    from_string(rec, :d, RuntimeError, "1234567a90123456")
+    from_string(rec, :d, RuntimeError, "12345678/")
+
+    for i in [:g, :h]
+      from_string(rec, i, 1234567890123456, "1234567890123.4567891")
+      from_string(rec, i, 12000, "12.")
+      from_string(rec, i, RuntimeError, "1.2.3")
+      from_string(rec, i, RuntimeError, "1.2345x")
+
+      from_string(rec, i, 0, "1970-01-01T00:00:00Z")
+      from_string(rec, i, Time.utc(2013, 3, 1, 12, 34, 56).to_i * 1000 + 789, "2013-03-01T12:34:56.789Z")
+      from_string(rec, i, Time.utc(2013, 3, 1, 12, 34, 56).to_i * 1000 + 500, "2013-03-01 12:34:56.5")
+      from_string(rec, i, Time.utc(2000, 2, 29, 22, 4, 5).to_i * 1000, "2000-03-01T00:04:05+02:00")
+      from_string(rec, i, Time.utc(2099, 12, 31, 23, 59, 59).to_i * 1000 + 123, "2099-12-31T23:59:59.123456-00:00")
+      from_string(rec, i, RuntimeError, "2013-13-01T12:34:56Z")
+      from_string(rec, i, RuntimeError, "2013-02-31T12:34:56Z")
+      from_string(rec, i, RuntimeError, "2013-02-29T12:34:56Z")
+      from_string(rec, i, RuntimeError, "1900-02-29T12:34:56Z")
+      from_string(rec, i, RuntimeError, "2013-04-31T12:34:56Z")
+      from_string(rec, i, Time.utc(2012, 2, 29).to_i * 1000, "2012-02-29T00:00:00Z")
+      from_string(rec, i, RuntimeError, "2013-03-01T12:34:56X")
+      from_string(rec, i, RuntimeError, "1969-12-31T23:59:59Z")
+    end
+
     from_string(rec, :s, 'abcdefgh' + "\000"*(32-8), 'abcdefgh') 
     from_string(rec, :s, 'a' + "\000"*31, 'a') 
 
@@ -170,4 +222,488 @@ class TestRecordModel < Test::Unit::TestCase
     end
   end
 
+  def test_bulk_parse_line_parallel
+    k = RecordModel.define do |r|
+      r.key :a, :uint64
+      r.val :b, :uint32
+    end
+    fields = [:a, :b].map {|fld| k.sym_to_fld_idx(fld)}
+
+    expected = []
+    File.open("./bulk_parse.txt", "w") do |f|
+      1_000.times do |i|
+        case i % 10
+        when 3 then f.puts "#{i} xyz"  # parse error
+        when 7 then f.puts "#{i}"      # too few tokens
+        else
+          f.puts "#{i} #{i * 2}"
+          expected << [i, i * 2]
+        end
+      end
+      f.print "1000 2000" # no trailing newline
+      expected << [1000, 2000]
+    end
+
+    [[1, 64], [3, 64], [4, 1000], [2, 1 << 20]].each do |threads, chunk_size|
+      got, lines_read, stats_total = [], 0, [0, 0, 0, 0]
+      AutoFileReader.open("./bulk_parse.txt") do |reader|
+        more = true
+        while more
+          # a small array, so that it fills up in the middle of a block
+          arr = k.make_array(77, false)
+          more, lread, stats = arr.bulk_parse_line_parallel(reader, fields, " ", chunk_size, 2, 2, threads)
+          assert_equal threads, stats.size
+          lines_read += lread
+          stats.each {|st| st.each_with_index {|v, i| stats_total[i] += v}}
+          arr.each {|rec| got << [rec.a, rec.b]}
+        end
+      end
+      assert_equal expected, got
+      assert_equal 1_001, lines_read
+      assert_equal [1_001, expected.size, 100, 100], stats_total
+    end
+
+    # the sequential version continues after the last stored line as well
+    got = []
+    AutoFileReader.open("./bulk_parse.txt") do |reader|
+      more = true
+      while more
+        arr = k.make_array(77, false)
+        more, _ = arr.bulk_parse_line(k.new, reader, fields, " ", 4096, true, true, 2, 2)
+        arr.each {|rec| got << [rec.a, rec.b]}
+      end
+    end
+    assert_equal expected, got
+  ensure
+    File.unlink("./bulk_parse.txt") if File.exist?("./bulk_parse.txt")
+  end
+
+  def test_bulk_parse_line_mmap
+    k = RecordModel.define do |r|
+      r.key :a, :uint64
+      r.val :b, :uint32
+    end
+    fields = [:a, :b].map {|fld| k.sym_to_fld_idx(fld)}
+
+    # exactly one page, last line unterminated. plain files are memory mapped,
+    # gzip files are read through the copying path.
+    data = ""
+    i = 0
+    while data.size < 4096 - 20
+      data << "#{i} #{i + 1}\n"
+      i += 1
+    end
+    data << "#{i} "
+    data << ("0" * (4095 - data.size)) << "1"
+    assert_equal 4096, data.size
+    lines = data.split("\n").map {|l| l.split(" ").map(&:to_i)}
+
+    ["", "\n"].each do |trailer|
+      File.write("./bulk_parse.txt", data + trailer)
+      Zlib::GzipWriter.open("./bulk_parse.txt.gz") {|gz| gz.write(data + trailer)}
+
+      ["./bulk_parse.txt", "./bulk_parse.txt.gz"].each do |path|
+        [false, true].each do |parallel|
+          got, lines_read = [], 0
+          AutoFileReader.open(path) do |reader|
+            more = true
+            while more
+              arr = k.make_array(100, false)
+              if parallel
+                more, lread, _ = arr.bulk_parse_line_parallel(reader, fields, " ", 1000, 2, 2, 2)
+              else
+                more, lread = arr.bulk_parse_line(k.new, reader, fields, " ", 4096, true, true, 2, 2)
+              end
+              lines_read += lread
+              arr.each {|rec| got << [rec.a, rec.b]}
+            end
+          end
+          assert_equal lines.size, lines_read, path
+          assert_equal lines, got, path
+        end
+      end
+    end
+  ensure
+    ["./bulk_parse.txt", "./bulk_parse.txt.gz"].each {|f| File.unlink(f) if File.exist?(f)}
+  end
+
+  def test_bulk_parse_line_async_spans
+    k = RecordModel.define do |r|
+      r.key :a, :uint64
+      r.val :b, :uint32
+    end
+    fields = [:a, :b].map {|fld| k.sym_to_fld_idx(fld)}
+
+    # several 1 MB blocks of the async reader, lines crossing their ends
+    data = (0 ... 250_000).map {|i| "#{i * 7} #{i % 1000}\n"}.join
+    lines = data.split("\n").map {|l| l.split(" ").map(&:to_i)}
+    File.write("./bulk_parse.txt", data.chomp)
+
+    [false, true].each do |parallel|
+      got, lines_read = [], 0
+      AutoFileReader.open("./bulk_parse.txt", 2**16, true) do |reader|
+        more = true
+        while more
+          arr = k.make_array(70_000, false)
+          if parallel
+            more, lread, _ = arr.bulk_parse_line_parallel(reader, fields, " ", 100_000, 2, 2, 3)
+          else
+            more, lread = arr.bulk_parse_line(k.new, reader, fields, " ", 4096, true, true, 2, 2)
+          end
+          lines_read += lread
+          arr.each {|rec| got << [rec.a, rec.b]}
+        end
+      end
+      assert_equal lines.size, lines_read
+      assert_equal lines, got
+    end
+  ensure
+    File.unlink("./bulk_parse.txt") if File.exist?("./bulk_parse.txt")
+  end
+
+  def test_bulk_parse_line_csv
+    k = RecordModel.define do |r|
+      r.key :a, :uint64
+      r.val :s, :string, :size => 16
+      r.val :b, :uint32, :default => 7
+    end
+    fields = [:a, :s, :b].map {|fld| k.sym_to_fld_idx(fld)}
+
+    File.write("./bulk_parse.csv",
+      %{1,plain,2\r\n} +
+      %{2,"with,sep",3\n} +
+      %{3,"say ""hi""",4\n} +
+      %{4,"",\n} +            # empty fields keep their default
+      %{5,"open,6\n} +        # not terminated
+      %{6,"x"y,7\n} +         # garbage behind the closing quote
+      %{"7",mid"quote,8})
+
+    expected = [[1, "plain", 2], [2, "with,sep", 3], [3, 'say "hi"', 4], [4, "", 7], [7, 'mid"quote', 8]]
+
+    [false, true].each do |parallel|
+      arr = k.make_array(10, false)
+      AutoFileReader.open("./bulk_parse.csv") do |reader|
+        if parallel
+          _, lines_read, stats = arr.bulk_parse_line_parallel(reader, fields, {:sep => ","}, 64, 3, 3, 2)
+          assert_equal 7, lines_read
+          assert_equal 2, stats.map {|st| st[2]}.inject(:+) # parse errors
+        else
+          errors = []
+          _, lines_read = arr.bulk_parse_line(k.new, reader, fields, {:sep => ","}, 4096, false, true, 3, 3) {|n, err, rec|
+            errors << err; false
+          }
+          assert_equal 7, lines_read
+          assert_equal [30, 30], errors
+        end
+      end
+      assert_equal expected, arr.map {|rec| [rec.a, rec.s.unpack("Z*").first, rec.b]}
+    end
+
+    # a backslash as escape character
+    File.write("./bulk_parse.csv", %{1;"a\\"b;c";2\n})
+    arr = k.make_array(10, false)
+    AutoFileReader.open("./bulk_parse.csv") do |reader|
+      arr.bulk_parse_line(k.new, reader, fields, {:sep => ";", :escape => "\\"}, 4096, true, true, 3, 3)
+    end
+    assert_equal [[1, 'a"b;c', 2]], arr.map {|rec| [rec.a, rec.s.unpack("Z*").first, rec.b]}
+  ensure
+    File.unlink("./bulk_parse.csv") if File.exist?("./bulk_parse.csv")
+  end
+
+  def test_bulk_parse_line_json
+    k = RecordModel.define do |r|
+      r.key :a, :uint64
+      r.val :s, :string, :size => 16
+      r.val :b, :uint32, :default => 7
+      r.val :t, :timestamp
+    end
+    descr = k.def_json_descr(:a, :s, "bb" => :b, "ts" => :t)
+
+    File.write("./bulk_parse.jsonl", [
+      '{"a": 1, "s": "plain", "bb": 2, "ts": 1000}',
+      ' {"ignored": {"x": [1, "}"]}, "ts":"2012-01-01T00:00:01Z","s":"q\\"\\u00e4\\ud83d\\ude00","a":2,"bb":null} ',
+      '{"a": 3, "s": "x", "bb": true, "ts": 1}',
+      '{"a": 4, "s": "x", "bb": "y", "ts": 1}',     # parse error
+      '{"a": 5, "s": "x", "bb": 1, "ts": 1},',      # malformed
+      '{"a": 6, "s": "missing"}',                   # too few members
+      '{, "a": 8, "s": "x", "bb": 1, "ts": 1}',     # malformed: leading comma
+      '{"a": 9, "s": "\\udc00", "bb": 1, "ts": 1}', # malformed: lone low surrogate
+      '{"a": 7, "s": "unterminated}',
+    ].join("\n"))
+
+    # numeric timestamps are seconds
+    expected = [[1, "plain", 2, 1_000_000], [2, "q\"\u00e4\u{1F600}".b, 7, 1325376001000], [3, "x", 1, 1000]]
+
+    [false, true].each do |parallel|
+      arr = k.make_array(10, false)
+      AutoFileReader.open("./bulk_parse.jsonl") do |reader|
+        if parallel
+          _, lines_read, stats = arr.bulk_parse_line_parallel(reader, descr, nil, 64, 4, -1, 2)
+          assert_equal [9, 3, 5, 1], stats.transpose.map {|c| c.inject(:+)}
+        else
+          errors = []
+          _, lines_read = arr.bulk_parse_line(k.new, reader, descr, nil, 4096, false, true, 4, -1) {|n, err, rec|
+            errors << err; false
+          }
+          assert_equal [2, 31, 31, 31, 31], errors
+        end
+      end
+      assert_equal expected, arr.map {|rec| [rec.a, rec.s.unpack("Z*").first, rec.b, rec.t]}
+    end
+  ensure
+    File.unlink("./bulk_parse.jsonl") if File.exist?("./bulk_parse.jsonl")
+  end
+
+  def test_bulk_parse_line_skip_columns
+    k = RecordModel.define do |r|
+      r.key :a, :uint64
+      r.val :b, :uint32
+      r.val :c, :uint32, :default => 42
+    end
+    fields = k.def_parse_descr(:a, nil, nil, :b)
+
+    File.write("./bulk_parse.txt", "1 x y 2\n3 x y\n4 x y z\n5 6 7 8 9\n")
+    [false, true].each do |parallel|
+      arr = k.make_array(10, false)
+      AutoFileReader.open("./bulk_parse.txt") do |reader|
+        if parallel
+          arr.bulk_parse_line_parallel(reader, fields, " ", 16, 4, 4, 2)
+        else
+          arr.bulk_parse_line(k.new, reader, fields, " ", 4096, true, true, 4, 4)
+        end
+      end
+      assert_equal [[1, 2, 42]], arr.map {|rec| [rec.a, rec.b, rec.c]}
+    end
+  ensure
+    File.unlink("./bulk_parse.txt") if File.exist?("./bulk_parse.txt")
+  end
+
+  def test_combine
+    k = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.key :b, :uint16
+      r.val :n, :uint32
+      r.val :x, :double
+    end
+
+    arr = k.make_array(8, false)
+    [[2, 1, 1, 0.5], [1, 1, 2, 1.0], [2, 1, 3, 0.25], [1, 2, 4, 2.0]].each {|a, b, n, x|
+      arr << k.new(:a => a, :b => b, :n => n, :x => x)
+    }
+    assert_same arr, arr.combine!
+    assert_equal [[1, 1, 2, 1.0], [1, 2, 4, 2.0], [2, 1, 4, 0.75]], arr.map {|r| [r.a, r.b, r.n, r.x]}
+    assert_equal 8, arr.capacity
+
+    # still usable afterwards
+    arr << k.new(:a => 0, :b => 0, :n => 1)
+    arr << k.new(:a => 2, :b => 1, :n => 1)
+    arr.combine!
+    assert_equal [[0, 0, 1], [1, 1, 2], [1, 2, 4], [2, 1, 5]], arr.map {|r| [r.a, r.b, r.n]}
+
+    empty = k.make_array(4)
+    assert_equal 0, empty.combine!.size
+  end
+
+  def test_column_operations
+    k = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.key :t, :timestamp_desc
+      r.key :s, :hexstr, :size => 2
+      r.val :n, :uint16
+      r.val :x, :double
+    end
+
+    arr = k.make_array(8)
+    10.times {|i| arr << k.new(:a => i, :t => i % 3, :s => "%04X" % (i % 4), :n => i * 10, :x => i * 0.5)}
+
+    assert_equal 450.0, arr.column_sum(:n)
+    assert_equal 22.5, arr.column_sum(:x)
+    assert_raise(ArgumentError) { arr.column_sum(:s) }
+    assert_equal 0, arr.column_min(:n)
+    assert_equal 90, arr.column_max(:n)
+    assert_equal 4.5, arr.column_max(:x)
+    assert_equal 2, arr.column_min(:t)   # descending order
+    assert_equal "0000", arr.column_min(:s)
+    assert_equal "0003", arr.column_max(:s)
+    assert_nil k.make_array(8).column_min(:n)
+
+    assert_equal 10, arr.column_count(:n)
+    assert_equal 4, arr.column_count(:n, 20..50)
+    assert_equal 5, arr.column_count(:x, 1.0..3.0)
+    assert_equal 3, arr.column_count(:s, "0001".."0001")
+    assert_raise(ArgumentError) { arr.column_count(:n, 20...50) }
+
+    arr.sort([:t, :a])
+    filtered = arr.column_filter(:a, 3..6)
+    assert_equal [5, 4, 3, 6], filtered.map {|r| r.a}
+    assert_equal 10, arr.size
+    arr.sort([:a])
+
+    assert_equal({0 => 4, 1 => 3, 2 => 3}, arr.column_histogram(:t))
+    assert_equal({"0000" => 3, "0001" => 3, "0002" => 2, "0003" => 2}, arr.column_histogram(:s))
+    assert_equal({}, k.make_array(8).column_histogram(:n))
+    nans = k.make_array(8)
+    [1.0, 0.0 / 0.0, 0.5, 1.0, -(0.0 / 0.0)].each {|x| nans << k.new(:x => x)}
+    hist = nans.column_histogram(:x)
+    assert_equal [[0.5, 1], [1.0, 2]], hist.reject {|x, c| x.nan?}.sort
+    assert_equal [2], hist.select {|x, c| x.nan?}.values
+
+    arr.column_scale!(:n, 1.5)
+    assert_equal [0, 15, 30, 45], arr.first(4).map {|r| r.n}
+    arr.column_scale!(:n, 10_000)
+    assert_equal 65535, arr.column_max(:n)
+    arr.column_add!(:x, -0.5)
+    assert_equal [-0.5, 0.0, 0.5], arr.first(3).map {|r| r.x}
+    assert_raise(ArgumentError) { arr.column_add!(:s, "0001") }
+  end
+
+  def test_join
+    clicks = RecordModel.define do |r|
+      r.key :uid, :uint64
+      r.key :ts, :timestamp
+      r.val :campaign, :uint32
+    end
+    convs = RecordModel.define do |r|
+      r.key :user, :uint64
+      r.key :ts, :timestamp
+      r.val :amount, :double
+    end
+    joined = RecordModel.define do |r|
+      r.key :uid, :uint64
+      r.key :campaign, :uint32
+      r.val :amount, :double
+      r.val :conv_ts, :timestamp
+    end
+
+    l = clicks.make_array(8)
+    r = convs.make_array(8)
+    1000.times {|i| l << clicks.new(:uid => i % 100, :ts => i, :campaign => i % 3)}
+    300.times {|i| r << convs.new(:user => (i * 7) % 150, :ts => i, :amount => 1.0)}
+    l.sort([:uid])
+
+    out = joined.make_array(8)
+    assert_raise(ArgumentError) { l.join(r, {:uid => :user}, out) }
+    assert_equal 0, out.size
+    r.sort([:user])
+
+    expected = []
+    l.each {|c| r.each {|v| expected << [c.uid, c.campaign, v.amount, v.ts] if c.uid == v.user}}
+
+    pairs = l.join(r, {:uid => :user}, out, :fields => {:conv_ts => [:right, :ts]})
+    assert_equal expected.size, pairs
+    assert_equal expected.sort, out.map {|o| [o.uid, o.campaign, o.amount, o.conv_ts]}.sort
+
+    out4 = joined.make_array(8)
+    l.join(r, {:uid => :user}, out4, :threads => 4, :fields => {:conv_ts => [:right, :ts]})
+    assert_equal out.map {|o| o.to_hash}, out4.map {|o| o.to_hash}
+
+    combined = joined.make_array(8)
+    assert_equal pairs, l.join(r, {:uid => :user}, combined, :threads => 3, :combine => true)
+    sums = Hash.new(0.0)
+    expected.each {|uid, campaign, amount, ts| sums[[uid, campaign]] += amount}
+    assert_equal sums.sort, combined.map {|o| [[o.uid, o.campaign], o.amount]}
+
+    assert_raise(ArgumentError) { l.join(r, {:ts => :user}, out) }
+    assert_raise(ArgumentError) { l.join(r, {:uid => :amount}, out) }
+  end
+
+  def test_column_array
+    k = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.key :s, :hexstr, :size => 4
+      r.val :n, :uint16
+      r.val :x, :double
+    end
+
+    arr = k.make_column_array(2)
+    [[3, "ab", 1, 0.5], [1, "ff", 2, 1.5], [3, "01", 3, 2.5]].each {|a, s, n, x|
+      arr << k.new(:a => a, :s => s, :n => n, :x => x)
+    }
+    assert_equal 3, arr.size
+    assert arr.capacity >= 3
+    assert_equal [[3, "000000AB", 1], [1, "000000FF", 2], [3, "00000001", 3]], arr.map {|r| [r.a, r.s, r.n]}
+
+    arr.sort
+    assert_equal [[1, "000000FF"], [3, "00000001"], [3, "000000AB"]], arr.map {|r| [r.a, r.s]}
+    arr.sort([:n])
+    assert_equal [1, 2, 3], arr.map {|r| r.n}
+
+    arr.bulk_set(:x, 4.0)
+    assert_equal [4.0, 4.0, 4.0], arr.map {|r| r.x}
+
+    arr.reset
+    assert arr.empty?
+    assert_raise(ArgumentError) { arr << RecordModel.define {|r| r.key :z, :uint8}.new }
+
+    fixed = k.make_column_array(8, false)
+    8.times {|i| fixed << k.new(:a => i)}
+    assert fixed.full?
+    assert_raise(ArgumentError) { fixed << k.new }
+  end
+
+  def test_each_dup
+    k = RecordModel.define do |r|
+      r.key :a, :uint32
+      r.val :n, :uint32
+    end
+
+    arr = k.make_array(8)
+    100.times {|i| arr << k.new(:a => i, :n => i * 2)}
+
+    recs = arr.to_a
+    assert_equal 100, recs.map {|r| r.object_id}.uniq.size
+    assert_equal (0...100).map {|i| [i, i * 2]}, recs.map {|r| [r.a, r.n]}
+    recs.first.n = 1_000
+    assert_equal 0, arr.first.n
+
+    # blocks are reused after being freed. each round allocates 20_000
+    # blocks (of 48 bytes), without reuse the pools would grow by all of them.
+    big = k.make_array(10_000)
+    10_000.times {|i| big << k.new(:a => i, :n => i)}
+    GC.start
+    before = RecordModel.slab_bytes
+    10.times do
+      big.each {|r| r.dup}
+      GC.start
+    end
+    assert RecordModel.slab_bytes - before < 2 * 20_000 * 48
+    assert_equal (0...100).map {|i| i * 2}.inject(:+), arr.map {|r| r.n}.inject(:+)
+  end
+
+  def test_large_array_growth
+    k = RecordModel.define do |r|
+      r.key :a, :uint64
+      r.val :b, :uint64
+      r.val :c, :uint64
+      r.val :d, :uint64
+      r.val :e, :uint64
+      r.val :f, :uint64
+    end
+
+    # grows past RecordModelInstanceArray::MMAP_THRESHOLD (remapped from there on)
+    n = 150_000
+    arr = k.make_array(16)
+    rec = k.new
+    n.times {|i| rec.a = n - i; rec.b = i; arr << rec}
+    assert_equal n, arr.size
+
+    arr.sort
+    arr << k.new(:a => 0, :b => n)
+    assert_equal [[1, n - 1], [2, n - 2]], arr.first(2).map {|r| [r.a, r.b]}
+    assert_equal [0, n], [arr.to_a.last.a, arr.to_a.last.b]
+    assert_equal (0..n).inject(:+), arr.map {|r| r.b}.inject(:+)
+
+    arr.combine!
+    assert_equal n + 1, arr.size
+    assert_equal [0, n], [arr.first.a, arr.first.b]
+
+    # an expandable array uses the whole mapping (rounded up to 2 MB), a
+    # fixed one exactly the requested capacity
+    assert_equal (6 << 20) / 48, k.make_array(100_000).capacity
+    fixed = k.make_array(100_000, false)
+    assert_equal 100_000, fixed.capacity
+    fixed.capacity.times {|i| rec.a = i; fixed << rec}
+    assert fixed.full?
+  end
+
 end